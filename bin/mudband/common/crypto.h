@@ -12,6 +12,8 @@
     blake2s_init(ctx,outlen,key,keylen)
 #define wireguard_blake2s_update(ctx,in,inlen) \
     blake2s_update(ctx,in,inlen)
+#define wireguard_blake2s_flush(ctx) \
+    blake2s_flush(ctx)
 #define wireguard_blake2s_final(ctx,out) \
     blake2s_final(ctx,out)
 #define wireguard_blake2s(out,outlen,key,keylen,in,inlen) \
@@ -1,5 +1,7 @@
 // Taken from RFC7693 - https://tools.ietf.org/html/rfc7693
 
+#include <string.h>
+
 #include "blake2s.h"
 #include "crypto.h"
 
@@ -27,21 +29,24 @@ static const uint32_t blake2s_iv[8] =
 	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
 };
 
+// Message schedule.
+static const uint8_t blake2s_sigma[10][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+	{ 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+	{ 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+	{ 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+	{ 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+	{ 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+	{ 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+	{ 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+	{ 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 }
+};
+
 // Compression function. "last" flag indicates last block.
-static void blake2s_compress(blake2s_ctx *ctx, int last)
+static void blake2s_compress_generic(blake2s_ctx *ctx, int last)
 {
-	const uint8_t sigma[10][16] = {
-		{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
-		{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
-		{ 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
-		{ 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
-		{ 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
-		{ 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
-		{ 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
-		{ 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
-		{ 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
-		{ 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 }
-	};
+	const uint8_t *s;
 	int i;
 	uint32_t v[16], m[16];
 
@@ -58,20 +63,167 @@ static void blake2s_compress(blake2s_ctx *ctx, int last)
 		m[i] = U8TO32_LITTLE(&ctx->b[4 * i]);
 
 	for (i = 0; i < 10; i++) {          // ten rounds
-		B2S_G( 0, 4,  8, 12, m[sigma[i][ 0]], m[sigma[i][ 1]]);
-		B2S_G( 1, 5,  9, 13, m[sigma[i][ 2]], m[sigma[i][ 3]]);
-		B2S_G( 2, 6, 10, 14, m[sigma[i][ 4]], m[sigma[i][ 5]]);
-		B2S_G( 3, 7, 11, 15, m[sigma[i][ 6]], m[sigma[i][ 7]]);
-		B2S_G( 0, 5, 10, 15, m[sigma[i][ 8]], m[sigma[i][ 9]]);
-		B2S_G( 1, 6, 11, 12, m[sigma[i][10]], m[sigma[i][11]]);
-		B2S_G( 2, 7,  8, 13, m[sigma[i][12]], m[sigma[i][13]]);
-		B2S_G( 3, 4,  9, 14, m[sigma[i][14]], m[sigma[i][15]]);
+		s = blake2s_sigma[i];
+		B2S_G( 0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+		B2S_G( 1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+		B2S_G( 2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+		B2S_G( 3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+		B2S_G( 0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+		B2S_G( 1, 6, 11, 12, m[s[10]], m[s[11]]);
+		B2S_G( 2, 7,  8, 13, m[s[12]], m[s[13]]);
+		B2S_G( 3, 4,  9, 14, m[s[14]], m[s[15]]);
 	}
 
 	for( i = 0; i < 8; ++i )
 		ctx->h[i] ^= v[i] ^ v[i + 8];
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLAKE2S_HAVE_SIMD
+#include <immintrin.h>
+
+// One row-wise G step on all four columns (or diagonals) at once.
+// Rotations by 16 and 8 are byte shuffles, 12 and 7 are shift pairs.
+#define B2S_G4(r1, r2, r3, r4, mx, my) {                              \
+	r1 = _mm_add_epi32(_mm_add_epi32(r1, r2), mx);                 \
+	r4 = _mm_shuffle_epi8(_mm_xor_si128(r4, r1), rot16);           \
+	r3 = _mm_add_epi32(r3, r4);                                    \
+	r2 = _mm_xor_si128(r2, r3);                                    \
+	r2 = _mm_or_si128(_mm_srli_epi32(r2, 12), _mm_slli_epi32(r2, 20)); \
+	r1 = _mm_add_epi32(_mm_add_epi32(r1, r2), my);                 \
+	r4 = _mm_shuffle_epi8(_mm_xor_si128(r4, r1), rot8);            \
+	r3 = _mm_add_epi32(r3, r4);                                    \
+	r2 = _mm_xor_si128(r2, r3);                                    \
+	r2 = _mm_or_si128(_mm_srli_epi32(r2, 7), _mm_slli_epi32(r2, 25)); }
+
+static inline __attribute__((always_inline, target("sse4.1"))) void
+blake2s_compress_rows(blake2s_ctx *ctx, int last)
+{
+	const __m128i rot16 = _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5,
+	    10, 11, 8, 9, 14, 15, 12, 13);
+	const __m128i rot8 = _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4,
+	    9, 10, 11, 8, 13, 14, 15, 12);
+	const uint8_t *s;
+	__m128i r1, r2, r3, r4, h1, h2;
+	uint32_t m[16];
+	int i;
+
+	memcpy(m, ctx->b, sizeof(m));       // x86 is little-endian
+	h1 = r1 = _mm_loadu_si128((const __m128i *)(const void *)&ctx->h[0]);
+	h2 = r2 = _mm_loadu_si128((const __m128i *)(const void *)&ctx->h[4]);
+	r3 = _mm_setr_epi32(blake2s_iv[0], blake2s_iv[1], blake2s_iv[2],
+	    blake2s_iv[3]);
+	r4 = _mm_setr_epi32(blake2s_iv[4] ^ ctx->t[0],
+	    blake2s_iv[5] ^ ctx->t[1], last ? ~blake2s_iv[6] : blake2s_iv[6],
+	    blake2s_iv[7]);
+
+	for (i = 0; i < 10; i++) {
+		s = blake2s_sigma[i];
+		// columns
+		B2S_G4(r1, r2, r3, r4,
+		    _mm_setr_epi32(m[s[0]], m[s[2]], m[s[4]], m[s[6]]),
+		    _mm_setr_epi32(m[s[1]], m[s[3]], m[s[5]], m[s[7]]));
+		// diagonalize
+		r2 = _mm_shuffle_epi32(r2, _MM_SHUFFLE(0, 3, 2, 1));
+		r3 = _mm_shuffle_epi32(r3, _MM_SHUFFLE(1, 0, 3, 2));
+		r4 = _mm_shuffle_epi32(r4, _MM_SHUFFLE(2, 1, 0, 3));
+		B2S_G4(r1, r2, r3, r4,
+		    _mm_setr_epi32(m[s[8]], m[s[10]], m[s[12]], m[s[14]]),
+		    _mm_setr_epi32(m[s[9]], m[s[11]], m[s[13]], m[s[15]]));
+		// undiagonalize
+		r2 = _mm_shuffle_epi32(r2, _MM_SHUFFLE(2, 1, 0, 3));
+		r3 = _mm_shuffle_epi32(r3, _MM_SHUFFLE(1, 0, 3, 2));
+		r4 = _mm_shuffle_epi32(r4, _MM_SHUFFLE(0, 3, 2, 1));
+	}
+
+	h1 = _mm_xor_si128(h1, _mm_xor_si128(r1, r3));
+	h2 = _mm_xor_si128(h2, _mm_xor_si128(r2, r4));
+	_mm_storeu_si128((__m128i *)(void *)&ctx->h[0], h1);
+	_mm_storeu_si128((__m128i *)(void *)&ctx->h[4], h2);
+}
+
+static __attribute__((target("sse4.1"))) void
+blake2s_compress_sse41(blake2s_ctx *ctx, int last)
+{
+
+	blake2s_compress_rows(ctx, last);
+}
+
+// Same code; the VEX encoding drops the register copies SSE needs.
+static __attribute__((target("avx"))) void
+blake2s_compress_avx(blake2s_ctx *ctx, int last)
+{
+
+	blake2s_compress_rows(ctx, last);
+}
+
+static void blake2s_compress_resolve(blake2s_ctx *ctx, int last);
+
+static void (*blake2s_compress_fn)(blake2s_ctx *, int) =
+    blake2s_compress_resolve;
+
+// Picks the implementation on first use. Racing threads store the
+// same pointer so no locking is needed.
+static void blake2s_compress_resolve(blake2s_ctx *ctx, int last)
+{
+	void (*fn)(blake2s_ctx *, int) = blake2s_compress_generic;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx"))
+		fn = blake2s_compress_avx;
+	else if (__builtin_cpu_supports("sse4.1"))
+		fn = blake2s_compress_sse41;
+	blake2s_compress_fn = fn;
+	fn(ctx, last);
+}
+
+#define blake2s_compress(ctx, last)	blake2s_compress_fn(ctx, last)
+#else
+#define blake2s_compress(ctx, last)	blake2s_compress_generic(ctx, last)
+#endif
+
+// Name of the compression function in use, for diagnostics.
+const char *blake2s_impl(void)
+{
+#ifdef BLAKE2S_HAVE_SIMD
+	blake2s_ctx ctx;
+
+	if (blake2s_compress_fn == blake2s_compress_resolve) {
+		memset(&ctx, 0, sizeof(ctx));
+		blake2s_compress_resolve(&ctx, 0);
+	}
+	if (blake2s_compress_fn == blake2s_compress_avx)
+		return "avx";
+	if (blake2s_compress_fn == blake2s_compress_sse41)
+		return "sse4.1";
+#endif
+	return "generic";
+}
+
+// Force a compression function by name, e.g. for benchmarking. Returns
+//      -1 if it isn't built in or the CPU lacks it.
+int blake2s_impl_set(const char *name)
+{
+	if (strcmp(name, "generic") == 0) {
+#ifdef BLAKE2S_HAVE_SIMD
+		blake2s_compress_fn = blake2s_compress_generic;
+#endif
+		return 0;
+	}
+#ifdef BLAKE2S_HAVE_SIMD
+	__builtin_cpu_init();
+	if (strcmp(name, "avx") == 0 && __builtin_cpu_supports("avx")) {
+		blake2s_compress_fn = blake2s_compress_avx;
+		return 0;
+	}
+	if (strcmp(name, "sse4.1") == 0 && __builtin_cpu_supports("sse4.1")) {
+		blake2s_compress_fn = blake2s_compress_sse41;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
 // Initialize the hashing context "ctx" with optional key "key".
 //      1 <= outlen <= 32 gives the digest size in bytes.
 //      Secret key (also <= 32 bytes) is optional (keylen = 0).
@@ -106,9 +258,10 @@ int blake2s_init(blake2s_ctx *ctx, size_t outlen,
 void blake2s_update(blake2s_ctx *ctx,
 	const void *in, size_t inlen)       // data bytes
 {
-	size_t i;
+	const uint8_t *p = (const uint8_t *) in;
+	size_t n;
 
-	for (i = 0; i < inlen; i++) {
+	while (inlen > 0) {
 		if (ctx->c == 64) {             // buffer full ?
 			ctx->t[0] += ctx->c;        // add counters
 			if (ctx->t[0] < ctx->c)     // carry overflow ?
@@ -116,7 +269,28 @@ void blake2s_update(blake2s_ctx *ctx,
 			blake2s_compress(ctx, 0);   // compress (not last)
 			ctx->c = 0;                 // counter to zero
 		}
-		ctx->b[ctx->c++] = ((const uint8_t *) in)[i];
+		n = 64 - ctx->c;                // copy as much as fits
+		if (n > inlen)
+			n = inlen;
+		memcpy(&ctx->b[ctx->c], p, n);
+		ctx->c += n;
+		p += n;
+		inlen -= n;
+	}
+}
+
+// Compress a full input buffer now instead of on the next update.
+//      Lets callers snapshot a context with a fixed prefix (a key or
+//      an HMAC pad) already absorbed. At least one more byte must be
+//      added before blake2s_final().
+void blake2s_flush(blake2s_ctx *ctx)
+{
+	if (ctx->c == 64) {
+		ctx->t[0] += ctx->c;
+		if (ctx->t[0] < ctx->c)
+			ctx->t[1]++;
+		blake2s_compress(ctx, 0);
+		ctx->c = 0;
 	}
 }
 
@@ -27,6 +27,10 @@ int blake2s_init(blake2s_ctx *ctx, size_t outlen,
 void blake2s_update(blake2s_ctx *ctx,   // context
     const void *in, size_t inlen);      // data to be hashed
 
+// Compress a full input buffer ahead of the next update. More input
+//      must follow before blake2s_final().
+void blake2s_flush(blake2s_ctx *ctx);
+
 // Generate the message digest (size given in init).
 //      Result placed in "out".
 void blake2s_final(blake2s_ctx *ctx, void *out);
@@ -36,4 +40,9 @@ int blake2s(void *out, size_t outlen,   // return buffer for digest
     const void *key, size_t keylen,     // optional secret key
     const void *in, size_t inlen);      // data to be hashed
 
+// Name of the compression function selected at runtime.
+const char *blake2s_impl(void);
+// Select a compression function by name; -1 if unavailable.
+int blake2s_impl_set(const char *name);
+
 #endif
@@ -4,6 +4,10 @@
 #else
 #include <arpa/inet.h>
 #endif
+#if defined(__linux__) && defined(__x86_64__)
+#include <sys/mman.h>
+#define	BPF_JIT_AMD64
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -485,3 +489,838 @@ mudband_bpf_validate(const struct mudband_bpf_insn *f, int len)
 	}
 	return (BPF_CLASS(f[len - 1].code) == BPF_RET);
 }
+
+#ifdef BPF_JIT_AMD64
+/*
+ * A small JIT for amd64 (SysV ABI).  The generated function has the same
+ * semantics as mudband_bpf_filter() with the following register mapping:
+ *
+ *	%eax	A
+ *	%ecx	X
+ *	%rdi	packet pointer
+ *	%esi	wirelen
+ *	%r10d	buflen (%edx is clobbered by div)
+ *	%r8, %r11 temporaries
+ *
+ * The scratch memory lives in the red zone below %rsp as the generated
+ * code never calls out.  It's only zeroed when the program reads it.
+ */
+
+#define	BPF_JIT_CC_B		0x2
+#define	BPF_JIT_CC_AE		0x3
+#define	BPF_JIT_CC_E		0x4
+#define	BPF_JIT_CC_NE		0x5
+#define	BPF_JIT_CC_BE		0x6
+#define	BPF_JIT_CC_A		0x7
+#define	BPF_JIT_CC_ALWAYS	(-1)
+
+struct bpf_jit_ctx {
+	uint8_t		*buf;		/* NULL on the sizing pass */
+	size_t		off;
+	size_t		*insn_off;
+	size_t		fail_off;
+};
+
+static void
+bpf_jit_emit(struct bpf_jit_ctx *ctx, const uint8_t *b, size_t len)
+{
+
+	if (ctx->buf != NULL)
+		memcpy(ctx->buf + ctx->off, b, len);
+	ctx->off += len;
+}
+
+static void
+bpf_jit_emit1(struct bpf_jit_ctx *ctx, uint8_t b)
+{
+
+	bpf_jit_emit(ctx, &b, 1);
+}
+
+static void
+bpf_jit_emit4(struct bpf_jit_ctx *ctx, uint32_t v)
+{
+	uint8_t b[4];
+
+	b[0] = v & 0xff;
+	b[1] = (v >> 8) & 0xff;
+	b[2] = (v >> 16) & 0xff;
+	b[3] = (v >> 24) & 0xff;
+	bpf_jit_emit(ctx, b, sizeof(b));
+}
+
+#define	BPF_JIT_EMIT(ctx, ...)	do {					\
+	static const uint8_t _b[] = { __VA_ARGS__ };			\
+	bpf_jit_emit((ctx), _b, sizeof(_b));				\
+} while (0)
+
+/*
+ * Always uses rel32 so the code size doesn't depend on the targets and
+ * the sizing pass yields the final offsets.
+ */
+static void
+bpf_jit_jmp(struct bpf_jit_ctx *ctx, int cc, size_t target)
+{
+	size_t end;
+
+	if (cc == BPF_JIT_CC_ALWAYS) {
+		end = ctx->off + 5;
+		bpf_jit_emit1(ctx, 0xe9);
+	} else {
+		end = ctx->off + 6;
+		bpf_jit_emit1(ctx, 0x0f);
+		bpf_jit_emit1(ctx, 0x80 | cc);
+	}
+	bpf_jit_emit4(ctx, (uint32_t)(target - end));
+}
+
+static void
+bpf_jit_branch(struct bpf_jit_ctx *ctx, const struct mudband_bpf_insn *pc,
+    int i, int cc)
+{
+	size_t t, f;
+
+	t = ctx->insn_off[i + 1 + pc->jt];
+	f = ctx->insn_off[i + 1 + pc->jf];
+	if (pc->jt == pc->jf) {
+		if (pc->jt != 0)
+			bpf_jit_jmp(ctx, BPF_JIT_CC_ALWAYS, t);
+		return;
+	}
+	if (pc->jt == 0) {
+		/* x86 condition codes are paired; flip the low bit. */
+		bpf_jit_jmp(ctx, cc ^ 1, f);
+		return;
+	}
+	bpf_jit_jmp(ctx, cc, t);
+	if (pc->jf != 0)
+		bpf_jit_jmp(ctx, BPF_JIT_CC_ALWAYS, f);
+}
+
+/*
+ * Loads 'size' bytes at p[%r8] (idx != 0) or p[k] into %eax, or into
+ * %ecx for BPF_MSH.  The caller did the bounds check.
+ */
+static void
+bpf_jit_load(struct bpf_jit_ctx *ctx, int size, int idx, uint32_t k,
+    int msh)
+{
+	uint8_t reg = msh ? 1 : 0;
+
+	if (!idx && k > INT32_MAX) {
+		/* movl $k, %r8d */
+		BPF_JIT_EMIT(ctx, 0x41, 0xb8);
+		bpf_jit_emit4(ctx, k);
+		idx = 1;
+	}
+	if (idx)
+		bpf_jit_emit1(ctx, 0x42);	/* REX.X for %r8 */
+	switch (size) {
+	case 4:
+		bpf_jit_emit1(ctx, 0x8b);	/* movl */
+		break;
+	case 2:
+		bpf_jit_emit1(ctx, 0x0f);	/* movzwl */
+		bpf_jit_emit1(ctx, 0xb7);
+		break;
+	case 1:
+		bpf_jit_emit1(ctx, 0x0f);	/* movzbl */
+		bpf_jit_emit1(ctx, 0xb6);
+		break;
+	}
+	if (idx) {
+		bpf_jit_emit1(ctx, 0x04 | (reg << 3));	/* (%rdi,%r8) */
+		bpf_jit_emit1(ctx, 0x07);
+	} else {
+		bpf_jit_emit1(ctx, 0x87 | (reg << 3));	/* k(%rdi) */
+		bpf_jit_emit4(ctx, k);
+	}
+	switch (size) {
+	case 4:
+		BPF_JIT_EMIT(ctx, 0x0f, 0xc8);			/* bswap %eax */
+		break;
+	case 2:
+		BPF_JIT_EMIT(ctx, 0x66, 0xc1, 0xc0, 0x08);	/* rolw $8, %ax */
+		break;
+	}
+	if (msh) {
+		BPF_JIT_EMIT(ctx, 0x83, 0xe1, 0x0f);	/* andl $0xf, %ecx */
+		BPF_JIT_EMIT(ctx, 0xc1, 0xe1, 0x02);	/* shll $2, %ecx */
+	}
+}
+
+static void
+bpf_jit_ld_abs(struct bpf_jit_ctx *ctx, int size, uint32_t k, int msh)
+{
+
+	if (k > UINT32_MAX - size) {
+		bpf_jit_jmp(ctx, BPF_JIT_CC_ALWAYS, ctx->fail_off);
+		return;
+	}
+	/* cmpl $(k + size), %r10d; jb fail */
+	BPF_JIT_EMIT(ctx, 0x41, 0x81, 0xfa);
+	bpf_jit_emit4(ctx, k + size);
+	bpf_jit_jmp(ctx, BPF_JIT_CC_B, ctx->fail_off);
+	bpf_jit_load(ctx, size, 0, k, msh);
+}
+
+static void
+bpf_jit_ld_ind(struct bpf_jit_ctx *ctx, int size, uint32_t k)
+{
+
+	/* 64-bit arithmetic so X + k + size can't wrap. */
+	BPF_JIT_EMIT(ctx, 0x41, 0x89, 0xc8);	/* movl %ecx, %r8d */
+	BPF_JIT_EMIT(ctx, 0x41, 0xbb);		/* movl $k, %r11d */
+	bpf_jit_emit4(ctx, k);
+	BPF_JIT_EMIT(ctx, 0x4d, 0x01, 0xd8);	/* addq %r11, %r8 */
+	BPF_JIT_EMIT(ctx, 0x4d, 0x8d, 0x58);	/* leaq size(%r8), %r11 */
+	bpf_jit_emit1(ctx, (uint8_t)size);
+	BPF_JIT_EMIT(ctx, 0x4d, 0x39, 0xd3);	/* cmpq %r10, %r11 */
+	bpf_jit_jmp(ctx, BPF_JIT_CC_A, ctx->fail_off);
+	bpf_jit_load(ctx, size, 1, 0, 0);
+}
+
+static uint8_t
+bpf_jit_mem_disp(uint32_t k)
+{
+
+	return ((uint8_t)(int8_t)(-(int)(BPF_MEMWORDS * 4) + (int)k * 4));
+}
+
+static int
+bpf_jit_gen(struct bpf_jit_ctx *ctx, const struct mudband_bpf_insn *f,
+    int len)
+{
+	const struct mudband_bpf_insn *pc;
+	int i, zeromem = 0;
+
+	for (i = 0; i < len; i++) {
+		if (f[i].code == (BPF_LD|BPF_MEM) ||
+		    f[i].code == (BPF_LDX|BPF_MEM))
+			zeromem = 1;
+	}
+
+	ctx->off = 0;
+	BPF_JIT_EMIT(ctx, 0x41, 0x89, 0xd2);	/* movl %edx, %r10d */
+	BPF_JIT_EMIT(ctx, 0x31, 0xc0);		/* xorl %eax, %eax */
+	BPF_JIT_EMIT(ctx, 0x31, 0xc9);		/* xorl %ecx, %ecx */
+	if (zeromem) {
+		BPF_JIT_EMIT(ctx, 0x45, 0x31, 0xc0);	/* xorl %r8d, %r8d */
+		for (i = 0; i < BPF_MEMWORDS; i++) {
+			/* movl %r8d, mem[i] */
+			BPF_JIT_EMIT(ctx, 0x44, 0x89, 0x44, 0x24);
+			bpf_jit_emit1(ctx, bpf_jit_mem_disp(i));
+		}
+	}
+
+	for (i = 0; i < len; i++) {
+		pc = &f[i];
+		ctx->insn_off[i] = ctx->off;
+		switch (pc->code) {
+		default:
+			return (-1);
+		case BPF_RET|BPF_K:
+			bpf_jit_emit1(ctx, 0xb8);	/* movl $k, %eax */
+			bpf_jit_emit4(ctx, pc->k);
+			bpf_jit_emit1(ctx, 0xc3);	/* ret */
+			break;
+		case BPF_RET|BPF_A:
+			bpf_jit_emit1(ctx, 0xc3);
+			break;
+		case BPF_LD|BPF_W|BPF_ABS:
+			bpf_jit_ld_abs(ctx, 4, pc->k, 0);
+			break;
+		case BPF_LD|BPF_H|BPF_ABS:
+			bpf_jit_ld_abs(ctx, 2, pc->k, 0);
+			break;
+		case BPF_LD|BPF_B|BPF_ABS:
+			bpf_jit_ld_abs(ctx, 1, pc->k, 0);
+			break;
+		case BPF_LD|BPF_W|BPF_LEN:
+			BPF_JIT_EMIT(ctx, 0x89, 0xf0);	/* movl %esi, %eax */
+			break;
+		case BPF_LDX|BPF_W|BPF_LEN:
+			BPF_JIT_EMIT(ctx, 0x89, 0xf1);	/* movl %esi, %ecx */
+			break;
+		case BPF_LD|BPF_W|BPF_IND:
+			bpf_jit_ld_ind(ctx, 4, pc->k);
+			break;
+		case BPF_LD|BPF_H|BPF_IND:
+			bpf_jit_ld_ind(ctx, 2, pc->k);
+			break;
+		case BPF_LD|BPF_B|BPF_IND:
+			bpf_jit_ld_ind(ctx, 1, pc->k);
+			break;
+		case BPF_LDX|BPF_MSH|BPF_B:
+			bpf_jit_ld_abs(ctx, 1, pc->k, 1);
+			break;
+		case BPF_LD|BPF_IMM:
+			bpf_jit_emit1(ctx, 0xb8);	/* movl $k, %eax */
+			bpf_jit_emit4(ctx, pc->k);
+			break;
+		case BPF_LDX|BPF_IMM:
+			bpf_jit_emit1(ctx, 0xb9);	/* movl $k, %ecx */
+			bpf_jit_emit4(ctx, pc->k);
+			break;
+		case BPF_LD|BPF_MEM:
+			BPF_JIT_EMIT(ctx, 0x8b, 0x44, 0x24);
+			bpf_jit_emit1(ctx, bpf_jit_mem_disp(pc->k));
+			break;
+		case BPF_LDX|BPF_MEM:
+			BPF_JIT_EMIT(ctx, 0x8b, 0x4c, 0x24);
+			bpf_jit_emit1(ctx, bpf_jit_mem_disp(pc->k));
+			break;
+		case BPF_ST:
+			BPF_JIT_EMIT(ctx, 0x89, 0x44, 0x24);
+			bpf_jit_emit1(ctx, bpf_jit_mem_disp(pc->k));
+			break;
+		case BPF_STX:
+			BPF_JIT_EMIT(ctx, 0x89, 0x4c, 0x24);
+			bpf_jit_emit1(ctx, bpf_jit_mem_disp(pc->k));
+			break;
+		case BPF_JMP|BPF_JA:
+			if (pc->k != 0)
+				bpf_jit_jmp(ctx, BPF_JIT_CC_ALWAYS,
+				    ctx->insn_off[i + 1 + pc->k]);
+			break;
+		case BPF_JMP|BPF_JGT|BPF_K:
+		case BPF_JMP|BPF_JGE|BPF_K:
+		case BPF_JMP|BPF_JEQ|BPF_K:
+		case BPF_JMP|BPF_JSET|BPF_K:
+			if (BPF_OP(pc->code) == BPF_JSET)
+				bpf_jit_emit1(ctx, 0xa9); /* testl $k, %eax */
+			else
+				bpf_jit_emit1(ctx, 0x3d); /* cmpl $k, %eax */
+			bpf_jit_emit4(ctx, pc->k);
+			goto branch;
+		case BPF_JMP|BPF_JGT|BPF_X:
+		case BPF_JMP|BPF_JGE|BPF_X:
+		case BPF_JMP|BPF_JEQ|BPF_X:
+		case BPF_JMP|BPF_JSET|BPF_X:
+			if (BPF_OP(pc->code) == BPF_JSET)
+				BPF_JIT_EMIT(ctx, 0x85, 0xc8); /* testl %ecx, %eax */
+			else
+				BPF_JIT_EMIT(ctx, 0x39, 0xc8); /* cmpl %ecx, %eax */
+branch:
+			switch (BPF_OP(pc->code)) {
+			case BPF_JGT:
+				bpf_jit_branch(ctx, pc, i, BPF_JIT_CC_A);
+				break;
+			case BPF_JGE:
+				bpf_jit_branch(ctx, pc, i, BPF_JIT_CC_AE);
+				break;
+			case BPF_JEQ:
+				bpf_jit_branch(ctx, pc, i, BPF_JIT_CC_E);
+				break;
+			case BPF_JSET:
+				bpf_jit_branch(ctx, pc, i, BPF_JIT_CC_NE);
+				break;
+			}
+			break;
+		case BPF_ALU|BPF_ADD|BPF_X:
+			BPF_JIT_EMIT(ctx, 0x01, 0xc8);	/* addl %ecx, %eax */
+			break;
+		case BPF_ALU|BPF_SUB|BPF_X:
+			BPF_JIT_EMIT(ctx, 0x29, 0xc8);	/* subl %ecx, %eax */
+			break;
+		case BPF_ALU|BPF_MUL|BPF_X:
+			BPF_JIT_EMIT(ctx, 0x0f, 0xaf, 0xc1); /* imull %ecx, %eax */
+			break;
+		case BPF_ALU|BPF_DIV|BPF_X:
+			BPF_JIT_EMIT(ctx, 0x85, 0xc9);	/* testl %ecx, %ecx */
+			bpf_jit_jmp(ctx, BPF_JIT_CC_E, ctx->fail_off);
+			BPF_JIT_EMIT(ctx, 0x31, 0xd2);	/* xorl %edx, %edx */
+			BPF_JIT_EMIT(ctx, 0xf7, 0xf1);	/* divl %ecx */
+			break;
+		case BPF_ALU|BPF_AND|BPF_X:
+			BPF_JIT_EMIT(ctx, 0x21, 0xc8);	/* andl %ecx, %eax */
+			break;
+		case BPF_ALU|BPF_OR|BPF_X:
+			BPF_JIT_EMIT(ctx, 0x09, 0xc8);	/* orl %ecx, %eax */
+			break;
+		case BPF_ALU|BPF_LSH|BPF_X:
+			BPF_JIT_EMIT(ctx, 0xd3, 0xe0);	/* shll %cl, %eax */
+			break;
+		case BPF_ALU|BPF_RSH|BPF_X:
+			BPF_JIT_EMIT(ctx, 0xd3, 0xe8);	/* shrl %cl, %eax */
+			break;
+		case BPF_ALU|BPF_ADD|BPF_K:
+			bpf_jit_emit1(ctx, 0x05);	/* addl $k, %eax */
+			bpf_jit_emit4(ctx, pc->k);
+			break;
+		case BPF_ALU|BPF_SUB|BPF_K:
+			bpf_jit_emit1(ctx, 0x2d);	/* subl $k, %eax */
+			bpf_jit_emit4(ctx, pc->k);
+			break;
+		case BPF_ALU|BPF_MUL|BPF_K:
+			BPF_JIT_EMIT(ctx, 0x69, 0xc0);	/* imull $k, %eax */
+			bpf_jit_emit4(ctx, pc->k);
+			break;
+		case BPF_ALU|BPF_DIV|BPF_K:
+			BPF_JIT_EMIT(ctx, 0x41, 0xb8);	/* movl $k, %r8d */
+			bpf_jit_emit4(ctx, pc->k);
+			BPF_JIT_EMIT(ctx, 0x31, 0xd2);	/* xorl %edx, %edx */
+			BPF_JIT_EMIT(ctx, 0x41, 0xf7, 0xf0); /* divl %r8d */
+			break;
+		case BPF_ALU|BPF_AND|BPF_K:
+			bpf_jit_emit1(ctx, 0x25);	/* andl $k, %eax */
+			bpf_jit_emit4(ctx, pc->k);
+			break;
+		case BPF_ALU|BPF_OR|BPF_K:
+			bpf_jit_emit1(ctx, 0x0d);	/* orl $k, %eax */
+			bpf_jit_emit4(ctx, pc->k);
+			break;
+		case BPF_ALU|BPF_LSH|BPF_K:
+			BPF_JIT_EMIT(ctx, 0xc1, 0xe0);	/* shll $k, %eax */
+			bpf_jit_emit1(ctx, (uint8_t)pc->k);
+			break;
+		case BPF_ALU|BPF_RSH|BPF_K:
+			BPF_JIT_EMIT(ctx, 0xc1, 0xe8);	/* shrl $k, %eax */
+			bpf_jit_emit1(ctx, (uint8_t)pc->k);
+			break;
+		case BPF_ALU|BPF_NEG:
+			BPF_JIT_EMIT(ctx, 0xf7, 0xd8);	/* negl %eax */
+			break;
+		case BPF_MISC|BPF_TAX:
+			BPF_JIT_EMIT(ctx, 0x89, 0xc1);	/* movl %eax, %ecx */
+			break;
+		case BPF_MISC|BPF_TXA:
+			BPF_JIT_EMIT(ctx, 0x89, 0xc8);	/* movl %ecx, %eax */
+			break;
+		}
+	}
+	ctx->insn_off[len] = ctx->off;
+	ctx->fail_off = ctx->off;
+	BPF_JIT_EMIT(ctx, 0x31, 0xc0);		/* xorl %eax, %eax */
+	bpf_jit_emit1(ctx, 0xc3);		/* ret */
+	return (0);
+}
+#endif
+
+/*
+ * Compiles the validated filter program to native code.  Returns -1 if
+ * the platform or the program isn't supported; the caller should fall
+ * back to mudband_bpf_filter() then.
+ */
+int
+mudband_bpf_jit_compile(struct mudband_bpf_jit *jit,
+    const struct mudband_bpf_insn *f, int len)
+{
+#ifdef BPF_JIT_AMD64
+	struct bpf_jit_ctx ctx;
+	void *code;
+	size_t size;
+	int r;
+
+	memset(jit, 0, sizeof(*jit));
+	if (len <= 0 || !mudband_bpf_validate(f, len))
+		return (-1);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.insn_off = calloc(len + 1, sizeof(*ctx.insn_off));
+	if (ctx.insn_off == NULL)
+		return (-1);
+	/* The first pass only sizes the code and resolves the offsets. */
+	r = bpf_jit_gen(&ctx, f, len);
+	if (r != 0) {
+		free(ctx.insn_off);
+		return (-1);
+	}
+	size = ctx.off;
+	code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		free(ctx.insn_off);
+		return (-1);
+	}
+	ctx.buf = code;
+	r = bpf_jit_gen(&ctx, f, len);
+	free(ctx.insn_off);
+	if (r != 0 || ctx.off != size ||
+	    mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(code, size);
+		return (-1);
+	}
+	jit->code = code;
+	jit->size = size;
+	jit->func = (mudband_bpf_jit_func_t)code;
+	return (0);
+#else
+	(void)f;
+	(void)len;
+
+	memset(jit, 0, sizeof(*jit));
+	return (-1);
+#endif
+}
+
+void
+mudband_bpf_jit_free(struct mudband_bpf_jit *jit)
+{
+
+#ifdef BPF_JIT_AMD64
+	if (jit->code != NULL)
+		munmap(jit->code, jit->size);
+#endif
+	memset(jit, 0, sizeof(*jit));
+}
+
+/*
+ * Recovers header-match rules from a filter program that runs on raw IPv4
+ * packets, by walking every path and collecting the conditions along it.
+ * Only loads of the IPv4 version, fragment offset, protocol, addresses and
+ * the L4 ports are understood; anything else makes the whole program
+ * unsupported.
+ */
+enum bpf_rule_field {
+	BPF_RULE_VER,		/* ldb [0] */
+	BPF_RULE_FRAG,		/* ldh [6] */
+	BPF_RULE_PROTO,		/* ldb [9] */
+	BPF_RULE_SADDR,		/* ld [12] */
+	BPF_RULE_DADDR,		/* ld [16] */
+	BPF_RULE_SPORT,		/* ldh [x + 0] with ldxb 4*([0]&0xf) */
+	BPF_RULE_DPORT,		/* ldh [x + 2] */
+	BPF_RULE_NFIELDS
+};
+
+static const uint32_t bpf_rule_width[BPF_RULE_NFIELDS] = {
+	0xff, 0xffff, 0xff, 0xffffffff, 0xffffffff, 0xffff, 0xffff
+};
+
+#define	BPF_RULE_NE_MAX		8
+#define	BPF_RULE_STEPS_MAX	4096
+
+struct bpf_rule_cons {
+	uint32_t	eqmask;		/* (v & eqmask) == eqval */
+	uint32_t	eqval;
+	uint32_t	lo;		/* lo <= v <= hi */
+	uint32_t	hi;
+};
+
+struct bpf_rule_ne {
+	int		field;		/* (v & mask) != val */
+	uint32_t	mask;
+	uint32_t	val;
+};
+
+struct bpf_rule_state {
+	struct bpf_rule_cons cons[BPF_RULE_NFIELDS];
+	struct bpf_rule_ne ne[BPF_RULE_NE_MAX];
+	int		n_ne;
+	int		a_field;	/* -1 unless A holds a header field */
+	uint32_t	a_mask;
+	int		x_msh;		/* X holds the IPv4 header length */
+	uint8_t		l4len;
+};
+
+struct bpf_rule_ctx {
+	const struct mudband_bpf_insn *f;
+	struct mudband_bpf_rule *rules;
+	int		maxrules;
+	int		n_rules;
+	int		steps;
+};
+
+static int
+bpf_rule_add_ne(struct bpf_rule_state *st, uint32_t mask, uint32_t val)
+{
+
+	if (st->n_ne >= BPF_RULE_NE_MAX)
+		return (-1);
+	st->ne[st->n_ne].field = st->a_field;
+	st->ne[st->n_ne].mask = mask;
+	st->ne[st->n_ne].val = val;
+	st->n_ne++;
+	return (1);
+}
+
+/*
+ * Narrows the state by the outcome of a conditional jump on A.  Returns 1
+ * if the outcome is possible, 0 if not and -1 if it can't be expressed.
+ */
+static int
+bpf_rule_cond(struct bpf_rule_state *st, const struct mudband_bpf_insn *pc,
+    int taken)
+{
+	struct bpf_rule_cons *c;
+	uint32_t k = pc->k, m = st->a_mask, mk;
+
+	c = &st->cons[st->a_field];
+	switch (BPF_OP(pc->code)) {
+	case BPF_JEQ:
+		if ((k & ~m) != 0)
+			return (taken ? 0 : 1);
+		if (!taken)
+			return (bpf_rule_add_ne(st, m, k));
+		if (((c->eqval ^ k) & c->eqmask & m) != 0)
+			return (0);
+		c->eqmask |= m;
+		c->eqval = (c->eqval & ~m) | k;
+		return (1);
+	case BPF_JSET:
+		mk = m & k;
+		if (mk == 0)
+			return (taken ? 0 : 1);
+		if (taken)
+			return (bpf_rule_add_ne(st, mk, 0));
+		if ((c->eqval & c->eqmask & mk) != 0)
+			return (0);
+		c->eqmask |= mk;
+		c->eqval &= ~mk;
+		return (1);
+	case BPF_JGT:
+		if (m != bpf_rule_width[st->a_field])
+			return (-1);
+		if (taken) {
+			if (k >= c->hi)
+				return (0);
+			if (k + 1 > c->lo)
+				c->lo = k + 1;
+		} else if (k < c->hi)
+			c->hi = k;
+		return (c->lo <= c->hi);
+	case BPF_JGE:
+		if (m != bpf_rule_width[st->a_field])
+			return (-1);
+		if (taken) {
+			if (k > c->lo)
+				c->lo = k;
+		} else {
+			if (k == 0)
+				return (0);
+			if (k - 1 < c->hi)
+				c->hi = k - 1;
+		}
+		return (c->lo <= c->hi);
+	}
+	return (-1);
+}
+
+/*
+ * Folds an exact match into the range of a port or protocol field.
+ * Returns 0 if nothing can match.
+ */
+static int
+bpf_rule_range(const struct bpf_rule_cons *c, uint32_t width, uint32_t *lo,
+    uint32_t *hi)
+{
+
+	*lo = c->lo;
+	*hi = c->hi;
+	if (c->eqmask == 0)
+		return (1);
+	if (c->eqmask != width)
+		return (-1);
+	if (c->eqval > *lo)
+		*lo = c->eqval;
+	if (c->eqval < *hi)
+		*hi = c->eqval;
+	return (*lo <= *hi);
+}
+
+/*
+ * The path ends in an accept.  Inequalities are only usable if the other
+ * conditions on the path already decide them.
+ */
+static int
+bpf_rule_emit(struct bpf_rule_ctx *ctx, struct bpf_rule_state *st)
+{
+	struct mudband_bpf_rule *rule;
+	const struct bpf_rule_cons *c;
+	const struct bpf_rule_ne *ne;
+	uint32_t lo, hi, slo, shi, dlo, dhi;
+	int i, r;
+
+	for (i = 0; i < st->n_ne; i++) {
+		ne = &st->ne[i];
+		c = &st->cons[ne->field];
+		if (ne->field == BPF_RULE_VER) {
+			/* Only IPv4 packets are classified. */
+			if ((ne->mask & 0x0f) != 0)
+				return (-1);
+			if ((0x40 & ne->mask) == ne->val)
+				return (0);
+			continue;
+		}
+		if ((c->eqmask & ne->mask) == ne->mask) {
+			if ((c->eqval & ne->mask) == ne->val)
+				return (0);
+			continue;
+		}
+		if (ne->mask == bpf_rule_width[ne->field]) {
+			if (ne->val < c->lo || ne->val > c->hi)
+				continue;
+			if (c->lo == c->hi)
+				return (0);
+		}
+		return (-1);
+	}
+
+	c = &st->cons[BPF_RULE_VER];
+	if (c->lo != 0 || c->hi != 0xff || (c->eqmask & 0x0f) != 0)
+		return (-1);
+	if (((c->eqval ^ 0x40) & c->eqmask) != 0)
+		return (0);
+
+	c = &st->cons[BPF_RULE_FRAG];
+	if (c->lo != 0 || c->hi != 0xffff)
+		return (-1);
+	if (c->eqmask != 0 && (c->eqmask != 0x1fff || c->eqval != 0))
+		return (-1);
+
+	for (i = BPF_RULE_SADDR; i <= BPF_RULE_DADDR; i++) {
+		c = &st->cons[i];
+		if (c->lo != 0 || c->hi != 0xffffffff)
+			return (-1);
+	}
+
+	r = bpf_rule_range(&st->cons[BPF_RULE_PROTO], 0xff, &lo, &hi);
+	if (r <= 0)
+		return (r);
+	if (lo != hi && (lo != 0 || hi != 0xff))
+		return (-1);
+	r = bpf_rule_range(&st->cons[BPF_RULE_SPORT], 0xffff, &slo, &shi);
+	if (r <= 0)
+		return (r);
+	r = bpf_rule_range(&st->cons[BPF_RULE_DPORT], 0xffff, &dlo, &dhi);
+	if (r <= 0)
+		return (r);
+
+	if (ctx->n_rules >= ctx->maxrules)
+		return (-1);
+	rule = &ctx->rules[ctx->n_rules++];
+	memset(rule, 0, sizeof(*rule));
+	rule->smask = st->cons[BPF_RULE_SADDR].eqmask;
+	rule->saddr = st->cons[BPF_RULE_SADDR].eqval;
+	rule->dmask = st->cons[BPF_RULE_DADDR].eqmask;
+	rule->daddr = st->cons[BPF_RULE_DADDR].eqval;
+	rule->sport_lo = (uint16_t)slo;
+	rule->sport_hi = (uint16_t)shi;
+	rule->dport_lo = (uint16_t)dlo;
+	rule->dport_hi = (uint16_t)dhi;
+	if (lo == hi) {
+		rule->flags |= MUDBAND_BPF_RULE_F_PROTO;
+		rule->proto = (uint8_t)lo;
+	}
+	if (st->cons[BPF_RULE_FRAG].eqmask != 0)
+		rule->flags |= MUDBAND_BPF_RULE_F_NOFRAG;
+	rule->l4len = st->l4len;
+	return (0);
+}
+
+static int
+bpf_rule_walk(struct bpf_rule_ctx *ctx, int i, struct bpf_rule_state *st)
+{
+	const struct mudband_bpf_insn *pc;
+	struct bpf_rule_state alt;
+	int r;
+
+	for (;; i++) {
+		if (++ctx->steps > BPF_RULE_STEPS_MAX)
+			return (-1);
+		pc = &ctx->f[i];
+		switch (pc->code) {
+		default:
+			return (-1);
+		case BPF_RET|BPF_K:
+			if (pc->k == 0)
+				return (0);
+			return (bpf_rule_emit(ctx, st));
+		case BPF_LD|BPF_B|BPF_ABS:
+			if (pc->k == 0)
+				st->a_field = BPF_RULE_VER;
+			else if (pc->k == 9)
+				st->a_field = BPF_RULE_PROTO;
+			else
+				return (-1);
+			st->a_mask = 0xff;
+			break;
+		case BPF_LD|BPF_H|BPF_ABS:
+			if (pc->k != 6)
+				return (-1);
+			st->a_field = BPF_RULE_FRAG;
+			st->a_mask = 0xffff;
+			break;
+		case BPF_LD|BPF_W|BPF_ABS:
+			if (pc->k == 12)
+				st->a_field = BPF_RULE_SADDR;
+			else if (pc->k == 16)
+				st->a_field = BPF_RULE_DADDR;
+			else
+				return (-1);
+			st->a_mask = 0xffffffff;
+			break;
+		case BPF_LDX|BPF_MSH|BPF_B:
+			if (pc->k != 0)
+				return (-1);
+			st->x_msh = 1;
+			break;
+		case BPF_LD|BPF_H|BPF_IND:
+			if (!st->x_msh || (pc->k != 0 && pc->k != 2))
+				return (-1);
+			st->a_field = pc->k == 0 ? BPF_RULE_SPORT :
+			    BPF_RULE_DPORT;
+			st->a_mask = 0xffff;
+			if (st->l4len < pc->k + 2)
+				st->l4len = pc->k + 2;
+			break;
+		case BPF_ALU|BPF_AND|BPF_K:
+			if (st->a_field < 0)
+				return (-1);
+			st->a_mask &= pc->k;
+			break;
+		case BPF_JMP|BPF_JA:
+			i += pc->k;
+			break;
+		case BPF_JMP|BPF_JGT|BPF_K:
+		case BPF_JMP|BPF_JGE|BPF_K:
+		case BPF_JMP|BPF_JEQ|BPF_K:
+		case BPF_JMP|BPF_JSET|BPF_K:
+			if (st->a_field < 0)
+				return (-1);
+			if (pc->jt == pc->jf) {
+				i += pc->jt;
+				break;
+			}
+			alt = *st;
+			r = bpf_rule_cond(&alt, pc, 1);
+			if (r < 0)
+				return (-1);
+			if (r > 0 && bpf_rule_walk(ctx, i + 1 + pc->jt, &alt) != 0)
+				return (-1);
+			r = bpf_rule_cond(st, pc, 0);
+			if (r <= 0)
+				return (r);
+			i += pc->jf;
+			break;
+		}
+	}
+}
+
+/*
+ * Returns the number of rules whose union matches exactly the IPv4
+ * packets (version 4, a complete header of at least 20 bytes) the program
+ * accepts, or -1 if the program can't be expressed that way or needs more
+ * than 'maxrules' rules.
+ */
+int
+mudband_bpf_rules(const struct mudband_bpf_insn *f, int len,
+    struct mudband_bpf_rule *rules, int maxrules)
+{
+	struct bpf_rule_ctx ctx;
+	struct bpf_rule_state st;
+	int i;
+
+	if (len <= 0 || !mudband_bpf_validate(f, len))
+		return (-1);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.f = f;
+	ctx.rules = rules;
+	ctx.maxrules = maxrules;
+	memset(&st, 0, sizeof(st));
+	for (i = 0; i < BPF_RULE_NFIELDS; i++)
+		st.cons[i].hi = bpf_rule_width[i];
+	st.a_field = -1;
+	if (bpf_rule_walk(&ctx, 0, &st) != 0)
+		return (-1);
+	return (ctx.n_rules);
+}
@@ -52,9 +52,48 @@ struct mudband_bpf_insn {
     mudband_bpf_u_int32 k;
 };
 
+/*
+ * A filter program compiled to native code by mudband_bpf_jit_compile().
+ * 'func' is NULL if the program couldn't be compiled.
+ */
+typedef uint32_t (*mudband_bpf_jit_func_t)(const uint8_t *p,
+		    uint32_t wirelen, uint32_t buflen);
+
+struct mudband_bpf_jit {
+	mudband_bpf_jit_func_t func;
+	void		*code;
+	size_t		size;
+};
+
+/*
+ * A header match on a raw IPv4 packet as recovered by mudband_bpf_rules().
+ * Values are in host byte order, the same as BPF sees them.  A packet
+ * matches if all of the following hold.
+ */
+struct mudband_bpf_rule {
+	uint32_t	saddr;		/* (ip_src & smask) == saddr */
+	uint32_t	smask;
+	uint32_t	daddr;		/* (ip_dst & dmask) == daddr */
+	uint32_t	dmask;
+	uint16_t	sport_lo;	/* sport_lo <= sport <= sport_hi */
+	uint16_t	sport_hi;
+	uint16_t	dport_lo;	/* dport_lo <= dport <= dport_hi */
+	uint16_t	dport_hi;
+	uint8_t		proto;
+	uint8_t		l4len;		/* L4 bytes the program reads (0, 2, 4) */
+	uint8_t		flags;
+#define	MUDBAND_BPF_RULE_F_PROTO	0x01	/* ip_p == proto */
+#define	MUDBAND_BPF_RULE_F_NOFRAG	0x02	/* (ip_off & IP_OFFMASK) == 0 */
+};
+
 uint32_t
     mudband_bpf_filter(const struct mudband_bpf_insn *pc, uint8_t *p, uint32_t
 		    wirelen, uint32_t buflen);
 int	mudband_bpf_validate(const struct mudband_bpf_insn *f, int len);
+int	mudband_bpf_jit_compile(struct mudband_bpf_jit *jit,
+	    const struct mudband_bpf_insn *f, int len);
+void	mudband_bpf_jit_free(struct mudband_bpf_jit *jit);
+int	mudband_bpf_rules(const struct mudband_bpf_insn *f, int len,
+	    struct mudband_bpf_rule *rules, int maxrules);
 
 #endif
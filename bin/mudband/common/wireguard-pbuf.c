@@ -28,6 +28,9 @@
  * SUCH DAMAGE.
  */
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,6 +52,43 @@ static struct wireguard_pbuf_stat wg_pbuf_stat;
 VTAILQ_HEAD(pbuf_cache_head, pbuf_cache);
 static struct pbuf_cache_head pbuf_cache_head[PBUF_CACHE_HEAD_SIZE];
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define	PBUF_ATOMIC_CAS64(p, o, n)					\
+	(_InterlockedCompareExchange64((volatile __int64 *)(p), (n), (o)) == (o))
+#define	PBUF_ATOMIC_LOAD64(p)	(*(volatile __int64 *)(p))
+#define	PBUF_ATOMIC_LOAD32(p)	(*(volatile long *)(p))
+#define	PBUF_ATOMIC_STORE32(p, v)					\
+	_InterlockedExchange((volatile long *)(p), (v))
+#define	PBUF_ATOMIC_INC64(p)	_InterlockedIncrement64((volatile __int64 *)(p))
+#else
+#define	PBUF_ATOMIC_CAS64(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define	PBUF_ATOMIC_LOAD64(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define	PBUF_ATOMIC_LOAD32(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define	PBUF_ATOMIC_STORE32(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define	PBUF_ATOMIC_INC64(p)	__atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#endif
+
+/*
+ * Optional arena of fixed-size buffers carved out at startup by
+ * PBUF_pool_init().  Every slot is big enough for the largest pbuf_alloc()
+ * request so any size can be served from it.  The free list is a Treiber
+ * stack; its head packs a tag in the upper 32 bits with the slot index + 1
+ * in the lower ones so a pop can't be fooled by a concurrent pop and push
+ * of the same slot (ABA).
+ */
+#define	PBUF_POOL_MAGIC			0x3c91f0a7
+#define	PBUF_POOL_HUGEPAGE		(2 * 1024 * 1024)
+
+static uint8_t *pbuf_pool_base;
+static size_t pbuf_pool_slotsz;
+static size_t pbuf_pool_mapsz;
+static uint32_t pbuf_pool_n;
+static uint32_t *pbuf_pool_next;	/* slot index + 1 of the next free */
+static uint64_t pbuf_pool_head;
+static const char *pbuf_pool_backing = "none";
+static uint64_t pbuf_pool_n_alloc_fails;
+
 void
 PBUF_init(void)
 {
@@ -59,6 +99,118 @@ PBUF_init(void)
 	}
 }
 
+static uint8_t *
+pbuf_pool_map(size_t size)
+{
+	uint8_t *base;
+
+#if defined(__linux__)
+#if defined(MAP_HUGETLB)
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (base != MAP_FAILED) {
+		pbuf_pool_backing = "hugetlb";
+		return (base);
+	}
+#endif
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return (NULL);
+	pbuf_pool_backing = "mmap";
+#if defined(MADV_HUGEPAGE)
+	if (madvise(base, size, MADV_HUGEPAGE) == 0)
+		pbuf_pool_backing = "thp";
+#endif
+	/* Fault everything in now rather than on the data path. */
+	memset(base, 0, size);
+#else
+	base = calloc(1, size);
+	if (base == NULL)
+		return (NULL);
+	pbuf_pool_backing = "malloc";
+#endif
+	return (base);
+}
+
+int
+PBUF_pool_init(uint32_t n_bufs)
+{
+	struct pbuf_cache *cache;
+	uint32_t i;
+
+	if (n_bufs == 0 || pbuf_pool_n != 0)
+		return (-1);
+	pbuf_pool_slotsz = sizeof(struct pbuf_cache) + sizeof(struct pbuf) +
+	    (PBUF_CACHE_HEAD_SIZE - 1) + 256;
+	pbuf_pool_slotsz = (pbuf_pool_slotsz + 63) & ~(size_t)63;
+	pbuf_pool_mapsz = pbuf_pool_slotsz * n_bufs;
+	pbuf_pool_mapsz = (pbuf_pool_mapsz + PBUF_POOL_HUGEPAGE - 1) &
+	    ~(size_t)(PBUF_POOL_HUGEPAGE - 1);
+	pbuf_pool_next = calloc(n_bufs, sizeof(*pbuf_pool_next));
+	if (pbuf_pool_next == NULL)
+		return (-1);
+	pbuf_pool_base = pbuf_pool_map(pbuf_pool_mapsz);
+	if (pbuf_pool_base == NULL) {
+		free(pbuf_pool_next);
+		pbuf_pool_next = NULL;
+		pbuf_pool_backing = "none";
+		return (-1);
+	}
+	for (i = 0; i < n_bufs; i++) {
+		cache = (struct pbuf_cache *)(pbuf_pool_base +
+		    (size_t)i * pbuf_pool_slotsz);
+		cache->magic = PBUF_POOL_MAGIC;
+		pbuf_pool_next[i] = i + 1 < n_bufs ? i + 2 : 0;
+	}
+	pbuf_pool_head = 1;
+	pbuf_pool_n = n_bufs;
+	return (0);
+}
+
+void
+PBUF_pool_stat(struct pbuf_pool_stat *st)
+{
+
+	st->n_bufs = pbuf_pool_n;
+	st->backing = pbuf_pool_backing;
+	st->n_alloc_fails = PBUF_ATOMIC_LOAD64(&pbuf_pool_n_alloc_fails);
+}
+
+static struct pbuf_cache *
+pbuf_pool_pop(void)
+{
+	uint64_t head, nhead;
+	uint32_t top;
+
+	do {
+		head = PBUF_ATOMIC_LOAD64(&pbuf_pool_head);
+		top = (uint32_t)head;
+		if (top == 0)
+			return (NULL);
+		nhead = (((head >> 32) + 1) << 32) |
+		    PBUF_ATOMIC_LOAD32(&pbuf_pool_next[top - 1]);
+	} while (!PBUF_ATOMIC_CAS64(&pbuf_pool_head, head, nhead));
+	return ((struct pbuf_cache *)(pbuf_pool_base +
+	    (size_t)(top - 1) * pbuf_pool_slotsz));
+}
+
+static void
+pbuf_pool_push(struct pbuf_cache *cache)
+{
+	uint64_t head, nhead;
+	uint32_t idx;
+
+	idx = (uint32_t)(((uint8_t *)cache - pbuf_pool_base) /
+	    pbuf_pool_slotsz);
+	assert(idx < pbuf_pool_n);
+	do {
+		head = PBUF_ATOMIC_LOAD64(&pbuf_pool_head);
+		PBUF_ATOMIC_STORE32(&pbuf_pool_next[idx], (uint32_t)head);
+		nhead = (((head >> 32) + 1) << 32) | (idx + 1);
+	} while (!PBUF_ATOMIC_CAS64(&pbuf_pool_head, head, nhead));
+}
+
 struct pbuf *
 pbuf_alloc(size_t size)
 {
@@ -68,6 +220,21 @@ pbuf_alloc(size_t size)
 
 	assert(size >= 0);
 	assert(size <= PBUF_CACHE_HEAD_SIZE - 1);
+	if (pbuf_pool_n > 0) {
+		cache = pbuf_pool_pop();
+		if (cache != NULL) {
+			assert(cache->magic == PBUF_POOL_MAGIC);
+			cache->size = (uint16_t)size;
+			p = (struct pbuf *)(cache + 1);
+			p->ptr = (uint8_t *)(p + 1);
+			p->payload = p->ptr + 128;
+			p->len = size;
+			p->tot_len = size;
+			p->next = NULL;
+			return (p);
+		}
+		PBUF_ATOMIC_INC64(&pbuf_pool_n_alloc_fails);
+	}
 	head = &pbuf_cache_head[size];
 	if (!VTAILQ_EMPTY(head)) {
 		cache = VTAILQ_FIRST(head);
@@ -159,6 +326,10 @@ pbuf_free(struct pbuf *p)
 	struct pbuf_cache *cache;
 
 	cache = (struct pbuf_cache *)(((uint8_t *)p) - sizeof(*cache));
+	if (cache->magic == PBUF_POOL_MAGIC) {
+		pbuf_pool_push(cache);
+		return;
+	}
 	assert(cache->magic == PBUF_CACHE_MAGIC);
 	assert(cache->size >= 0);
 	assert(cache->size <= PBUF_CACHE_HEAD_SIZE - 1);
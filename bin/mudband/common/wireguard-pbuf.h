@@ -49,7 +49,15 @@ struct pbuf {
 	struct pbuf	*next;
 };
 
+struct pbuf_pool_stat {
+	uint32_t	n_bufs;
+	const char	*backing;	/* hugetlb, thp, mmap, malloc or none */
+	uint64_t	n_alloc_fails;	/* pool empty; fell back to malloc */
+};
+
 void	PBUF_init(void);
+int	PBUF_pool_init(uint32_t n_bufs);
+void	PBUF_pool_stat(struct pbuf_pool_stat *st);
 struct pbuf *
 	pbuf_alloc(size_t size);
 int	pbuf_take(struct pbuf *buf, const void *dataptr, uint16_t len);
@@ -47,6 +47,7 @@
 #include <endian.h>
 #endif
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -59,6 +60,18 @@
 // For HMAC calculation
 #define WIREGUARD_BLAKE2S_BLOCK_SIZE (64)
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define	WG_ATOMIC_CAS(p, o, n)						\
+	(_InterlockedCompareExchange((volatile long *)(p), (n), (o)) == (o))
+#define	WG_ATOMIC_LOAD(p)	(*(volatile long *)(p))
+#define	WG_ATOMIC_STORE(p, v)	_InterlockedExchange((volatile long *)(p), (v))
+#else
+#define	WG_ATOMIC_CAS(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define	WG_ATOMIC_LOAD(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define	WG_ATOMIC_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
 // 5.4 Messages
 // Constants
 // The UTF-8 string literal "Noise_IKpsk2_25519_ChaChaPoly_BLAKE2s",
@@ -78,6 +91,20 @@ static const uint8_t zero_key[WIREGUARD_PUBLIC_KEY_LEN] = { 0 };
 static uint8_t construction_hash[WIREGUARD_HASH_LEN];
 static uint8_t identifier_hash[WIREGUARD_HASH_LEN];
 
+// Ephemeral keypairs generated ahead of time by a platform thread via
+// wireguard_ephemeral_refill().  Each slot is claimed with a CAS on its
+// state so any number of producers and consumers can share the pool.
+#define	WIREGUARD_EPHEMERAL_EMPTY	0
+#define	WIREGUARD_EPHEMERAL_BUSY	1
+#define	WIREGUARD_EPHEMERAL_READY	2
+struct wireguard_ephemeral {
+	volatile long	state;
+	uint8_t		private_key[WIREGUARD_PRIVATE_KEY_LEN];
+	uint8_t		public_key[WIREGUARD_PUBLIC_KEY_LEN];
+};
+static struct wireguard_ephemeral
+    ephemeral_pool[WIREGUARD_EPHEMERAL_POOL_SIZE];
+
 #if !defined(WIN32)
 #if !defined(le64toh)
 #define	le64toh(x)	(x)
@@ -156,6 +183,118 @@ wireguard_peer_alloc(struct wireguard_device *device)
 	return result;
 }
 
+// Makes sure the next n wireguard_peer_slab_alloc() calls succeed.  This
+// is the only place the peer array may move, so callers holding pointers
+// into it across the call must keep handles instead.
+bool
+wireguard_peer_slab_reserve(struct wireguard_device *device, int n)
+{
+	struct wireguard_peer *peers;
+	uint32_t *gen;
+	int *free_slots;
+	int avail, cap;
+
+	avail = device->peers_nfree + (device->peers_cap - device->peers_count);
+	if (n <= avail)
+		return (true);
+	cap = device->peers_cap * 2;
+	if (cap < device->peers_cap + (n - avail))
+		cap = device->peers_cap + (n - avail);
+	if (cap < 16)
+		cap = 16;
+	peers = realloc(device->peers, cap * sizeof(struct wireguard_peer));
+	if (peers == NULL)
+		return (false);
+	device->peers = peers;
+	gen = realloc(device->peers_gen, cap * sizeof(uint32_t));
+	if (gen == NULL)
+		return (false);
+	device->peers_gen = gen;
+	free_slots = realloc(device->peers_free, cap * sizeof(int));
+	if (free_slots == NULL)
+		return (false);
+	device->peers_free = free_slots;
+	memset(&device->peers[device->peers_cap], 0,
+	    (cap - device->peers_cap) * sizeof(struct wireguard_peer));
+	memset(&device->peers_gen[device->peers_cap], 0,
+	    (cap - device->peers_cap) * sizeof(uint32_t));
+	device->peers_cap = cap;
+	return (true);
+}
+
+// Returns a zeroed, not yet valid slot.  Released slots are reused
+// before the high-water mark grows.
+struct wireguard_peer *
+wireguard_peer_slab_alloc(struct wireguard_device *device)
+{
+	int x;
+
+	if (device->peers_nfree > 0)
+		x = device->peers_free[--device->peers_nfree];
+	else if (device->peers_count < device->peers_cap)
+		x = device->peers_count++;
+	else
+		return (NULL);
+	return (&device->peers[x]);
+}
+
+void
+wireguard_peer_slab_release(struct wireguard_device *device,
+    struct wireguard_peer *peer)
+{
+	int x;
+
+	x = (int)(peer - device->peers);
+	assert(x >= 0 && x < device->peers_count);
+	crypto_zero(peer, sizeof(struct wireguard_peer));
+	peer->valid = false;
+	device->peers_gen[x]++;
+	device->peers_free[device->peers_nfree++] = x;
+}
+
+void
+wireguard_peer_slab_fini(struct wireguard_device *device)
+{
+
+	free(device->peers);
+	free(device->peers_gen);
+	free(device->peers_free);
+	free(device->peers_hot);
+	device->peers = NULL;
+	device->peers_gen = NULL;
+	device->peers_free = NULL;
+	device->peers_hot = NULL;
+	device->peers_count = device->peers_cap = device->peers_nfree = 0;
+	device->peers_hot_base = NULL;
+	device->peers_hot_count = 0;
+}
+
+void
+wireguard_peer_handle_get(struct wireguard_device *device,
+    struct wireguard_peer *peer, struct wireguard_peer_handle *handle)
+{
+
+	handle->index = (int)(peer - device->peers);
+	assert(handle->index >= 0 && handle->index < device->peers_count);
+	handle->gen = device->peers_gen != NULL ?
+	    device->peers_gen[handle->index] : 0;
+}
+
+struct wireguard_peer *
+wireguard_peer_handle_resolve(struct wireguard_device *device,
+    const struct wireguard_peer_handle *handle)
+{
+	struct wireguard_peer *peer;
+
+	if (handle->index < 0 || handle->index >= device->peers_count)
+		return (NULL);
+	if (device->peers_gen != NULL &&
+	    device->peers_gen[handle->index] != handle->gen)
+		return (NULL);
+	peer = &device->peers[handle->index];
+	return (peer->valid ? peer : NULL);
+}
+
 struct wireguard_peer *
 wireguard_peer_lookup_by_pubkey(struct wireguard_device *device,
     uint8_t *public_key)
@@ -206,20 +345,128 @@ wireguard_peer_lookup_by_peer_index(struct wireguard_device *device,
 	return result;
 }
 
+static bool
+wireguard_peers_hot_ok(struct wireguard_device *device)
+{
+
+	return (device->peers_hot != NULL &&
+	    device->peers_hot_base == device->peers &&
+	    device->peers_hot_count == device->peers_count);
+}
+
+static void
+wireguard_peer_hot_fill(struct wireguard_peer_hot *hot,
+    struct wireguard_peer *peer)
+{
+
+	hot->receivers_valid = 0;
+	hot->receivers[0] = peer->curr_keypair.local_index;
+	if (peer->curr_keypair.valid)
+		hot->receivers_valid |= WIREGUARD_PEER_HOT_CURR;
+	hot->receivers[1] = peer->next_keypair.local_index;
+	if (peer->next_keypair.valid)
+		hot->receivers_valid |= WIREGUARD_PEER_HOT_NEXT;
+	hot->receivers[2] = peer->prev_keypair.local_index;
+	if (peer->prev_keypair.valid)
+		hot->receivers_valid |= WIREGUARD_PEER_HOT_PREV;
+}
+
+// Refreshes the receiver indexes of the peer after its keypairs rotated.
+// Keypairs destroyed elsewhere leave stale entries behind, which is fine
+// because every hit is verified against the peer itself.
+static void
+wireguard_peer_hot_sync(struct wireguard_peer *peer)
+{
+	struct wireguard_device *device = peer->device;
+	int x;
+
+	if (device == NULL || !wireguard_peers_hot_ok(device))
+		return;
+	x = (int)(peer - device->peers);
+	if (x < 0 || x >= device->peers_count)
+		return;
+	wireguard_peer_hot_fill(&device->peers_hot[x], peer);
+}
+
+void
+wireguard_device_peers_index(struct wireguard_device *device)
+{
+	struct wireguard_peer_hot *hot;
+	struct wireguard_peer *peer;
+	int x, y;
+
+	free(device->peers_hot);
+	device->peers_hot = NULL;
+	device->peers_hot_base = NULL;
+	device->peers_hot_count = 0;
+	if (device->peers_count <= 0)
+		return;
+	device->peers_hot = calloc(device->peers_count,
+	    sizeof(struct wireguard_peer_hot));
+	if (device->peers_hot == NULL)
+		return;
+	for (x = 0; x < device->peers_count; x++) {
+		peer = &device->peers[x];
+		hot = &device->peers_hot[x];
+		hot->valid = peer->valid;
+		wireguard_peer_hot_fill(hot, peer);
+		for (y = 0; y < WIREGUARD_MAX_SRC_IPS; y++) {
+			if (!peer->allowed_source_ips[y].valid)
+				continue;
+			hot->allowed_ips[hot->n_allowed_ips].mask =
+			    peer->allowed_source_ips[y].mask;
+			hot->allowed_ips[hot->n_allowed_ips].ip =
+			    peer->allowed_source_ips[y].ip &
+			    peer->allowed_source_ips[y].mask;
+			hot->n_allowed_ips++;
+		}
+	}
+	device->peers_hot_base = device->peers;
+	device->peers_hot_count = device->peers_count;
+}
+
+static bool
+wireguard_peer_has_receiver(struct wireguard_peer *peer, uint32_t receiver)
+{
+
+	return ((peer->curr_keypair.valid &&
+	    peer->curr_keypair.local_index == receiver) ||
+	    (peer->next_keypair.valid &&
+	    peer->next_keypair.local_index == receiver) ||
+	    (peer->prev_keypair.valid &&
+	    peer->prev_keypair.local_index == receiver));
+}
+
 struct wireguard_peer *
 wireguard_peer_lookup_by_receiver(struct wireguard_device *device, uint32_t receiver)
 {
+	struct wireguard_peer_hot *hot;
 	struct wireguard_peer *result = NULL;
 	struct wireguard_peer *tmp;
 	int x;
 
+	if (wireguard_peers_hot_ok(device)) {
+		for (x = 0; x < device->peers_hot_count; x++) {
+			hot = &device->peers_hot[x];
+			if (!hot->valid || hot->receivers_valid == 0)
+				continue;
+			if (!((hot->receivers_valid & WIREGUARD_PEER_HOT_CURR &&
+			    hot->receivers[0] == receiver) ||
+			    (hot->receivers_valid & WIREGUARD_PEER_HOT_NEXT &&
+			    hot->receivers[1] == receiver) ||
+			    (hot->receivers_valid & WIREGUARD_PEER_HOT_PREV &&
+			    hot->receivers[2] == receiver)))
+				continue;
+			tmp = &device->peers[x];
+			if (tmp->valid && wireguard_peer_has_receiver(tmp, receiver))
+				return (tmp);
+		}
+		return (NULL);
+	}
 	for (x=0; x < device->peers_count; x++) {
 		tmp = &device->peers[x];
 		if (tmp->valid) {
-			if ((tmp->curr_keypair.valid && (tmp->curr_keypair.local_index == receiver)) ||
-			    (tmp->next_keypair.valid && (tmp->next_keypair.local_index == receiver)) ||
-			    (tmp->prev_keypair.valid && (tmp->prev_keypair.local_index == receiver))
-				) {
+			if (wireguard_peer_has_receiver(tmp, receiver)) {
 				result = tmp;
 				break;
 			}
@@ -228,6 +475,46 @@ wireguard_peer_lookup_by_receiver(struct wireguard_device *device, uint32_t rece
 	return result;
 }
 
+struct wireguard_peer *
+wireguard_peer_lookup_by_allowed_ip(struct wireguard_device *device,
+    uint32_t ipaddr)
+{
+	struct wireguard_peer_hot *hot;
+	struct wireguard_peer *tmp;
+	uint32_t v1, v2;
+	int x, y;
+
+	if (wireguard_peers_hot_ok(device)) {
+		for (x = 0; x < device->peers_hot_count; x++) {
+			hot = &device->peers_hot[x];
+			if (!hot->valid)
+				continue;
+			for (y = 0; y < hot->n_allowed_ips; y++) {
+				if ((ipaddr & hot->allowed_ips[y].mask) ==
+				    hot->allowed_ips[y].ip &&
+				    device->peers[x].valid)
+					return (&device->peers[x]);
+			}
+		}
+		return (NULL);
+	}
+	for (x = 0; x < device->peers_count; x++) {
+		tmp = &device->peers[x];
+		if (!tmp->valid)
+			continue;
+		for (y = 0; y < WIREGUARD_MAX_SRC_IPS; y++) {
+			if (!(tmp->allowed_source_ips[y].valid))
+				continue;
+			v1 = ipaddr & tmp->allowed_source_ips[y].mask;
+			v2 = tmp->allowed_source_ips[y].ip &
+			    tmp->allowed_source_ips[y].mask;
+			if (v1 == v2)
+				return (tmp);
+		}
+	}
+	return (NULL);
+}
+
 struct wireguard_peer *
 wireguard_peer_lookup_by_handshake(struct wireguard_device *device, uint32_t receiver)
 {
@@ -297,6 +584,29 @@ wireguard_mac(uint8_t *dst, const void *message, size_t len,
 	wireguard_blake2s(dst, WIREGUARD_COOKIE_LEN, key, keylen, message, len);
 }
 
+// Keyed-Blake2s with the key block compressed up front; each MAC
+// computed from the copy saves one compression.
+static void
+wireguard_mac_ctx_init(wireguard_blake2s_ctx *ctx, const uint8_t *key)
+{
+
+	wireguard_blake2s_init(ctx, WIREGUARD_COOKIE_LEN, key,
+	    WIREGUARD_SESSION_KEY_LEN);
+	wireguard_blake2s_flush(ctx);
+}
+
+static void
+wireguard_mac_precomputed(uint8_t *dst, const void *message, size_t len,
+    const wireguard_blake2s_ctx *key_ctx)
+{
+	wireguard_blake2s_ctx ctx;
+
+	assert(len > 0);
+	ctx = *key_ctx;
+	wireguard_blake2s_update(&ctx, message, len);
+	wireguard_blake2s_final(&ctx, dst);
+}
+
 static void
 wireguard_mac_key(uint8_t *key, const uint8_t *public_key,
     const uint8_t *label, size_t label_len)
@@ -381,23 +691,76 @@ wireguard_hmac(uint8_t *digest, const uint8_t *key, size_t key_len,
 	wireguard_blake2s_final(&ctx, digest);
 }
 
+// HMAC with the inner and outer pad blocks already compressed, for a
+// key that is used more than once (tau0 in the KDFs below).
+struct wireguard_hmac_ctx {
+	wireguard_blake2s_ctx	inner;
+	wireguard_blake2s_ctx	outer;
+};
+
+static void
+wireguard_hmac_init(struct wireguard_hmac_ctx *hctx, const uint8_t *key,
+    size_t key_len)
+{
+	uint8_t k_pad[WIREGUARD_BLAKE2S_BLOCK_SIZE];
+	int i;
+
+	assert(key_len <= WIREGUARD_BLAKE2S_BLOCK_SIZE);
+	memset(k_pad, 0, sizeof(k_pad));
+	memcpy(k_pad, key, key_len);
+	for (i = 0; i < WIREGUARD_BLAKE2S_BLOCK_SIZE; i++)
+		k_pad[i] ^= 0x36;
+	wireguard_blake2s_init(&hctx->inner, WIREGUARD_HASH_LEN, NULL, 0);
+	wireguard_blake2s_update(&hctx->inner, k_pad,
+	    WIREGUARD_BLAKE2S_BLOCK_SIZE);
+	wireguard_blake2s_flush(&hctx->inner);
+	// 0x36 ^ 0x5c turns the inner pad into the outer one
+	for (i = 0; i < WIREGUARD_BLAKE2S_BLOCK_SIZE; i++)
+		k_pad[i] ^= 0x36 ^ 0x5c;
+	wireguard_blake2s_init(&hctx->outer, WIREGUARD_HASH_LEN, NULL, 0);
+	wireguard_blake2s_update(&hctx->outer, k_pad,
+	    WIREGUARD_BLAKE2S_BLOCK_SIZE);
+	wireguard_blake2s_flush(&hctx->outer);
+	crypto_zero(k_pad, sizeof(k_pad));
+}
+
+static void
+wireguard_hmac_final(const struct wireguard_hmac_ctx *hctx, uint8_t *digest,
+    const uint8_t *text, size_t text_len)
+{
+	wireguard_blake2s_ctx ctx;
+
+	// The flushed pad block must not be the last one
+	assert(text_len > 0);
+	ctx = hctx->inner;
+	wireguard_blake2s_update(&ctx, text, text_len);
+	wireguard_blake2s_final(&ctx, digest);
+	ctx = hctx->outer;
+	wireguard_blake2s_update(&ctx, digest, WIREGUARD_HASH_LEN);
+	wireguard_blake2s_final(&ctx, digest);
+	crypto_zero(&ctx, sizeof(ctx));
+}
+
 static void
 wireguard_kdf1(uint8_t *tau1, const uint8_t *chaining_key, const uint8_t *data,
     size_t data_len)
 {
 	uint8_t tau0[WIREGUARD_HASH_LEN];
 	uint8_t output[WIREGUARD_HASH_LEN + 1];
+	struct wireguard_hmac_ctx hctx;
 
 	// tau0 = Hmac(key, input)
 	wireguard_hmac(tau0, chaining_key, WIREGUARD_HASH_LEN, data, data_len);
+	wireguard_hmac_init(&hctx, tau0, WIREGUARD_HASH_LEN);
 	// tau1 := Hmac(tau0, 0x1)
 	output[0] = 1;
-	wireguard_hmac(output, tau0, WIREGUARD_HASH_LEN, output, 1);
+	wireguard_hmac_final(&hctx, output, output, 1);
 	memcpy(tau1, output, WIREGUARD_HASH_LEN);
 
 	// Wipe intermediates
 	crypto_zero(tau0, sizeof(tau0));
 	crypto_zero(output, sizeof(output));
+	crypto_zero(&hctx, sizeof(hctx));
 }
 
 static void
@@ -406,23 +769,25 @@ wireguard_kdf2(uint8_t *tau1, uint8_t *tau2, const uint8_t *chaining_key,
 {
 	uint8_t tau0[WIREGUARD_HASH_LEN];
 	uint8_t output[WIREGUARD_HASH_LEN + 1];
+	struct wireguard_hmac_ctx hctx;
 
 	// tau0 = Hmac(key, input)
 	wireguard_hmac(tau0, chaining_key, WIREGUARD_HASH_LEN, data, data_len);
+	wireguard_hmac_init(&hctx, tau0, WIREGUARD_HASH_LEN);
 	// tau1 := Hmac(tau0, 0x1)
 	output[0] = 1;
-	wireguard_hmac(output, tau0, WIREGUARD_HASH_LEN, output, 1);
+	wireguard_hmac_final(&hctx, output, output, 1);
 	memcpy(tau1, output, WIREGUARD_HASH_LEN);
 
 	// tau2 := Hmac(tau0,tau1 || 0x2)
 	output[WIREGUARD_HASH_LEN] = 2;
-	wireguard_hmac(output, tau0, WIREGUARD_HASH_LEN, output,
-	    WIREGUARD_HASH_LEN + 1);
+	wireguard_hmac_final(&hctx, output, output, WIREGUARD_HASH_LEN + 1);
 	memcpy(tau2, output, WIREGUARD_HASH_LEN);
 
 	// Wipe intermediates
 	crypto_zero(tau0, sizeof(tau0));
 	crypto_zero(output, sizeof(output));
+	crypto_zero(&hctx, sizeof(hctx));
 }
 
 static void
@@ -431,29 +796,30 @@ wireguard_kdf3(uint8_t *tau1, uint8_t *tau2, uint8_t *tau3,
 {
 	uint8_t tau0[WIREGUARD_HASH_LEN];
 	uint8_t output[WIREGUARD_HASH_LEN + 1];
+	struct wireguard_hmac_ctx hctx;
 
 	// tau0 = Hmac(key, input)
 	wireguard_hmac(tau0, chaining_key, WIREGUARD_HASH_LEN, data, data_len);
+	wireguard_hmac_init(&hctx, tau0, WIREGUARD_HASH_LEN);
 	// tau1 := Hmac(tau0, 0x1)
 	output[0] = 1;
-	wireguard_hmac(output, tau0, WIREGUARD_HASH_LEN, output, 1);
+	wireguard_hmac_final(&hctx, output, output, 1);
 	memcpy(tau1, output, WIREGUARD_HASH_LEN);
 
 	// tau2 := Hmac(tau0,tau1 || 0x2)
 	output[WIREGUARD_HASH_LEN] = 2;
-	wireguard_hmac(output, tau0, WIREGUARD_HASH_LEN, output,
-	    WIREGUARD_HASH_LEN + 1);
+	wireguard_hmac_final(&hctx, output, output, WIREGUARD_HASH_LEN + 1);
 	memcpy(tau2, output, WIREGUARD_HASH_LEN);
 
 	// tau3 := Hmac(tau0,tau1,tau2 || 0x3)
 	output[WIREGUARD_HASH_LEN] = 3;
-	wireguard_hmac(output, tau0, WIREGUARD_HASH_LEN, output,
-	    WIREGUARD_HASH_LEN + 1);
+	wireguard_hmac_final(&hctx, output, output, WIREGUARD_HASH_LEN + 1);
 	memcpy(tau3, output, WIREGUARD_HASH_LEN);
 
 	// Wipe intermediates
 	crypto_zero(tau0, sizeof(tau0));
 	crypto_zero(output, sizeof(output));
+	crypto_zero(&hctx, sizeof(hctx));
 }
 
 bool
@@ -581,6 +947,57 @@ wireguard_generate_public_key(uint8_t *public_key, const uint8_t *private_key)
 	return r;
 }
 
+int
+wireguard_ephemeral_refill(void)
+{
+	struct wireguard_ephemeral *e;
+	int i, n = 0;
+
+	for (i = 0; i < WIREGUARD_EPHEMERAL_POOL_SIZE; i++) {
+		e = &ephemeral_pool[i];
+		if (WG_ATOMIC_LOAD(&e->state) != WIREGUARD_EPHEMERAL_EMPTY)
+			continue;
+		if (!WG_ATOMIC_CAS(&e->state, WIREGUARD_EPHEMERAL_EMPTY,
+		    WIREGUARD_EPHEMERAL_BUSY))
+			continue;
+		wireguard_generate_private_key(e->private_key);
+		if (!wireguard_generate_public_key(e->public_key,
+		    e->private_key)) {
+			crypto_zero(e->private_key, WIREGUARD_PRIVATE_KEY_LEN);
+			WG_ATOMIC_STORE(&e->state, WIREGUARD_EPHEMERAL_EMPTY);
+			continue;
+		}
+		WG_ATOMIC_STORE(&e->state, WIREGUARD_EPHEMERAL_READY);
+		n++;
+	}
+	return (n);
+}
+
+// Takes a precomputed keypair from the pool if there is one; otherwise
+// generates it inline as before.
+static bool
+wireguard_generate_ephemeral(uint8_t *private_key, uint8_t *public_key)
+{
+	struct wireguard_ephemeral *e;
+	int i;
+
+	for (i = 0; i < WIREGUARD_EPHEMERAL_POOL_SIZE; i++) {
+		e = &ephemeral_pool[i];
+		if (WG_ATOMIC_LOAD(&e->state) != WIREGUARD_EPHEMERAL_READY)
+			continue;
+		if (!WG_ATOMIC_CAS(&e->state, WIREGUARD_EPHEMERAL_READY,
+		    WIREGUARD_EPHEMERAL_BUSY))
+			continue;
+		memcpy(private_key, e->private_key, WIREGUARD_PRIVATE_KEY_LEN);
+		memcpy(public_key, e->public_key, WIREGUARD_PUBLIC_KEY_LEN);
+		crypto_zero(e->private_key, WIREGUARD_PRIVATE_KEY_LEN);
+		WG_ATOMIC_STORE(&e->state, WIREGUARD_EPHEMERAL_EMPTY);
+		return (true);
+	}
+	wireguard_generate_private_key(private_key);
+	return (wireguard_generate_public_key(public_key, private_key));
+}
+
 bool
 wireguard_check_mac1(struct wireguard_device *device, const uint8_t *data,
     size_t len, const uint8_t *mac1)
@@ -588,8 +1005,8 @@ wireguard_check_mac1(struct wireguard_device *device, const uint8_t *data,
 	bool result = false;
 	uint8_t calculated[WIREGUARD_COOKIE_LEN];
 
-	wireguard_mac(calculated, data, len, device->label_mac1_key,
-	    WIREGUARD_SESSION_KEY_LEN);
+	wireguard_mac_precomputed(calculated, data, len,
+	    &device->label_mac1_ctx);
 	if (crypto_equal(calculated, mac1, WIREGUARD_COOKIE_LEN)) {
 		result = true;
 	}
@@ -632,6 +1049,7 @@ wireguard_keypair_update(struct wireguard_peer *peer,
 		peer->prev_keypair = peer->curr_keypair;
 		peer->curr_keypair = peer->next_keypair;
 		wireguard_keypair_destroy(&peer->next_keypair);
+		wireguard_peer_hot_sync(peer);
 	}
 }
 
@@ -652,6 +1070,7 @@ add_new_keypair(struct wireguard_peer *peer,
 		peer->next_keypair =  new_keypair;
 		wireguard_keypair_destroy(&peer->prev_keypair);
 	}
+	wireguard_peer_hot_sync(peer);
 }
 
 void
@@ -1013,8 +1432,8 @@ wireguard_create_handshake_initiation(struct wireguard_device *device,
 	    WIREGUARD_PUBLIC_KEY_LEN);
 
 	// (Eprivi, Epubi) := DH-Generate()
-	wireguard_generate_private_key(handshake->ephemeral_private);
-	if (wireguard_generate_public_key(dst->ephemeral, handshake->ephemeral_private)) {
+	if (wireguard_generate_ephemeral(handshake->ephemeral_private,
+	    dst->ephemeral)) {
 
 		// Ci := Kdf1(Ci, Epubi)
 		wireguard_kdf1(handshake->chaining_key,
@@ -1083,10 +1502,9 @@ wireguard_create_handshake_initiation(struct wireguard_device *device,
 		// msg.mac1 := Mac(Hash(Label-Mac1 || Spubm' ), msgA)
 		// The value Hash(Label-Mac1 || Spubm' )
 		// above can be pre-computed
-		wireguard_mac(dst->mac1, dst,
+		wireguard_mac_precomputed(dst->mac1, dst,
 		    sizeof(struct wireguard_msg_handshake_initiation) -
-		    (2 * WIREGUARD_COOKIE_LEN), peer->label_mac1_key,
-		    WIREGUARD_SESSION_KEY_LEN);
+		    (2 * WIREGUARD_COOKIE_LEN), &peer->label_mac1_ctx);
 
 		// if Lm = E or Lm 120:
 		if ((peer->cookie_millis == 0) ||
@@ -1122,8 +1540,8 @@ wireguard_create_handshake_response(struct wireguard_device *device,
 	if (handshake->valid && !handshake->initiator) {
 
 		// (Eprivr, Epubr) := DH-Generate()
-		wireguard_generate_private_key(handshake->ephemeral_private);
-		if (wireguard_generate_public_key(dst->ephemeral, handshake->ephemeral_private)) {
+		if (wireguard_generate_ephemeral(handshake->ephemeral_private,
+		    dst->ephemeral)) {
 
 			// Cr := Kdf1(Cr,Epubr)
 			wireguard_kdf1(handshake->chaining_key, handshake->chaining_key, dst->ephemeral, WIREGUARD_PUBLIC_KEY_LEN);
@@ -1181,7 +1599,7 @@ wireguard_create_handshake_response(struct wireguard_device *device,
 		// 5.4.4 Cookie MACs
 		// msg.mac1 := Mac(Hash(Label-Mac1 || Spubm' ), msgA)
 		// The value Hash(Label-Mac1 || Spubm' ) above can be pre-computed
-		wireguard_mac(dst->mac1, dst, (sizeof(struct wireguard_msg_handshake_response)-(2*WIREGUARD_COOKIE_LEN)), peer->label_mac1_key, WIREGUARD_SESSION_KEY_LEN);
+		wireguard_mac_precomputed(dst->mac1, dst, (sizeof(struct wireguard_msg_handshake_response)-(2*WIREGUARD_COOKIE_LEN)), &peer->label_mac1_ctx);
 
 		// if Lm = E or Lm 120:
 		if ((peer->cookie_millis == 0) || wireguard_expired(peer->cookie_millis, WIREGUARD_COOKIE_SECRET_MAX_AGE)) {
@@ -1215,13 +1633,42 @@ wireguard_create_cookie_reply(struct wireguard_device *device,
 	    mac1, WIREGUARD_COOKIE_LEN, dst->nonce, device->label_cookie_key);
 }
 
+// The static-static DH is the costly part of setting up a peer and
+// only reads the device private key, so callers may run it on any
+// thread ahead of wireguard_peer_init_dh().
+bool
+wireguard_peer_compute_dh(struct wireguard_device *device,
+    const uint8_t *public_key, uint8_t *public_key_dh)
+{
+
+	if (wireguard_x25519(public_key_dh, device->private_key,
+	    public_key) != 0) {
+		crypto_zero(public_key_dh, WIREGUARD_PUBLIC_KEY_LEN);
+		return (false);
+	}
+	return (true);
+}
+
 bool
 wireguard_peer_init(struct wireguard_device *device,
     struct wireguard_peer *peer, const uint8_t *public_key,
     const uint8_t *preshared_key)
 {
+
+	return (wireguard_peer_init_dh(device, peer, public_key, preshared_key,
+	    NULL));
+}
+
+bool
+wireguard_peer_init_dh(struct wireguard_device *device,
+    struct wireguard_peer *peer, const uint8_t *public_key,
+    const uint8_t *preshared_key, const uint8_t *public_key_dh)
+{
+	bool r;
+
 	// Clear out structure
 	memset(peer, 0, sizeof(struct wireguard_peer));
+	peer->device = device;
 
 	if (!device->valid)
 		return peer->valid;
@@ -1234,7 +1681,15 @@ wireguard_peer_init(struct wireguard_device *device,
 	} else {
 		crypto_zero(peer->preshared_key, WIREGUARD_SESSION_KEY_LEN);
 	}
-	if (wireguard_x25519(peer->public_key_dh, device->private_key, peer->public_key) == 0) {
+	if (public_key_dh != NULL) {
+		memcpy(peer->public_key_dh, public_key_dh,
+		    WIREGUARD_PUBLIC_KEY_LEN);
+		r = true;
+	} else {
+		r = wireguard_peer_compute_dh(device, peer->public_key,
+		    peer->public_key_dh);
+	}
+	if (r) {
 		// Zero out handshake
 		memset(&peer->handshake, 0, sizeof(struct wireguard_handshake));
 		peer->handshake.valid = false;
@@ -1244,11 +1699,11 @@ wireguard_peer_init(struct wireguard_device *device,
 		// Precompute keys to deal with mac1/2 calculation
 		wireguard_mac_key(peer->label_mac1_key, peer->public_key,
 		    LABEL_MAC1, sizeof(LABEL_MAC1));
+		wireguard_mac_ctx_init(&peer->label_mac1_ctx,
+		    peer->label_mac1_key);
 		wireguard_mac_key(peer->label_cookie_key, peer->public_key,
 		    LABEL_COOKIE, sizeof(LABEL_COOKIE));
 		peer->valid = true;
-	} else {
-		crypto_zero(peer->public_key_dh, WIREGUARD_PUBLIC_KEY_LEN);
 	}
 	return (peer->valid);
 }
@@ -1270,6 +1725,8 @@ wireguard_device_init(struct wireguard_device *device,
 		// above can be pre-computed.
 		wireguard_mac_key(device->label_mac1_key, device->public_key,
 		    LABEL_MAC1, sizeof(LABEL_MAC1));
+		wireguard_mac_ctx_init(&device->label_mac1_ctx,
+		    device->label_mac1_key);
 		// 5.4.7 Under Load: Cookie Reply Message -
 		// The value Hash(Label-Cookie || Spubm) above can be
 		// pre-computed.
@@ -1424,3 +1881,173 @@ wireguard_base64_encode(const uint8_t *in, size_t inlen, char *out,
 	}
 	return result;
 }
+
+// ACL classifier.  Only packets with a complete IPv4 header are classified;
+// the caller runs the BPF programs for anything else and for the programs
+// that aren't covered by it.
+
+static uint32_t
+wireguard_acl_hash(size_t tuple, uint32_t saddr, uint32_t daddr, uint8_t proto,
+    uint16_t dport)
+{
+	uint32_t h;
+
+	h = (uint32_t)tuple * 0x9e3779b1U;
+	h = (h ^ saddr) * 0x85ebca6bU;
+	h = (h ^ daddr) * 0xc2b2ae35U;
+	h ^= ((uint32_t)proto << 16) | dport;
+	h ^= h >> 16;
+	h *= 0x7feb352dU;
+	h ^= h >> 15;
+	return (h & (WIREGUARD_ACL_HASH_SIZE - 1));
+}
+
+static void
+wireguard_acl_tuple_of(const struct mudband_bpf_rule *rule,
+    struct wireguard_acl_tuple *tuple)
+{
+
+	tuple->smask = rule->smask;
+	tuple->dmask = rule->dmask;
+	tuple->proto = (rule->flags & MUDBAND_BPF_RULE_F_PROTO) != 0;
+	tuple->dport = rule->l4len >= 4 && rule->dport_lo == rule->dport_hi;
+}
+
+static int
+wireguard_acl_tuple_find(const struct wireguard_acl_tuple *tuples, size_t n,
+    const struct wireguard_acl_tuple *tuple)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (tuples[i].smask == tuple->smask &&
+		    tuples[i].dmask == tuple->dmask &&
+		    tuples[i].proto == tuple->proto &&
+		    tuples[i].dport == tuple->dport)
+			return ((int)i);
+	}
+	return (-1);
+}
+
+// Builds the classifier from the ACL programs.  A program is either covered
+// entirely or not at all.  Returns the number of programs covered.  Also
+// tells whether the verdict of every program depends on the addresses, the
+// protocol and the ports only.
+size_t
+wireguard_acl_compile(struct wireguard_acl *acl)
+{
+	struct wireguard_acl_classifier *cl = &acl->classifier;
+	struct wireguard_acl_program *program;
+	struct wireguard_acl_tuple tuples[WIREGUARD_ACL_TUPLE_MAX], tuple;
+	struct mudband_bpf_rule rules[WIREGUARD_ACL_RULE_MAX], *rule;
+	size_t i, j, n_tuples, n_compiled = 0;
+	uint32_t h;
+	int n, t;
+
+	memset(cl, 0, sizeof(*cl));
+	for (i = 0; i < WIREGUARD_ACL_HASH_SIZE; i++)
+		cl->buckets[i] = -1;
+	acl->tuple_only = true;
+	for (i = 0; i < acl->n_programs; i++) {
+		program = &acl->programs[i];
+		program->compiled = false;
+		n = mudband_bpf_rules(program->insns, (int)program->n_insns,
+		    rules, WIREGUARD_ACL_RULE_MAX);
+		if (n < 0) {
+			acl->tuple_only = false;
+			continue;
+		}
+		if (cl->n_rules + (size_t)n > WIREGUARD_ACL_RULE_MAX)
+			continue;
+		memcpy(tuples, cl->tuples, sizeof(tuples));
+		n_tuples = cl->n_tuples;
+		for (j = 0; j < (size_t)n; j++) {
+			wireguard_acl_tuple_of(&rules[j], &tuple);
+			if (wireguard_acl_tuple_find(tuples, n_tuples,
+			    &tuple) >= 0)
+				continue;
+			if (n_tuples == WIREGUARD_ACL_TUPLE_MAX)
+				break;
+			tuples[n_tuples++] = tuple;
+		}
+		if (j < (size_t)n)
+			continue;
+		memcpy(cl->tuples, tuples, sizeof(tuples));
+		cl->n_tuples = n_tuples;
+		for (j = 0; j < (size_t)n; j++) {
+			rule = &cl->rules[cl->n_rules];
+			*rule = rules[j];
+			wireguard_acl_tuple_of(rule, &tuple);
+			t = wireguard_acl_tuple_find(cl->tuples, cl->n_tuples,
+			    &tuple);
+			assert(t >= 0);
+			h = wireguard_acl_hash((size_t)t, rule->saddr,
+			    rule->daddr, tuple.proto ? rule->proto : 0,
+			    tuple.dport ? rule->dport_lo : 0);
+			cl->next[cl->n_rules] = cl->buckets[h];
+			cl->buckets[h] = (int16_t)cl->n_rules;
+			cl->n_rules++;
+		}
+		program->compiled = true;
+		n_compiled++;
+	}
+	return (n_compiled);
+}
+
+// Returns 1 if any compiled program accepts the packet, 0 if none does and
+// -1 if the packet isn't something the classifier can answer for.
+int
+wireguard_acl_classify(const struct wireguard_acl *acl, const uint8_t *pkt,
+    size_t len)
+{
+	const struct wireguard_acl_classifier *cl = &acl->classifier;
+	const struct wireguard_acl_tuple *tuple;
+	const struct mudband_bpf_rule *rule;
+	uint32_t saddr, daddr, h;
+	uint16_t frag, sport = 0, dport = 0;
+	size_t hlen, l4len = 0, i;
+	int16_t x;
+
+	if (len < 20 || (pkt[0] >> 4) != 4 || (pkt[0] & 0x0f) < 5)
+		return (-1);
+	hlen = (pkt[0] & 0x0f) * 4;
+	frag = (uint16_t)(((pkt[6] << 8) | pkt[7]) & 0x1fff);
+	saddr = ((uint32_t)pkt[12] << 24) | ((uint32_t)pkt[13] << 16) |
+	    ((uint32_t)pkt[14] << 8) | pkt[15];
+	daddr = ((uint32_t)pkt[16] << 24) | ((uint32_t)pkt[17] << 16) |
+	    ((uint32_t)pkt[18] << 8) | pkt[19];
+	if (len >= hlen + 2) {
+		sport = (uint16_t)((pkt[hlen] << 8) | pkt[hlen + 1]);
+		l4len = 2;
+	}
+	if (len >= hlen + 4) {
+		dport = (uint16_t)((pkt[hlen + 2] << 8) | pkt[hlen + 3]);
+		l4len = 4;
+	}
+	for (i = 0; i < cl->n_tuples; i++) {
+		tuple = &cl->tuples[i];
+		if (tuple->dport && l4len < 4)
+			continue;
+		h = wireguard_acl_hash(i, saddr & tuple->smask,
+		    daddr & tuple->dmask, tuple->proto ? pkt[9] : 0,
+		    tuple->dport ? dport : 0);
+		for (x = cl->buckets[h]; x >= 0; x = cl->next[x]) {
+			rule = &cl->rules[x];
+			if ((saddr & rule->smask) != rule->saddr ||
+			    (daddr & rule->dmask) != rule->daddr)
+				continue;
+			if ((rule->flags & MUDBAND_BPF_RULE_F_PROTO) != 0 &&
+			    pkt[9] != rule->proto)
+				continue;
+			if ((rule->flags & MUDBAND_BPF_RULE_F_NOFRAG) != 0 &&
+			    frag != 0)
+				continue;
+			if (l4len < rule->l4len ||
+			    sport < rule->sport_lo || sport > rule->sport_hi ||
+			    dport < rule->dport_lo || dport > rule->dport_hi)
+				continue;
+			return (1);
+		}
+	}
+	return (0);
+}
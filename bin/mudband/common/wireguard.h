@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#include "crypto/blake2s.h"
 #include "mudband_bpf.h"
 #include "callout.h"
 /* Platform-specific functions that need to be implemented per-platform */
@@ -65,6 +66,9 @@
 #define WIREGUARD_REKEY_TIMEOUT		(5)
 #define WIREGUARD_KEEPALIVE_TIMEOUT	(25)
 
+// Precomputed ephemeral keypairs kept for handshake creation
+#define WIREGUARD_EPHEMERAL_POOL_SIZE	(16)
+
 struct wireguard_keypair {
 	bool		valid;
 	/*
@@ -111,19 +115,28 @@ struct wireguard_allowed_ip {
 
 #define	WIREGUARD_PEER_CONNECTS_MAX	16
 
+struct wireguard_device;
+
+/*
+ * The fields touched for every data packet come first so they share the
+ * first few cache lines; handshake and cookie state, which only matter
+ * a few times per REKEY_AFTER_TIME, are kept at the tail.
+ */
 struct wireguard_peer {
 	bool		valid;	/* Is this peer initialised? */
 	bool		active; /* Should we be actively trying to connect? */
+	/*
+	 * We set this flag on RX/TX of packets if we think that we
+	 * should initiate a new handshake
+	 */
+	bool		send_handshake;
 
 	uint32_t	iface_addr;
-	/* This is the configured IP of the peer (endpoint) */
-	struct {
-		bool		alive;		/* got a handshake response */
-		bool		is_proxy;
-		uint32_t	ip;
-		uint16_t	port;
-	} endpoints[WIREGUARD_PEER_CONNECTS_MAX];
-	uint8_t		n_endpoints;
+
+	/* last_tx and last_rx of data packets */
+	uint32_t	last_tx;
+	uint32_t	last_rx;
+
 	/* This is the latest received IP/port */
 	bool		endpoint_latest_is_proxy;
 	uint32_t	endpoint_latest_ip;
@@ -139,6 +152,28 @@ struct wireguard_peer {
 
 	struct wireguard_allowed_ip allowed_source_ips[WIREGUARD_MAX_SRC_IPS];
 
+	/* Session keypairs */
+	struct wireguard_keypair curr_keypair;
+	struct wireguard_keypair prev_keypair;
+	struct wireguard_keypair next_keypair;
+
+	/* The device this peer belongs to */
+	struct wireguard_device *device;
+
+	/* The last time we sent an initiation message to this peer */
+	uint32_t	last_initiation_tx;
+	/* The last time we received a valid initiation message */
+	uint32_t	last_initiation_rx;
+
+	/* This is the configured IP of the peer (endpoint) */
+	struct {
+		bool		alive;		/* got a handshake response */
+		bool		is_proxy;
+		uint32_t	ip;
+		uint16_t	port;
+	} endpoints[WIREGUARD_PEER_CONNECTS_MAX];
+	uint8_t		n_endpoints;
+
 	uint8_t		public_key[WIREGUARD_PUBLIC_KEY_LEN];
 	uint8_t		preshared_key[WIREGUARD_SESSION_KEY_LEN];
 
@@ -148,11 +183,6 @@ struct wireguard_peer {
 	 */
 	uint8_t		public_key_dh[WIREGUARD_PUBLIC_KEY_LEN];
 
-	/* Session keypairs */
-	struct wireguard_keypair curr_keypair;
-	struct wireguard_keypair prev_keypair;
-	struct wireguard_keypair next_keypair;
-
 	/*
 	 * 5.1 Silence is a Virtue: The responder keeps track of the
 	 * greatest timestamp received per peer
@@ -173,32 +203,51 @@ struct wireguard_peer {
 	/* Precomputed keys for use in mac validation */
 	uint8_t		label_cookie_key[WIREGUARD_SESSION_KEY_LEN];
 	uint8_t		label_mac1_key[WIREGUARD_SESSION_KEY_LEN];
-
-	/* The last time we received a valid initiation message */
-	uint32_t	last_initiation_rx;
-	/* The last time we sent an initiation message to this peer */
-	uint32_t	last_initiation_tx;
-
-	/* last_tx and last_rx of data packets */
-	uint32_t	last_tx;
-	uint32_t	last_rx;
-
-	/*
-	 * We set this flag on RX/TX of packets if we think that we
-	 * should initiate a new handshake
-	 */
-	bool		send_handshake;
+	/* Keyed BLAKE2s state with label_mac1_key already absorbed */
+	blake2s_ctx	label_mac1_ctx;
 
 	bool		otp_enabled;
 	uint64_t	otp_sender;
 	uint64_t	otp_receiver[3];
 };
 
+/*
+ * A reference to a peer slot which survives peer table updates.  The
+ * generation is bumped whenever the slot is released, so a stale handle
+ * resolves to NULL rather than to whichever peer reused the slot.
+ */
+struct wireguard_peer_handle {
+	int		index;
+	uint32_t	gen;
+};
+
+/*
+ * Per-peer lookup keys packed two to a cache line, kept in the same order
+ * as device->peers.  Scans for a receiver index or an allowed IP walk this
+ * array instead of the full peer structures.
+ */
+#define	WIREGUARD_PEER_HOT_CURR		0x01
+#define	WIREGUARD_PEER_HOT_NEXT		0x02
+#define	WIREGUARD_PEER_HOT_PREV		0x04
+
+struct wireguard_peer_hot {
+	uint32_t	receivers[3];	/* curr, next, prev local_index */
+	uint8_t		receivers_valid;
+	bool		valid;
+	uint8_t		n_allowed_ips;
+	struct {
+		uint32_t	ip;	/* already masked */
+		uint32_t	mask;
+	} allowed_ips[WIREGUARD_MAX_SRC_IPS];
+};
+
 #define	WIREGUARD_ACL_PROGRAM_INSNS_MAX	256
 
 struct wireguard_acl_program {
 	struct mudband_bpf_insn insns[256];
 	size_t n_insns;
+	struct mudband_bpf_jit jit;
+	bool	compiled;	/* covered by the classifier */
 };
 
 #define	WIREGUARD_ACL_PROGRAM_MAX	64
@@ -208,10 +257,38 @@ enum wireguard_acl_policy {
 	WIREGUARD_ACL_POLICY_BLOCK
 };
 
+/*
+ * The rules recovered from the ACL programs, indexed by tuple space
+ * search: rules sharing the same address masks, protocol and exact
+ * destination port-ness form a tuple and are hashed on those fields, so a
+ * lookup costs one probe per tuple rather than one BPF run per program.
+ */
+#define	WIREGUARD_ACL_RULE_MAX		256
+#define	WIREGUARD_ACL_TUPLE_MAX		16
+#define	WIREGUARD_ACL_HASH_SIZE		512	/* power of 2 */
+
+struct wireguard_acl_tuple {
+	uint32_t	smask;
+	uint32_t	dmask;
+	bool		proto;
+	bool		dport;
+};
+
+struct wireguard_acl_classifier {
+	struct mudband_bpf_rule rules[WIREGUARD_ACL_RULE_MAX];
+	int16_t		next[WIREGUARD_ACL_RULE_MAX];
+	int16_t		buckets[WIREGUARD_ACL_HASH_SIZE];
+	size_t		n_rules;
+	struct wireguard_acl_tuple tuples[WIREGUARD_ACL_TUPLE_MAX];
+	size_t		n_tuples;
+};
+
 struct wireguard_acl {
 	struct wireguard_acl_program programs[64];
   	size_t n_programs;
 	enum wireguard_acl_policy default_policy;
+	struct wireguard_acl_classifier classifier;
+	bool	tuple_only;	/* no program looks beyond the 5-tuple */
 };
 
 struct wireguard_device {
@@ -230,10 +307,24 @@ struct wireguard_device {
 	/* Precalculated */
  	uint8_t		label_cookie_key[WIREGUARD_SESSION_KEY_LEN];
 	uint8_t		label_mac1_key[WIREGUARD_SESSION_KEY_LEN];
+	blake2s_ctx	label_mac1_ctx;
 
 	/* List of peers associated with this device */
  	struct wireguard_peer *peers;
  	int		peers_count;
+	/*
+	 * Slab bookkeeping when the peers are managed by
+	 * wireguard_peer_slab_alloc(); peers_count is the high-water mark
+	 * and released slots stay in place with valid cleared.
+	 */
+	uint32_t	*peers_gen;
+	int		*peers_free;
+	int		peers_nfree;
+	int		peers_cap;
+	/* Built by wireguard_device_peers_index() */
+	struct wireguard_peer_hot *peers_hot;
+	struct wireguard_peer *peers_hot_base;
+	int		peers_hot_count;
 
 	struct wireguard_acl acl;
 
@@ -305,10 +396,27 @@ bool	wireguard_device_init(struct wireguard_device *device,
 bool	wireguard_peer_init(struct wireguard_device *device,
 	    struct wireguard_peer *peer, const uint8_t *public_key,
 	    const uint8_t *preshared_key);
+bool	wireguard_peer_init_dh(struct wireguard_device *device,
+	    struct wireguard_peer *peer, const uint8_t *public_key,
+	    const uint8_t *preshared_key, const uint8_t *public_key_dh);
+bool	wireguard_peer_compute_dh(struct wireguard_device *device,
+	    const uint8_t *public_key, uint8_t *public_key_dh);
 struct wireguard_peer *
 	wireguard_peer_alloc(struct wireguard_device *device);
 int	wireguard_peer_index(struct wireguard_device *device,
 	    struct wireguard_peer *peer);
+void	wireguard_device_peers_index(struct wireguard_device *device);
+bool	wireguard_peer_slab_reserve(struct wireguard_device *device, int n);
+struct wireguard_peer *
+	wireguard_peer_slab_alloc(struct wireguard_device *device);
+void	wireguard_peer_slab_release(struct wireguard_device *device,
+	    struct wireguard_peer *peer);
+void	wireguard_peer_slab_fini(struct wireguard_device *device);
+void	wireguard_peer_handle_get(struct wireguard_device *device,
+	    struct wireguard_peer *peer, struct wireguard_peer_handle *handle);
+struct wireguard_peer *
+	wireguard_peer_handle_resolve(struct wireguard_device *device,
+	    const struct wireguard_peer_handle *handle);
 struct wireguard_peer *
 	wireguard_peer_lookup_by_pubkey(struct wireguard_device *device,
 	    uint8_t *public_key);
@@ -318,6 +426,9 @@ struct wireguard_peer *
 struct wireguard_peer *
 	wireguard_peer_lookup_by_receiver(struct wireguard_device *device,
 	     uint32_t receiver);
+struct wireguard_peer *
+	wireguard_peer_lookup_by_allowed_ip(struct wireguard_device *device,
+	     uint32_t ipaddr);
 struct wireguard_peer *
 	wireguard_peer_lookup_by_handshake(struct wireguard_device *device,
 	     uint32_t receiver);
@@ -367,5 +478,9 @@ bool	wireguard_base64_encode(const uint8_t *in, size_t inlen, char *out,
 void	wireguard_generate_private_key(uint8_t *key);
 bool	wireguard_generate_public_key(uint8_t *public_key,
 	    const uint8_t *private_key);
+int	wireguard_ephemeral_refill(void);
+size_t	wireguard_acl_compile(struct wireguard_acl *acl);
+int	wireguard_acl_classify(const struct wireguard_acl *acl,
+	    const uint8_t *pkt, size_t len);
 
 #endif /* _WIREGUARD_H_ */
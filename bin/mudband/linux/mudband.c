@@ -32,12 +32,14 @@
 
 #include <sys/param.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <linux/if_tun.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
@@ -55,11 +57,13 @@
 
 #include "linux/vpf.h"
 #include "odr.h"
+#include "odr_pthread.h"
 #include "vassert.h"
 #include "vhttps.h"
 #include "vopt.h"
 #include "vqueue.h"
 #include "vtc_log.h"
+#include "vtim.h"
 
 #include "callout.h"
 #include "wireguard-pbuf.h"
@@ -67,8 +71,13 @@
 #define	MUDBAND_VERSION		"v0.1.3"
 
 #define WIREGUARD_IFACE_DEFAULT_PORT		(51820)
-#define WIREGUARD_IFACE_KEEPALIVE_DEFAULT	(0xFFFF)
 #define WIREGUARD_IFACE_INVALID_INDEX		(-1)
+#define WIREGUARD_IFACE_PRECOMPUTE_THREADS_MAX	8
+#define WIREGUARD_IFACE_PRECOMPUTE_JOBS_PER_THREAD	64
+#define WIREGUARD_IFACE_ACL_FLOW_SETS		1024	/* power of 2 */
+#define WIREGUARD_IFACE_ACL_FLOW_WAYS		4
+#define WIREGUARD_IFACE_CT_SETS			2048	/* power of 2 */
+#define WIREGUARD_IFACE_CT_WAYS			4
 
 #define WIREGUARD_IPHDR_HI_BYTE(byte)	(((byte) >> 4) & 0x0F)
 #define WIREGUARD_IPHDR_LO_BYTE(byte)	((byte) & 0x0F)
@@ -112,6 +121,77 @@ struct wireguard_sockaddr {
 	} proxy;
 };
 
+/*
+ * What the last sync applied.  The config it came from is kept busy so
+ * the next sync can compare the peers' JSON one by one and only rebuild
+ * the peers which were added, removed or modified.  Entries are found by
+ * the base64 public key through an open addressing table.
+ */
+struct wireguard_iface_sync_ent {
+	const char	*public_key;
+	json_t		*jpeer;
+	struct wireguard_peer_handle handle;
+};
+
+struct wireguard_iface_sync {
+	struct cnf	*cnf;
+	struct wireguard_iface_sync_ent *ents;
+	int		n_ents;
+	int		*hash;		/* index into ents, -1 if empty */
+	uint32_t	hash_mask;
+};
+
+/*
+ * ACL verdict cache keyed by the 5-tuple.  A set holds 4 ways of 16 bytes
+ * so one lookup touches one cache line.  Entries whose generation doesn't
+ * match wg_acl_flow_gen belong to a previous ACL and count as empty.
+ */
+struct wireguard_iface_acl_flow {
+	uint32_t	saddr;
+	uint32_t	daddr;
+	uint32_t	ports;
+	uint16_t	gen;
+	uint8_t		proto;
+	uint8_t		flags;
+#define	WIREGUARD_IFACE_ACL_FLOW_F_DROP		0x01
+#define	WIREGUARD_IFACE_ACL_FLOW_F_REF		0x02	/* clock bit */
+};
+
+struct wireguard_iface_acl_flow_set {
+	struct wireguard_iface_acl_flow ways[WIREGUARD_IFACE_ACL_FLOW_WAYS];
+} __attribute__((aligned(64)));
+
+/*
+ * Connection tracking for the ACL.  Outbound packets create or refresh an
+ * entry keyed by their 5-tuple (the ICMP echo id stands in for the ports);
+ * inbound packets whose reversed tuple finds a live entry are replies and
+ * skip the ACL programs.
+ */
+enum wireguard_iface_ct_state {
+	WIREGUARD_IFACE_CT_NONE = 0,
+	WIREGUARD_IFACE_CT_TCP_SYN_SENT,
+	WIREGUARD_IFACE_CT_TCP_ESTABLISHED,
+	WIREGUARD_IFACE_CT_TCP_CLOSING,
+	WIREGUARD_IFACE_CT_UDP_UNREPLIED,
+	WIREGUARD_IFACE_CT_UDP_REPLIED,
+	WIREGUARD_IFACE_CT_ICMP,
+	WIREGUARD_IFACE_CT_MAX
+};
+
+struct wireguard_iface_ct {
+	uint32_t	saddr;		/* local */
+	uint32_t	daddr;		/* remote */
+	uint16_t	sport;
+	uint16_t	dport;
+	uint32_t	expire;		/* wireguard_sys_now() */
+	uint8_t		proto;
+	uint8_t		state;
+};
+
+struct wireguard_iface_ct_set {
+	struct wireguard_iface_ct ways[WIREGUARD_IFACE_CT_WAYS];
+};
+
 struct wireguard_iface_init_data {
 	/* Required: the private key of this WireGuard network interface */
 	const char *private_key;
@@ -132,6 +212,9 @@ struct wireguard_iface_stat {
 	uint64_t	n_udp_proxy_rx_pkts;
 	uint64_t	n_udp_proxy_tx_pkts;
 	uint64_t	n_udp_proxy_rx_errs;
+	uint64_t	n_acl_flow_hits;
+	uint64_t	n_acl_flow_misses;
+	uint64_t	n_acl_ct_replies;
 	uint64_t	bytes_tun_rx;
 	uint64_t	bytes_tun_tx;
 	uint64_t	bytes_udp_rx;
@@ -139,8 +222,74 @@ struct wireguard_iface_stat {
 	uint64_t	bytes_udp_proxy_rx;
 	uint64_t	bytes_udp_proxy_tx;
 };
-static struct wireguard_iface_stat wg_stat;
+/*
+ * Counters live in per-thread shards, each on its own cache lines, and are
+ * only summed up when read.  Every counter has a single writer, the thread
+ * owning the shard, so a relaxed store is enough for readers on other
+ * threads never to see a torn value.  Per-peer counters follow the same
+ * scheme with one array per shard indexed by the peer's slab slot; those
+ * arrays are only resized from the peer table update.  The last shard
+ * is shared by the threads which come after the others are taken; those
+ * add atomically.
+ */
+#define	WIREGUARD_IFACE_STAT_SHARDS	8
+
+struct wireguard_iface_peer_stat {
+	uint64_t	n_rx_pkts;
+	uint64_t	n_tx_pkts;
+	uint64_t	n_drops;
+	uint64_t	bytes_rx;
+	uint64_t	bytes_tx;
+};
+
+struct wireguard_iface_stat_shard {
+	struct wireguard_iface_stat stat;
+	struct wireguard_iface_peer_stat *peers;
+	int		shared;
+} __attribute__((aligned(64)));
+
+static struct wireguard_iface_stat_shard
+		wg_stat_shards[WIREGUARD_IFACE_STAT_SHARDS] = {
+	[WIREGUARD_IFACE_STAT_SHARDS - 1] = { .shared = 1 }
+};
+static unsigned	wg_stat_n_shards;
+static int	wg_stat_peers_cap;
+static __thread struct wireguard_iface_stat_shard *wg_stat_self;
+
+#define	WG_STAT_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define	WG_STAT_BUMP(shard, p, v)	do {				\
+	if ((shard)->shared)						\
+		(void)__atomic_fetch_add((p), (v), __ATOMIC_RELAXED);	\
+	else								\
+		WG_STAT_STORE((p), *(p) + (v));				\
+} while (0)
+#define	WG_STAT_ADD(field, v)	do {					\
+	struct wireguard_iface_stat_shard *_sh =			\
+	    wireguard_iface_stat_shard();				\
+	WG_STAT_BUMP(_sh, &_sh->stat.field, (v));			\
+} while (0)
+#define	WG_STAT_INC(field)	WG_STAT_ADD(field, 1)
+#define	WG_PEER_STAT_ADD(device, peer, field, v)	do {		\
+	struct wireguard_iface_stat_shard *_sh =			\
+	    wireguard_iface_stat_shard();				\
+	struct wireguard_iface_peer_stat *_ps =				\
+	    wireguard_iface_peer_stat(_sh, device, peer);		\
+	if (_ps != NULL)						\
+		WG_STAT_BUMP(_sh, &_ps->field, (v));			\
+} while (0)
+#define	WG_PEER_STAT_INC(device, peer, field)				\
+	WG_PEER_STAT_ADD(device, peer, field, 1)
 static struct callout wg_stat_co;
+static struct wireguard_iface_acl_flow_set
+		wg_acl_flows[WIREGUARD_IFACE_ACL_FLOW_SETS];
+static uint16_t	wg_acl_flow_gen = 1;
+static unsigned	wg_acl_flow_hand;
+static struct wireguard_iface_ct_set wg_ct[WIREGUARD_IFACE_CT_SETS];
+static struct wireguard_iface_sync wg_sync;
+/* Seconds, indexed by enum wireguard_iface_ct_state. */
+static const uint32_t wg_ct_timeouts[WIREGUARD_IFACE_CT_MAX] = {
+	0, 120, 7200, 10, 30, 180, 30
+};
 
 static struct vtclog *stats_vl;
 struct vtclog *band_vl;
@@ -148,12 +297,12 @@ const char *band_b_arg;
 char *band_confdir_root;
 char *band_confdir_enroll;
 int band_need_iface_sync = 1;
-int band_need_peer_snapahot;
 int band_mfa_authentication_required;
 char band_mfa_authentication_url[512];
 
 static struct callout_block wg_cb;
 static int wg_aborted;
+static odr_pthread_t wg_ephemeral_tp;
 static int orig_argc;
 static char **orig_argv;
 
@@ -161,12 +310,276 @@ static int wg_tunfd = -1;
 static char wg_tunname[IFNAMSIZ];
 static unsigned S_flag = 0;
 unsigned status_snapshot_flag = 0;
+static uint32_t pbuf_pool_size = 0;
+
+static struct wireguard_iface_stat_shard *
+wireguard_iface_stat_shard(void)
+{
+	struct wireguard_iface_stat_shard *shard;
+	unsigned i;
+
+	if (wg_stat_self != NULL)
+		return (wg_stat_self);
+	i = __sync_fetch_and_add(&wg_stat_n_shards, 1);
+	if (i >= WIREGUARD_IFACE_STAT_SHARDS - 1)
+		i = WIREGUARD_IFACE_STAT_SHARDS - 1;
+	shard = &wg_stat_shards[i];
+	/* The shared one gets its peers from the resize. */
+	if (!shard->shared && shard->peers == NULL && wg_stat_peers_cap > 0) {
+		shard->peers = calloc(wg_stat_peers_cap, sizeof(*shard->peers));
+		AN(shard->peers);
+	}
+	wg_stat_self = shard;
+	return (shard);
+}
+
+static struct wireguard_iface_peer_stat *
+wireguard_iface_peer_stat(struct wireguard_iface_stat_shard *shard,
+    struct wireguard_device *device, struct wireguard_peer *peer)
+{
+	int x;
+
+	x = (int)(peer - device->peers);
+	if (shard->peers == NULL || x < 0 || x >= wg_stat_peers_cap)
+		return (NULL);
+	return (&shard->peers[x]);
+}
+
+static void
+wireguard_iface_stat_sum(struct wireguard_iface_stat *st)
+{
+	const uint64_t *src;
+	uint64_t *dst;
+	unsigned i, n;
+	size_t j;
+
+	memset(st, 0, sizeof(*st));
+	dst = (uint64_t *)st;
+	n = __atomic_load_n(&wg_stat_n_shards, __ATOMIC_ACQUIRE);
+	if (n > WIREGUARD_IFACE_STAT_SHARDS)
+		n = WIREGUARD_IFACE_STAT_SHARDS;
+	for (i = 0; i < n; i++) {
+		src = (const uint64_t *)&wg_stat_shards[i].stat;
+		for (j = 0; j < sizeof(*st) / sizeof(uint64_t); j++)
+			dst[j] += __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+	}
+}
+
+static void
+wireguard_iface_peer_stat_sum(int x, struct wireguard_iface_peer_stat *ps)
+{
+	struct wireguard_iface_peer_stat *src;
+	unsigned i;
+
+	memset(ps, 0, sizeof(*ps));
+	if (x < 0 || x >= wg_stat_peers_cap)
+		return;
+	for (i = 0; i < WIREGUARD_IFACE_STAT_SHARDS; i++) {
+		if (wg_stat_shards[i].peers == NULL)
+			continue;
+		src = &wg_stat_shards[i].peers[x];
+		ps->n_rx_pkts += __atomic_load_n(&src->n_rx_pkts,
+		    __ATOMIC_RELAXED);
+		ps->n_tx_pkts += __atomic_load_n(&src->n_tx_pkts,
+		    __ATOMIC_RELAXED);
+		ps->n_drops += __atomic_load_n(&src->n_drops,
+		    __ATOMIC_RELAXED);
+		ps->bytes_rx += __atomic_load_n(&src->bytes_rx,
+		    __ATOMIC_RELAXED);
+		ps->bytes_tx += __atomic_load_n(&src->bytes_tx,
+		    __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Called from the peer table update, with the data path quiesced, once
+ * the slab might have grown.
+ */
+static void
+wireguard_iface_peer_stat_resize(int cap)
+{
+	struct wireguard_iface_peer_stat *peers;
+	unsigned i;
+
+	if (cap <= wg_stat_peers_cap)
+		return;
+	for (i = 0; i < WIREGUARD_IFACE_STAT_SHARDS; i++) {
+		if (i >= wg_stat_n_shards && !wg_stat_shards[i].shared &&
+		    wg_stat_shards[i].peers == NULL)
+			continue;
+		peers = realloc(wg_stat_shards[i].peers, cap * sizeof(*peers));
+		AN(peers);
+		memset(&peers[wg_stat_peers_cap], 0,
+		    (cap - wg_stat_peers_cap) * sizeof(*peers));
+		wg_stat_shards[i].peers = peers;
+	}
+	wg_stat_peers_cap = cap;
+}
+
+static void
+wireguard_iface_peer_stat_reset(int x)
+{
+	unsigned i;
+
+	if (x < 0 || x >= wg_stat_peers_cap)
+		return;
+	for (i = 0; i < WIREGUARD_IFACE_STAT_SHARDS; i++) {
+		if (wg_stat_shards[i].peers == NULL)
+			continue;
+		memset(&wg_stat_shards[i].peers[x], 0,
+		    sizeof(struct wireguard_iface_peer_stat));
+	}
+}
+
+/*
+ * Peer status published by the data thread for the task thread.  Each
+ * entry, indexed by the peer's slab slot, has its own sequence counter:
+ * the writer makes it odd while updating the entry and readers retry their
+ * copy until they see the same even value before and after.  Neither side
+ * ever waits for the other.  The table is replaced when the slab grows;
+ * a retired table is freed once no reader is inside one.
+ */
+struct wireguard_peer_snapshot_entry {
+	unsigned	seq;
+	bool		valid;
+	struct wireguard_peer_snapshot snap;
+} __attribute__((aligned(64)));
+
+struct wireguard_peer_snapshot_table {
+	int		n;
+	struct wireguard_peer_snapshot_table *retired;
+	struct wireguard_peer_snapshot_entry entries[];
+};
+
+static struct wireguard_peer_snapshot_table *wg_peer_snapshots;
+static unsigned	wg_peer_snapshot_readers;
+
+static void
+wireguard_peer_snapshot_write(struct wireguard_peer_snapshot_entry *e,
+    struct wireguard_peer *peer, int x)
+{
+	struct wireguard_iface_peer_stat ps;
+	unsigned seq;
+
+	seq = e->seq;
+	__atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->valid = peer->valid;
+	e->snap.iface_addr = peer->iface_addr;
+	e->snap.endpoint_ip = peer->endpoint_latest_ip;
+	e->snap.endpoint_port = peer->endpoint_latest_port;
+	e->snap.endpoint_t_heartbeated = peer->endpoint_latest_t_heartbeated;
+	wireguard_iface_peer_stat_sum(x, &ps);
+	e->snap.n_rx_pkts = ps.n_rx_pkts;
+	e->snap.n_tx_pkts = ps.n_tx_pkts;
+	e->snap.n_drops = ps.n_drops;
+	e->snap.bytes_rx = ps.bytes_rx;
+	e->snap.bytes_tx = ps.bytes_tx;
+	__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Called by the data thread whenever the published state of a peer changes. */
+static void
+wireguard_peer_snapshot_update(struct wireguard_device *device,
+    struct wireguard_peer *peer)
+{
+	struct wireguard_peer_snapshot_table *tbl = wg_peer_snapshots;
+	int x;
+
+	x = (int)(peer - device->peers);
+	if (tbl == NULL || x < 0 || x >= tbl->n)
+		return;
+	wireguard_peer_snapshot_write(&tbl->entries[x], peer, x);
+}
+
+/* Rewrites every entry after a peer table update. */
+static void
+wireguard_peer_snapshot_sync(struct wireguard_device *device)
+{
+	struct wireguard_peer_snapshot_table *tbl, *old, *next;
+	struct wireguard_peer_snapshot_entry *e;
+	int i;
+
+	old = wg_peer_snapshots;
+	tbl = old;
+	if (tbl == NULL || tbl->n < device->peers_cap) {
+		tbl = calloc(1, sizeof(*tbl) +
+		    device->peers_cap * sizeof(tbl->entries[0]));
+		AN(tbl);
+		tbl->n = device->peers_cap;
+	}
+	for (i = 0; i < tbl->n; i++) {
+		if (i < device->peers_count) {
+			wireguard_peer_snapshot_write(&tbl->entries[i],
+			    &device->peers[i], i);
+		} else if (tbl->entries[i].valid) {
+			e = &tbl->entries[i];
+			__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			e->valid = false;
+			__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+		}
+	}
+	if (tbl != old) {
+		tbl->retired = old;
+		__atomic_store_n(&wg_peer_snapshots, tbl, __ATOMIC_SEQ_CST);
+	}
+	if (tbl->retired != NULL &&
+	    __atomic_load_n(&wg_peer_snapshot_readers, __ATOMIC_SEQ_CST) == 0) {
+		for (old = tbl->retired; old != NULL; old = next) {
+			next = old->retired;
+			free(old);
+		}
+		tbl->retired = NULL;
+	}
+}
+
+/*
+ * Returns a consistent copy of every valid peer's status; the caller
+ * frees *out.  Safe to call from any thread.
+ */
+int
+wireguard_peer_snapshot_get(struct wireguard_peer_snapshot **out)
+{
+	struct wireguard_peer_snapshot_table *tbl;
+	struct wireguard_peer_snapshot_entry *e;
+	struct wireguard_peer_snapshot snap;
+	unsigned s1, s2;
+	bool valid;
+	int i, n = 0;
+
+	*out = NULL;
+	__atomic_add_fetch(&wg_peer_snapshot_readers, 1, __ATOMIC_SEQ_CST);
+	tbl = __atomic_load_n(&wg_peer_snapshots, __ATOMIC_SEQ_CST);
+	if (tbl == NULL || tbl->n == 0)
+		goto done;
+	*out = malloc(tbl->n * sizeof(**out));
+	AN(*out);
+	for (i = 0; i < tbl->n; i++) {
+		e = &tbl->entries[i];
+		do {
+			s1 = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+			valid = e->valid;
+			snap = e->snap;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			s2 = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+		} while ((s1 & 1) != 0 || s1 != s2);
+		if (valid)
+			(*out)[n++] = snap;
+	}
+done:
+	__atomic_sub_fetch(&wg_peer_snapshot_readers, 1, __ATOMIC_SEQ_CST);
+	return (n);
+}
 
 json_t *
 wireguard_iface_stat_to_json(void)
 {
+	struct wireguard_iface_stat wg_stat;
+	struct pbuf_pool_stat pool_stat;
 	json_t *jroot;
 
+	wireguard_iface_stat_sum(&wg_stat);
 	jroot = json_object();
 	AN(jroot);
 
@@ -188,6 +601,17 @@ wireguard_iface_stat_to_json(void)
 	    json_integer(wg_stat.n_udp_proxy_tx_pkts));
 	json_object_set_new(jroot, "n_udp_proxy_rx_errs",
 	    json_integer(wg_stat.n_udp_proxy_rx_errs));
+	json_object_set_new(jroot, "n_acl_flow_hits",
+	    json_integer(wg_stat.n_acl_flow_hits));
+	json_object_set_new(jroot, "n_acl_flow_misses",
+	    json_integer(wg_stat.n_acl_flow_misses));
+	json_object_set_new(jroot, "n_acl_ct_replies",
+	    json_integer(wg_stat.n_acl_ct_replies));
+	PBUF_pool_stat(&pool_stat);
+	json_object_set_new(jroot, "n_pbuf_pool_bufs",
+	    json_integer(pool_stat.n_bufs));
+	json_object_set_new(jroot, "n_pbuf_pool_alloc_fails",
+	    json_integer(pool_stat.n_alloc_fails));
 	json_object_set_new(jroot, "bytes_tun_rx",
 	    json_integer(wg_stat.bytes_tun_rx));
 	json_object_set_new(jroot, "bytes_tun_tx",
@@ -261,7 +685,7 @@ sighup_func(int signo)
 
 	(void)signo;
 
-	band_need_iface_sync = 1;
+	__atomic_store_n(&band_need_iface_sync, 1, __ATOMIC_RELEASE);
 }
 
 int
@@ -527,8 +951,8 @@ wireguard_iface_peer_output_multipath(struct wireguard_device *device,
 		if (pr->endpoints[x].is_proxy) {
 			buf = wireguard_iface_prepend_proxy_pkthdr(buf, &buflen,
 			    device->iface_addr, pr->iface_addr);
-			wg_stat.n_udp_proxy_tx_pkts++;
-			wg_stat.bytes_udp_proxy_tx += buflen;
+			WG_STAT_INC(n_udp_proxy_tx_pkts);
+			WG_STAT_ADD(bytes_udp_proxy_tx, buflen);
 		}
 		memset(&sin, 0, sizeof(sin));
 		sin.sin_family = AF_INET;
@@ -537,9 +961,9 @@ wireguard_iface_peer_output_multipath(struct wireguard_device *device,
 		l = sendto(device->udp_fd, buf, buflen, 0,
 		    (struct sockaddr *)&sin, sizeof(sin));
 		if (l == -1) {
-			wg_stat.n_udp_tx_errs++;
+			WG_STAT_INC(n_udp_tx_errs);
 			if (errno == ENOBUFS) {
-				wg_stat.n_nobufs++;
+				WG_STAT_INC(n_nobufs);
 				return (-1);
 			}
 			vtc_log(band_vl, 0,
@@ -549,8 +973,8 @@ wireguard_iface_peer_output_multipath(struct wireguard_device *device,
 			return (-1);
 		}
 		assert(l == buflen);
-		wg_stat.n_udp_tx_pkts++;
-		wg_stat.bytes_udp_tx += buflen;
+		WG_STAT_INC(n_udp_tx_pkts);
+		WG_STAT_ADD(bytes_udp_tx, buflen);
 	}
 	if (same_endpoint)
 		return (1);
@@ -576,8 +1000,8 @@ wireguard_iface_peer_output(struct wireguard_device *device, struct pbuf *q,
 	if (peer->endpoint_latest_is_proxy) {
 		buf = wireguard_iface_prepend_proxy_pkthdr(buf, &buflen,
 		    device->iface_addr, peer->iface_addr);
-		wg_stat.n_udp_proxy_tx_pkts++;
-		wg_stat.bytes_udp_proxy_tx += buflen;
+		WG_STAT_INC(n_udp_proxy_tx_pkts);
+		WG_STAT_ADD(bytes_udp_proxy_tx, buflen);
 	}
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
@@ -586,9 +1010,9 @@ wireguard_iface_peer_output(struct wireguard_device *device, struct pbuf *q,
 	l = sendto(device->udp_fd, buf, buflen, 0,
 	    (struct sockaddr *)&sin, sizeof(sin));
 	if (l == -1) {
-		wg_stat.n_udp_tx_errs++;
+		WG_STAT_INC(n_udp_tx_errs);
 		if (errno == ENOBUFS) {
-			wg_stat.n_nobufs++;
+			WG_STAT_INC(n_nobufs);
 			return (-1);
 		}
 		vtc_log(band_vl, 0,
@@ -598,8 +1022,8 @@ wireguard_iface_peer_output(struct wireguard_device *device, struct pbuf *q,
 		return (-1);
 	}
 	assert(l == buflen);
-	wg_stat.n_udp_tx_pkts++;
-	wg_stat.bytes_udp_tx += buflen;
+	WG_STAT_INC(n_udp_tx_pkts);
+	WG_STAT_ADD(bytes_udp_tx, buflen);
 	return (0);
 }
 
@@ -615,8 +1039,8 @@ wireguard_iface_device_output(struct wireguard_device *device, struct pbuf *q,
 	if (wsin->proxy.from_it) {
 		buf = wireguard_iface_prepend_proxy_pkthdr(buf, &buflen,
 		    device->iface_addr, wsin->proxy.src_addr);		
-		wg_stat.n_udp_proxy_tx_pkts++;
-		wg_stat.bytes_udp_proxy_tx += buflen;
+		WG_STAT_INC(n_udp_proxy_tx_pkts);
+		WG_STAT_ADD(bytes_udp_proxy_tx, buflen);
 	}
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
@@ -625,9 +1049,9 @@ wireguard_iface_device_output(struct wireguard_device *device, struct pbuf *q,
 	l = sendto(device->udp_fd, buf, buflen, 0,
 	    (struct sockaddr *)&sin, sizeof(sin));
 	if (l == -1) {
-		wg_stat.n_udp_tx_errs++;
+		WG_STAT_INC(n_udp_tx_errs);
 		if (errno == ENOBUFS) {
-			wg_stat.n_nobufs++;
+			WG_STAT_INC(n_nobufs);
 			return (-1);
 		}
 		vtc_log(band_vl, 0,
@@ -637,8 +1061,8 @@ wireguard_iface_device_output(struct wireguard_device *device, struct pbuf *q,
 		return (-1);
 	}
 	assert(l == buflen);
-	wg_stat.n_udp_tx_pkts++;
-	wg_stat.bytes_udp_tx += buflen;
+	WG_STAT_INC(n_udp_tx_pkts);
+	WG_STAT_ADD(bytes_udp_tx, buflen);
 	return (0);
 }
 
@@ -722,7 +1146,14 @@ wireguard_iface_output_to_peer(struct wireguard_device *device, struct pbuf *p,
 				now = wireguard_sys_now();
 				peer->last_tx = now;
 				keypair->last_tx = now;
-			}
+				if (p != NULL) {
+					WG_PEER_STAT_INC(device, peer,
+					    n_tx_pkts);
+					WG_PEER_STAT_ADD(device, peer,
+					    bytes_tx, unpadded_len);
+				}
+			} else
+				WG_PEER_STAT_INC(device, peer, n_drops);
 			pbuf_free(pbuf);
 			// Check to see if we should rekey
 			if (keypair->sending_counter >= WIREGUARD_REKEY_AFTER_MESSAGES) {
@@ -834,6 +1265,8 @@ wireguard_iface_timer(void *arg)
 			peer->endpoint_latest_port = peer->endpoints[0].port;
 			timer_stats.n_reset_peer++;
 		}
+		/* Refreshes the published counters once a second. */
+		wireguard_peer_snapshot_update(device, peer);
 		if (wireguard_iface_should_destroy_current_keypair(peer)) {
 			/* Destroy current keypair */
 			wireguard_keypair_destroy(&peer->curr_keypair);
@@ -867,6 +1300,25 @@ wireguard_iface_timer(void *arg)
 	    wireguard_iface_timer, device);
 }
 
+/*
+ * Keeps the ephemeral keypair pool full so handshake creation on the
+ * data path doesn't pay for the x25519 base point multiplication.
+ */
+static void *
+wireguard_iface_ephemeral_thread(void *arg)
+{
+
+	(void)arg;
+
+	/* On Linux this only lowers the priority of the calling thread. */
+	(void)setpriority(PRIO_PROCESS, 0, 19);
+	while (!wg_aborted) {
+		if (wireguard_ephemeral_refill() == 0)
+			ODR_msleep(100);
+	}
+	return (NULL);
+}
+
 static struct wireguard_device *
 wireguard_iface_init(struct wireguard_iface_init_data *init_data)
 {
@@ -904,18 +1356,37 @@ wireguard_iface_init(struct wireguard_iface_init_data *init_data)
 
 	vtc_log(band_vl, 2, "Initialized the wireguard device.");
 
+	AZ(ODR_pthread_create(&wg_ephemeral_tp, NULL,
+	    wireguard_iface_ephemeral_thread, NULL));
+	AZ(ODR_pthread_detach(wg_ephemeral_tp));
+
 	callout_reset(&wg_cb, &device->co, CALLOUT_SECTOTICKS(1),
 	    wireguard_iface_timer, device);
 	return (device);
 }
 
+static void
+wireguard_iface_sync_reset(void)
+{
+
+	free(wg_sync.ents);
+	free(wg_sync.hash);
+	if (wg_sync.cnf != NULL)
+		CNF_rel(&wg_sync.cnf);
+	memset(&wg_sync, 0, sizeof(wg_sync));
+}
+
 static void
 wireguard_iface_fini(struct wireguard_device *device)
 {
+	size_t i;
 
 	callout_stop(&wg_cb, &device->co);
-	if (device->peers != NULL)
-		free(device->peers);
+	ODR_pthread_free(wg_ephemeral_tp);
+	for (i = 0; i < device->acl.n_programs; i++)
+		mudband_bpf_jit_free(&device->acl.programs[i].jit);
+	wireguard_peer_slab_fini(device);
+	wireguard_iface_sync_reset();
 	mudband_tunnel_iface_fini();
 	if (device->udp_fd >= 0)
 		ODR_close(device->udp_fd);
@@ -977,23 +1448,6 @@ wireguard_iface_peer_add_ip(struct wireguard_peer *peer, uint32_t ip,
 	return result;
 }
 
-static int
-wireguard_iface_otp_reusable(struct wireguard_peer *peer,
-    struct wireguard_iface_peer *p)
-{
-	int i;
-
-	if (peer->otp_enabled != p->otp_enabled)
-		return (0);
-	if (peer->otp_sender != p->otp_sender)
-		return (0);
-	for (i = 0; i < 3; i++) {
-		if (peer->otp_receiver[i] != p->otp_receiver[i])
-			return (0);
-	}
-	return (1);
-}
-
 static void
 wireguard_iface_otp_update(struct wireguard_peer *peer,
     struct wireguard_iface_peer *p)
@@ -1006,60 +1460,6 @@ wireguard_iface_otp_update(struct wireguard_peer *peer,
 		peer->otp_receiver[i] = p->otp_receiver[i];
 }
 
-static struct wireguard_peer *
-wireguard_iface_reusable_old_peer_by_pubkey(struct wireguard_peer *peers,
-    int peers_count, uint8_t *public_key)
-{
-	struct wireguard_peer *result = NULL;
-	struct wireguard_peer *tmp;
-	int r, x;
-
-	for (x = 0; x < peers_count; x++) {
-		tmp = &peers[x];
-		if (tmp->valid) {
-			r = memcmp(tmp->public_key, public_key,
-			    WIREGUARD_PUBLIC_KEY_LEN);
-			if (r == 0) {
-				result = tmp;
-				break;
-			}
-		}
-	}
-	return result;
-}
-
-static struct wireguard_peer *
-wireguard_iface_reusable_old_peer(struct wireguard_peer *peers,
-    int peers_count, struct wireguard_iface_peer *p)
-{
-	struct wireguard_peer *peer = NULL;
-	size_t public_key_len;
-	uint8_t i, public_key[WIREGUARD_PUBLIC_KEY_LEN];
-	bool r;
-
-	public_key_len = sizeof(public_key);
-	r = wireguard_base64_decode(p->public_key, public_key, &public_key_len);
-	if (!r || public_key_len != WIREGUARD_PUBLIC_KEY_LEN)
-		return (NULL);
-	peer = wireguard_iface_reusable_old_peer_by_pubkey(peers,
-	    peers_count, public_key);
-	if (peer == NULL)
-		return (NULL);
-	if (peer->n_endpoints != p->n_endpoints)
-		return (NULL);
-	for (i = 0; i < peer->n_endpoints; i++) {
-		if (peer->endpoints[i].is_proxy != p->endpoints[i].is_proxy)
-			return (NULL);
-		if (peer->endpoints[i].ip != p->endpoints[i].ip)
-			return (NULL);
-		if (peer->endpoints[i].port != p->endpoints[i].port)
-			return (NULL);
-	}
-	if (!wireguard_iface_otp_reusable(peer, p))
-		return (NULL);
-	return (peer);
-}
-
 static void
 wireguard_iface_timeout_update(struct wireguard_peer *peer)
 {
@@ -1090,7 +1490,12 @@ wireguard_iface_add_peer(struct wireguard_device *device,
 	*peer_index = WIREGUARD_IFACE_INVALID_INDEX;
 	public_key_len = sizeof(public_key);
 
-	r = wireguard_base64_decode(p->public_key, public_key, &public_key_len);
+	if (p->public_key_raw_valid) {
+		memcpy(public_key, p->public_key_raw, sizeof(public_key));
+		r = true;
+	} else
+		r = wireguard_base64_decode(p->public_key, public_key,
+		    &public_key_len);
 	if (!r || public_key_len != WIREGUARD_PUBLIC_KEY_LEN) {
 		vtc_log(band_vl, 0, "BANDEC_00125: Invalid public key %s",
 		    p->public_key);
@@ -1103,15 +1508,17 @@ wireguard_iface_add_peer(struct wireguard_device *device,
 		return (0);
 	}
 	/* Not active - see if we have room to allocate a new one */
-	peer = wireguard_peer_alloc(device);
+	peer = wireguard_peer_slab_alloc(device);
 	if (peer == NULL) {
 		vtc_log(band_vl, 0, "BANDEC_00126: No room for new peer");
 		return (-1);
 	}
-	r = wireguard_peer_init(device, peer, public_key, p->preshared_key);
+	r = wireguard_peer_init_dh(device, peer, public_key, p->preshared_key,
+	    p->public_key_dh_valid ? p->public_key_dh : NULL);
 	if (!r) {
 		vtc_log(band_vl, 0,
 		    "BANDEC_00127: wireguard_peer_init() failed");
+		wireguard_peer_slab_release(device, peer);
 		return (-1);
 	}
 	wireguard_iface_otp_update(peer, p);
@@ -1150,6 +1557,68 @@ wireguard_iface_add_peer(struct wireguard_device *device,
 	return (0);
 }
 
+/*
+ * Applies new settings for the same public key to a live peer.  The
+ * keypairs and the handshake state are left alone so the session goes on;
+ * an endpoint which still exists keeps its state, and the latest endpoint
+ * is only reset if it's gone and no session proves it's still good.
+ */
+static void
+wireguard_iface_update_peer(struct wireguard_peer *peer,
+    struct wireguard_iface_peer *p)
+{
+	bool alive[WIREGUARD_IFACE_PEER_ENDPOINTS_MAX], found = false;
+	uint8_t i, j;
+	bool r;
+
+	wireguard_iface_otp_update(peer, p);
+	for (i = 0; i < p->n_endpoints; i++) {
+		alive[i] = false;
+		for (j = 0; j < peer->n_endpoints; j++) {
+			if (peer->endpoints[j].is_proxy ==
+			    p->endpoints[i].is_proxy &&
+			    peer->endpoints[j].ip == p->endpoints[i].ip &&
+			    peer->endpoints[j].port == p->endpoints[i].port) {
+				alive[i] = peer->endpoints[j].alive;
+				break;
+			}
+		}
+	}
+	for (i = 0; i < p->n_endpoints; i++) {
+		peer->endpoints[i].alive = alive[i];
+		peer->endpoints[i].is_proxy = p->endpoints[i].is_proxy;
+		peer->endpoints[i].ip = p->endpoints[i].ip;
+		peer->endpoints[i].port = p->endpoints[i].port;
+		if (peer->endpoint_latest_ip == p->endpoints[i].ip &&
+		    peer->endpoint_latest_port == p->endpoints[i].port &&
+		    peer->endpoint_latest_is_proxy == p->endpoints[i].is_proxy)
+			found = true;
+	}
+	peer->n_endpoints = p->n_endpoints;
+	if (!found && !peer->curr_keypair.valid) {
+		peer->endpoint_latest_ip = peer->endpoints[0].ip;
+		peer->endpoint_latest_port = peer->endpoints[0].port;
+		peer->endpoint_latest_is_proxy = peer->endpoints[0].is_proxy;
+	}
+	if (p->keep_alive == WIREGUARD_IFACE_KEEPALIVE_DEFAULT) {
+		peer->keepalive_interval = WIREGUARD_KEEPALIVE_TIMEOUT;
+	} else {
+		peer->keepalive_interval = p->keep_alive;
+	}
+	wireguard_iface_timeout_update(peer);
+	if (peer->iface_addr != p->iface_addr ||
+	    !peer->allowed_source_ips[0].valid ||
+	    peer->allowed_source_ips[0].ip != p->allowed_ip ||
+	    peer->allowed_source_ips[0].mask != p->allowed_mask) {
+		peer->iface_addr = p->iface_addr;
+		memset(peer->allowed_source_ips, 0,
+		    sizeof(peer->allowed_source_ips));
+		r = wireguard_iface_peer_add_ip(peer, p->allowed_ip,
+		    p->allowed_mask);
+		assert(r);
+	}
+}
+
 static int
 wireguard_iface_lookup_peer(struct wireguard_device *device, int peer_index,
     struct wireguard_peer **out)
@@ -1197,30 +1666,194 @@ static struct wireguard_peer *
 wireguard_iface_peer_lookup_by_allowed_ip(struct wireguard_device *device,
     const uint32_t ipaddr)
 {
-	struct wireguard_peer *result = NULL;
-	struct wireguard_peer *tmp;
-	int x;
-	int y;
 
-	for (x = 0; (!result) && (x < device->peers_count); x++) {
-		tmp = &device->peers[x];
-		if (!tmp->valid)
-			continue;
-		for (y = 0; y < WIREGUARD_MAX_SRC_IPS; y++) {
-			uint32_t v1, v2;
+	return (wireguard_peer_lookup_by_allowed_ip(device, ipaddr));
+}
 
-			if (!(tmp->allowed_source_ips[y].valid))
-				continue;
-			v1 = ipaddr & tmp->allowed_source_ips[y].mask;
-			v2 = tmp->allowed_source_ips[y].ip &
-			    tmp->allowed_source_ips[y].mask;
-			if (v1 == v2) {
-				result = tmp;
-				break;
-			}
+/*
+ * Tracking only pays off when there is an ACL that could drop the replies.
+ */
+static bool
+wireguard_iface_ct_enabled(struct wireguard_device *device)
+{
+
+	return (device->acl.n_programs > 0 ||
+	    device->acl.default_policy == WIREGUARD_ACL_POLICY_BLOCK);
+}
+
+/*
+ * Fills the key as seen outbound; 'inbound' swaps the ends so a reply
+ * yields the key of the connection it belongs to.  Only TCP, UDP and ICMP
+ * echo (requests outbound, replies inbound) are tracked.
+ */
+static bool
+wireguard_iface_ct_key(const uint8_t *pkt, size_t len, bool inbound,
+    struct wireguard_iface_ct *key, uint8_t *tcp_flags)
+{
+	const struct wireguard_iphdr *iphdr;
+	const uint8_t *l4;
+	size_t hlen;
+	uint16_t p0, p1;
+
+	if (len < sizeof(struct wireguard_iphdr))
+		return (false);
+	iphdr = (const struct wireguard_iphdr *)pkt;
+	if (WIREGUARD_IPHDR_HI_BYTE(iphdr->verlen) != 4)
+		return (false);
+	if ((ntohs(iphdr->frag_off) & IP_OFFMASK) != 0)
+		return (false);
+	hlen = WIREGUARD_IPHDR_LO_BYTE(iphdr->verlen) * 4;
+	if (hlen < sizeof(struct wireguard_iphdr) || len < hlen)
+		return (false);
+	l4 = pkt + hlen;
+	len -= hlen;
+	switch (iphdr->protocol) {
+	case IPPROTO_TCP:
+		if (len < 14)
+			return (false);
+		*tcp_flags = l4[13];
+		/* FALLTHROUGH */
+	case IPPROTO_UDP:
+		if (len < 4)
+			return (false);
+		memcpy(&p0, l4, sizeof(p0));
+		memcpy(&p1, l4 + 2, sizeof(p1));
+		break;
+	case IPPROTO_ICMP:
+		if (len < 8 || l4[0] != (inbound ? 0 : 8))
+			return (false);
+		memcpy(&p0, l4 + 4, sizeof(p0));
+		p1 = p0;
+		break;
+	default:
+		return (false);
+	}
+	key->proto = iphdr->protocol;
+	if (inbound) {
+		key->saddr = iphdr->daddr;
+		key->daddr = iphdr->saddr;
+		key->sport = p1;
+		key->dport = p0;
+	} else {
+		key->saddr = iphdr->saddr;
+		key->daddr = iphdr->daddr;
+		key->sport = p0;
+		key->dport = p1;
+	}
+	return (true);
+}
+
+/*
+ * Returns the live entry for the key, or NULL.  With 'create' a missing
+ * entry gets a way of its own: an expired one if any, otherwise the one
+ * closest to expiring.
+ */
+static struct wireguard_iface_ct *
+wireguard_iface_ct_lookup(const struct wireguard_iface_ct *key, uint32_t now,
+    bool create)
+{
+	struct wireguard_iface_ct_set *set;
+	struct wireguard_iface_ct *ct, *victim = NULL;
+	uint32_t h;
+	unsigned i;
+
+	h = key->saddr ^ (key->daddr * 0x9e3779b1U) ^
+	    ((((uint32_t)key->sport << 16) | key->dport) * 0x85ebca6bU) ^
+	    key->proto;
+	h ^= h >> 16;
+	h *= 0x7feb352dU;
+	h ^= h >> 15;
+	set = &wg_ct[h & (WIREGUARD_IFACE_CT_SETS - 1)];
+	for (i = 0; i < WIREGUARD_IFACE_CT_WAYS; i++) {
+		ct = &set->ways[i];
+		if (ct->state == WIREGUARD_IFACE_CT_NONE ||
+		    (int32_t)(ct->expire - now) <= 0) {
+			if (victim == NULL ||
+			    victim->state != WIREGUARD_IFACE_CT_NONE)
+				victim = ct;
+			ct->state = WIREGUARD_IFACE_CT_NONE;
+			continue;
 		}
+		if (ct->saddr == key->saddr && ct->daddr == key->daddr &&
+		    ct->sport == key->sport && ct->dport == key->dport &&
+		    ct->proto == key->proto)
+			return (ct);
+		if (victim == NULL || (victim->state != WIREGUARD_IFACE_CT_NONE &&
+		    (int32_t)(ct->expire - victim->expire) < 0))
+			victim = ct;
+	}
+	if (!create)
+		return (NULL);
+	*victim = *key;
+	victim->state = WIREGUARD_IFACE_CT_NONE;
+	return (victim);
+}
+
+static void
+wireguard_iface_ct_output(struct pbuf *p)
+{
+	struct wireguard_iface_ct key, *ct;
+	uint32_t now;
+	uint8_t tcp_flags = 0;
+
+	if (!wireguard_iface_ct_key(p->payload, p->len, false, &key,
+	    &tcp_flags))
+		return;
+	now = wireguard_sys_now();
+	ct = wireguard_iface_ct_lookup(&key, now, true);
+	switch (key.proto) {
+	case IPPROTO_TCP:
+		if ((tcp_flags & (TH_FIN | TH_RST)) != 0)
+			ct->state = WIREGUARD_IFACE_CT_TCP_CLOSING;
+		else if ((tcp_flags & (TH_SYN | TH_ACK)) == TH_SYN)
+			ct->state = WIREGUARD_IFACE_CT_TCP_SYN_SENT;
+		else if (ct->state == WIREGUARD_IFACE_CT_NONE)
+			ct->state = WIREGUARD_IFACE_CT_TCP_ESTABLISHED;
+		break;
+	case IPPROTO_UDP:
+		if (ct->state == WIREGUARD_IFACE_CT_NONE)
+			ct->state = WIREGUARD_IFACE_CT_UDP_UNREPLIED;
+		break;
+	default:
+		ct->state = WIREGUARD_IFACE_CT_ICMP;
+		break;
 	}
-	return result;
+	ct->expire = now + wg_ct_timeouts[ct->state] * 1000;
+}
+
+/*
+ * Returns true if the inbound packet is a reply on a tracked connection.
+ */
+static bool
+wireguard_iface_ct_input(struct pbuf *p)
+{
+	struct wireguard_iface_ct key, *ct;
+	uint32_t now;
+	uint8_t tcp_flags = 0;
+
+	if (!wireguard_iface_ct_key(p->payload, p->tot_len, true, &key,
+	    &tcp_flags))
+		return (false);
+	now = wireguard_sys_now();
+	ct = wireguard_iface_ct_lookup(&key, now, false);
+	if (ct == NULL)
+		return (false);
+	switch (ct->state) {
+	case WIREGUARD_IFACE_CT_TCP_SYN_SENT:
+	case WIREGUARD_IFACE_CT_TCP_ESTABLISHED:
+		if ((tcp_flags & (TH_FIN | TH_RST)) != 0)
+			ct->state = WIREGUARD_IFACE_CT_TCP_CLOSING;
+		else
+			ct->state = WIREGUARD_IFACE_CT_TCP_ESTABLISHED;
+		break;
+	case WIREGUARD_IFACE_CT_UDP_UNREPLIED:
+		ct->state = WIREGUARD_IFACE_CT_UDP_REPLIED;
+		break;
+	default:
+		break;
+	}
+	ct->expire = now + wg_ct_timeouts[ct->state] * 1000;
+	return (true);
 }
 
 static int
@@ -1232,9 +1865,11 @@ wireguard_iface_output(struct wireguard_device *device, struct pbuf *p,
 	peer = wireguard_iface_peer_lookup_by_allowed_ip(device, ipaddr);
 	if (peer == NULL) {
 		/* No peer found - drop packet */
-		wg_stat.n_no_peer_found++;
+		WG_STAT_INC(n_no_peer_found);
 		return (-1);
 	}
+	if (wireguard_iface_ct_enabled(device))
+		wireguard_iface_ct_output(p);
 	return wireguard_iface_output_to_peer(device, p, peer);
 }
 
@@ -1328,16 +1963,22 @@ static void
 wireguard_iface_update_peer_addr(struct wireguard_peer *peer,
     const struct wireguard_sockaddr *wsin)
 {
+	time_t now;
 
+	now = time(NULL);
 	if (peer->endpoint_latest_ip == wsin->addr &&
 	    peer->endpoint_latest_port == wsin->port) {
-		peer->endpoint_latest_t_heartbeated = time(NULL);
+		if (peer->endpoint_latest_t_heartbeated == now)
+			return;
+		peer->endpoint_latest_t_heartbeated = now;
+		wireguard_peer_snapshot_update(peer->device, peer);
 		return;
 	}
 	peer->endpoint_latest_ip = wsin->addr;
 	peer->endpoint_latest_port = wsin->port;
 	peer->endpoint_latest_is_proxy = wsin->proxy.from_it;
-	peer->endpoint_latest_t_heartbeated = time(NULL);
+	peer->endpoint_latest_t_heartbeated = now;
+	wireguard_peer_snapshot_update(peer->device, peer);
 }
 
 static void
@@ -1431,37 +2072,177 @@ wireguard_iface_tun_write(struct wireguard_device *device, struct pbuf *p)
 
 	(void)device;
 
-	wg_stat.n_tun_tx_pkts++;
-	wg_stat.bytes_tun_tx += p->tot_len;
+	WG_STAT_INC(n_tun_tx_pkts);
+	WG_STAT_ADD(bytes_tun_tx, p->tot_len);
 	mudband_tunnel_iface_write(p->payload, p->tot_len);
 }
 
 static bool
-wireguard_iface_apply_acl(struct wireguard_device *device, struct pbuf *pbuf)
+wireguard_iface_eval_acl(struct wireguard_device *device, struct pbuf *pbuf)
 {
 	struct wireguard_acl *acl = &device->acl;
+	struct wireguard_acl_program *acl_program;
 	size_t i;
-	uint32_t r;
-	bool need_drop = false;
-
-	for (i = 0; i < acl->n_programs; i++) {
-		struct wireguard_acl_program *acl_program;
+	uint32_t r = 0;
+	int classified;
 
+	/*
+	 * The classifier answers for the programs it covers and the rest run
+	 * as BPF.  Every match gives the same verdict so the order is moot.
+	 */
+	classified = wireguard_acl_classify(acl, pbuf->payload, pbuf->tot_len);
+	if (classified == 1)
+		r = 1;
+	for (i = 0; r == 0 && i < acl->n_programs; i++) {
 		acl_program = &acl->programs[i];
-		r = mudband_bpf_filter(acl_program->insns, pbuf->payload, pbuf->tot_len,
-		    pbuf->tot_len);
-		if (r != 0) {
-			/* matched */
-			if (acl->default_policy == WIREGUARD_ACL_POLICY_ALLOW)
-				return (true);
-			else if (acl->default_policy == WIREGUARD_ACL_POLICY_BLOCK)
-				return (false);
-			else
-				assert(0 == 1);
+		if (classified == 0 && acl_program->compiled)
+			continue;
+		if (acl_program->jit.func != NULL) {
+			r = acl_program->jit.func(pbuf->payload, pbuf->tot_len,
+			    pbuf->tot_len);
+#ifdef MUDBAND_BPF_JIT_CHECK
+			assert(r == mudband_bpf_filter(acl_program->insns,
+			    pbuf->payload, pbuf->tot_len, pbuf->tot_len));
+#endif
+		} else
+			r = mudband_bpf_filter(acl_program->insns,
+			    pbuf->payload, pbuf->tot_len, pbuf->tot_len);
+	}
+	if (r != 0) {
+		/* matched */
+		if (acl->default_policy == WIREGUARD_ACL_POLICY_ALLOW)
+			return (true);
+		else if (acl->default_policy == WIREGUARD_ACL_POLICY_BLOCK)
+			return (false);
+		else
+			assert(0 == 1);
+	}
+	return (acl->default_policy == WIREGUARD_ACL_POLICY_BLOCK);
+}
+
+/*
+ * Only TCP and UDP packets carrying the ports are cached; everything else
+ * (ICMP, non-first fragments) is evaluated every time.
+ */
+static bool
+wireguard_iface_acl_flow_key(struct pbuf *pbuf,
+    struct wireguard_iface_acl_flow *key)
+{
+	struct wireguard_iphdr *iphdr;
+	size_t hlen;
+
+	if (pbuf->tot_len < sizeof(struct wireguard_iphdr))
+		return (false);
+	iphdr = (struct wireguard_iphdr *)pbuf->payload;
+	if (WIREGUARD_IPHDR_HI_BYTE(iphdr->verlen) != 4)
+		return (false);
+	if (iphdr->protocol != IPPROTO_TCP && iphdr->protocol != IPPROTO_UDP)
+		return (false);
+	if ((ntohs(iphdr->frag_off) & IP_OFFMASK) != 0)
+		return (false);
+	hlen = WIREGUARD_IPHDR_LO_BYTE(iphdr->verlen) * 4;
+	if (hlen < sizeof(struct wireguard_iphdr) ||
+	    pbuf->tot_len < hlen + sizeof(key->ports))
+		return (false);
+	key->saddr = iphdr->saddr;
+	key->daddr = iphdr->daddr;
+	memcpy(&key->ports, (uint8_t *)pbuf->payload + hlen,
+	    sizeof(key->ports));
+	key->proto = iphdr->protocol;
+	return (true);
+}
+
+static struct wireguard_iface_acl_flow_set *
+wireguard_iface_acl_flow_set(const struct wireguard_iface_acl_flow *key)
+{
+	uint32_t h;
+
+	h = key->saddr ^ (key->daddr * 0x9e3779b1U) ^
+	    (key->ports * 0x85ebca6bU) ^ key->proto;
+	h ^= h >> 16;
+	h *= 0x7feb352dU;
+	h ^= h >> 15;
+	return (&wg_acl_flows[h & (WIREGUARD_IFACE_ACL_FLOW_SETS - 1)]);
+}
+
+/*
+ * Returns the entry for the key with *found set, or the way to replace:
+ * a stale one if any, otherwise the first one the clock hand finds with
+ * its reference bit clear.
+ */
+static struct wireguard_iface_acl_flow *
+wireguard_iface_acl_flow_lookup(const struct wireguard_iface_acl_flow *key,
+    bool *found)
+{
+	struct wireguard_iface_acl_flow_set *set;
+	struct wireguard_iface_acl_flow *flow;
+	unsigned i, hand;
+
+	set = wireguard_iface_acl_flow_set(key);
+	for (i = 0; i < WIREGUARD_IFACE_ACL_FLOW_WAYS; i++) {
+		flow = &set->ways[i];
+		if (flow->gen == wg_acl_flow_gen &&
+		    flow->saddr == key->saddr && flow->daddr == key->daddr &&
+		    flow->ports == key->ports && flow->proto == key->proto) {
+			flow->flags |= WIREGUARD_IFACE_ACL_FLOW_F_REF;
+			*found = true;
+			return (flow);
 		}
 	}
-	if (acl->default_policy == WIREGUARD_ACL_POLICY_BLOCK)
-		need_drop = true;
+	*found = false;
+	for (i = 0; i < WIREGUARD_IFACE_ACL_FLOW_WAYS; i++) {
+		flow = &set->ways[i];
+		if (flow->gen != wg_acl_flow_gen)
+			return (flow);
+	}
+	hand = wg_acl_flow_hand++;
+	for (i = 0; ; i++) {
+		flow = &set->ways[(hand + i) % WIREGUARD_IFACE_ACL_FLOW_WAYS];
+		if ((flow->flags & WIREGUARD_IFACE_ACL_FLOW_F_REF) == 0)
+			return (flow);
+		flow->flags &= ~WIREGUARD_IFACE_ACL_FLOW_F_REF;
+	}
+}
+
+static void
+wireguard_iface_acl_flow_flush(void)
+{
+
+	if (++wg_acl_flow_gen == 0) {
+		/* Wrapped; stale entries could look current again. */
+		memset(wg_acl_flows, 0, sizeof(wg_acl_flows));
+		wg_acl_flow_gen = 1;
+	}
+}
+
+static bool
+wireguard_iface_apply_acl(struct wireguard_device *device, struct pbuf *pbuf)
+{
+	struct wireguard_iface_acl_flow key, *flow;
+	bool found, need_drop;
+
+	if (wireguard_iface_ct_enabled(device) &&
+	    wireguard_iface_ct_input(pbuf)) {
+		WG_STAT_INC(n_acl_ct_replies);
+		return (false);
+	}
+	/*
+	 * A verdict holds for the whole flow only if no program looks at
+	 * anything else than the 5-tuple, e.g. TCP flags or the length.
+	 */
+	if (device->acl.n_programs == 0 || !device->acl.tuple_only ||
+	    !wireguard_iface_acl_flow_key(pbuf, &key))
+		return (wireguard_iface_eval_acl(device, pbuf));
+	flow = wireguard_iface_acl_flow_lookup(&key, &found);
+	if (found) {
+		WG_STAT_INC(n_acl_flow_hits);
+		return ((flow->flags & WIREGUARD_IFACE_ACL_FLOW_F_DROP) != 0);
+	}
+	WG_STAT_INC(n_acl_flow_misses);
+	need_drop = wireguard_iface_eval_acl(device, pbuf);
+	*flow = key;
+	flow->gen = wg_acl_flow_gen;
+	flow->flags = need_drop ? WIREGUARD_IFACE_ACL_FLOW_F_DROP : 0;
 	return (need_drop);
 }
 
@@ -1477,14 +2258,12 @@ wireguard_iface_process_data_message(struct wireguard_device *device,
 	struct pbuf *pbuf;
 	struct wireguard_iphdr *iphdr;
 	uint32_t dest;
-	bool dest_ok = false, r;
+	bool dest_ok = false, delivered = false, r;
 	int x;
 	uint32_t now;
 	uint16_t header_len = 0xFFFF;
 	uint32_t idx = data_hdr->receiver;
 
-	(void)device;
-
 	keypair = wireguard_get_peer_keypair_for_idx(peer, idx);
 	if (keypair == NULL) {
 		// Could not locate valid keypair for remote index
@@ -1574,8 +2353,14 @@ wireguard_iface_process_data_message(struct wireguard_device *device,
 			if (wireguard_iface_apply_acl(device, pbuf))
 				goto drop;
 			wireguard_iface_tun_write(device, pbuf);
+			delivered = true;
 		}
 drop:
+		if (delivered) {
+			WG_PEER_STAT_INC(device, peer, n_rx_pkts);
+			WG_PEER_STAT_ADD(device, peer, bytes_rx, pbuf->tot_len);
+		} else if (pbuf->tot_len > 0)
+			WG_PEER_STAT_INC(device, peer, n_drops);
 		if (pbuf)
 			pbuf_free(pbuf);
 	} else {
@@ -1714,9 +2499,12 @@ wireguard_iface_print_stat(void *arg)
 	char bytes_tun_rx[20], bytes_tun_tx[20];
 	char bytes_udp_rx[20], bytes_udp_tx[20];
 	char bytes_udp_proxy_rx[20], bytes_udp_proxy_tx[20];
+	struct wireguard_iface_stat wg_stat;
 
 	(void)arg;
 
+	wireguard_iface_stat_sum(&wg_stat);
+
 	mudband_count2size(wg_stat.bytes_tun_rx, bytes_tun_rx,
 	    sizeof(bytes_tun_rx));
 	mudband_count2size(wg_stat.bytes_tun_tx, bytes_tun_tx,
@@ -1747,47 +2535,275 @@ wireguard_iface_print_stat(void *arg)
 	    wireguard_iface_print_stat, NULL);
 }
 
+struct wireguard_iface_precompute {
+	struct wireguard_device		*device;
+	struct wireguard_iface_peer	*peers;
+	int				n_peers;
+	volatile int			next;
+};
+
+static void *
+wireguard_iface_precompute_thread(void *arg)
+{
+	struct wireguard_iface_precompute *pc;
+	struct wireguard_iface_peer *p;
+	size_t public_key_len;
+	uint8_t public_key[WIREGUARD_PUBLIC_KEY_LEN];
+	bool r;
+	int i;
+
+	pc = (struct wireguard_iface_precompute *)arg;
+	while ((i = __sync_fetch_and_add(&pc->next, 1)) < pc->n_peers) {
+		p = &pc->peers[i];
+		if (!p->need_public_key_dh)
+			continue;
+		if (p->public_key_raw_valid) {
+			memcpy(public_key, p->public_key_raw,
+			    sizeof(public_key));
+		} else {
+			public_key_len = sizeof(public_key);
+			r = wireguard_base64_decode(p->public_key, public_key,
+			    &public_key_len);
+			if (!r || public_key_len != WIREGUARD_PUBLIC_KEY_LEN)
+				continue;
+		}
+		p->public_key_dh_valid = wireguard_peer_compute_dh(pc->device,
+		    public_key, p->public_key_dh);
+	}
+	return (NULL);
+}
+
+/*
+ * Computes the static-static DH of the new peers on a few worker threads
+ * so a large band doesn't do thousands of scalar multiplications one by
+ * one.  Small batches aren't worth the thread creation.
+ */
+static void
+wireguard_iface_precompute(struct wireguard_device *device,
+    struct wireguard_iface_peer *peers, int n_peers, int n_jobs)
+{
+	struct wireguard_iface_precompute pc;
+	odr_pthread_t tps[WIREGUARD_IFACE_PRECOMPUTE_THREADS_MAX];
+	long n_cpus;
+	int i, n_threads;
+
+	pc.device = device;
+	pc.peers = peers;
+	pc.n_peers = n_peers;
+	pc.next = 0;
+
+	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n_threads = n_jobs / WIREGUARD_IFACE_PRECOMPUTE_JOBS_PER_THREAD;
+	n_threads = MIN(n_threads, (int)n_cpus - 1);
+	n_threads = MIN(n_threads, WIREGUARD_IFACE_PRECOMPUTE_THREADS_MAX);
+	for (i = 0; i < n_threads; i++) {
+		if (ODR_pthread_create(&tps[i], NULL,
+		    wireguard_iface_precompute_thread, &pc) != 0) {
+			vtc_log(band_vl, 1,
+			    "BANDEC_00912: Failed to create the precompute"
+			    " thread.");
+			break;
+		}
+	}
+	n_threads = i;
+	/* The calling thread works too. */
+	(void)wireguard_iface_precompute_thread(&pc);
+	for (i = 0; i < n_threads; i++) {
+		AZ(ODR_pthread_join(tps[i], NULL));
+		ODR_pthread_free(tps[i]);
+	}
+}
+
+static uint32_t
+wireguard_iface_sync_hash(const char *public_key)
+{
+	uint32_t h = 2166136261U;
+
+	while (*public_key != '\0') {
+		h ^= (uint8_t)*public_key++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+/*
+ * Looks the public key up in 'hash'.  Returns the index into 'ents' or,
+ * if not found, -1 with *slot set to where it would go.
+ */
+static int
+wireguard_iface_sync_find(struct wireguard_iface_sync_ent *ents, int *hash,
+    uint32_t hash_mask, const char *public_key, uint32_t *slot)
+{
+	uint32_t h;
+	int x;
+
+	h = wireguard_iface_sync_hash(public_key) & hash_mask;
+	while ((x = hash[h]) != -1) {
+		if (!strcmp(ents[x].public_key, public_key))
+			return (x);
+		h = (h + 1) & hash_mask;
+	}
+	if (slot != NULL)
+		*slot = h;
+	return (-1);
+}
+
+enum wireguard_iface_sync_op {
+	WIREGUARD_IFACE_SYNC_KEEP,	/* JSON unchanged */
+	WIREGUARD_IFACE_SYNC_UPDATE,	/* modified, updated in place */
+	WIREGUARD_IFACE_SYNC_CREATE,	/* added or needs a new peer */
+	WIREGUARD_IFACE_SYNC_SKIP,	/* duplicated public key */
+};
+
+/*
+ * Applies the difference between the config of the last sync and 'cnf'.
+ * Peers whose JSON is unchanged are left alone, removed ones are
+ * released, and only the added or modified ones are decoded.  A modified
+ * peer is updated in place, keeping its slab slot and its session.
+ * A change of the interface NAT type changes how every peer is read, so
+ * then every peer counts as modified.  Code which needs to refer to a
+ * peer across syncs should keep a wireguard_peer_handle.
+ */
 static void
 wireguard_iface_peers_update(struct wireguard_device *device, struct cnf *cnf)
 {
-	struct wireguard_peer *old_peers;
-	int i, n_peers, r;
-	int peer_index, old_peers_count;
-	int n_create = 0, n_reuse = 0, n_failure = 0;
+	struct wireguard_iface_peer *iface_peers = NULL, *iface_peer;
+	struct wireguard_iface_sync_ent *ents = NULL, *ent, *oent;
+	struct wireguard_peer *peer;
+	json_t *jpeers, *jpeer, *jpubkey;
+	uint8_t *ops = NULL;
+	bool *seen = NULL, full;
+	uint32_t hash_mask, slot;
+	int *hash;
+	int i, x, n_peers, r;
+	int peer_index;
+	int n_create = 0, n_update = 0, n_keep = 0, n_retire = 0;
+	int n_failure = 0;
 
 	vtc_log(band_vl, 2, "Updating the wireguard peers information.");
 
-	old_peers_count = device->peers_count;
-	old_peers = device->peers;
 	n_peers = CNF_get_peer_size(cnf->jroot);
-	if (n_peers == 0) {
-		device->peers_count = 0;
-		device->peers = NULL;
-		goto done;
+	assert(n_peers >= 0);
+	jpeers = json_object_get(cnf->jroot, "peers");
+	AN(jpeers);
+	full = wg_sync.cnf == NULL ||
+	    CNF_get_interface_nat_type(wg_sync.cnf->jroot) !=
+	    CNF_get_interface_nat_type(cnf->jroot);
+	if (wg_sync.n_ents > 0) {
+		seen = calloc(wg_sync.n_ents, sizeof(*seen));
+		AN(seen);
+	}
+	for (hash_mask = 16; hash_mask < (uint32_t)n_peers * 2; hash_mask *= 2)
+		continue;
+	hash = malloc(hash_mask * sizeof(*hash));
+	AN(hash);
+	memset(hash, 0xff, hash_mask * sizeof(*hash));
+	hash_mask--;
+	if (n_peers > 0) {
+		iface_peers = calloc(n_peers, sizeof(*iface_peers));
+		AN(iface_peers);
+		ents = calloc(n_peers, sizeof(*ents));
+		AN(ents);
+		ops = calloc(n_peers, sizeof(*ops));
+		AN(ops);
 	}
-	assert(n_peers > 0);
-	device->peers_count = n_peers;
-	device->peers = calloc(device->peers_count,
-	    sizeof(struct wireguard_peer));
-	AN(device->peers);
 	for (i = 0; i < n_peers; i++) {
-		struct wireguard_iface_peer iface_peer;
-		struct wireguard_peer *old_peer, *new_peer;
-
-		wireguard_iface_peer_init(&iface_peer);
-		r = CNF_fill_iface_peer(cnf->jroot, &iface_peer, i);
+		ent = &ents[i];
+		ent->handle.index = WIREGUARD_IFACE_INVALID_INDEX;
+		jpeer = json_array_get(jpeers, i);
+		AN(jpeer);
+		jpubkey = json_object_get(jpeer, "wireguard_pubkey");
+		AN(jpubkey);
+		assert(json_is_string(jpubkey));
+		ent->public_key = json_string_value(jpubkey);
+		ent->jpeer = jpeer;
+		if (wireguard_iface_sync_find(ents, hash, hash_mask,
+		    ent->public_key, &slot) != -1) {
+			ops[i] = WIREGUARD_IFACE_SYNC_SKIP;
+			continue;
+		}
+		hash[slot] = i;
+		x = -1;
+		oent = NULL;
+		peer = NULL;
+		if (wg_sync.n_ents > 0) {
+			x = wireguard_iface_sync_find(wg_sync.ents,
+			    wg_sync.hash, wg_sync.hash_mask, ent->public_key,
+			    NULL);
+		}
+		if (x != -1) {
+			oent = &wg_sync.ents[x];
+			peer = wireguard_peer_handle_resolve(device,
+			    &oent->handle);
+			if (peer == NULL)
+				oent = NULL;
+		}
+		if (oent != NULL && !full && json_equal(oent->jpeer, jpeer)) {
+			ent->handle = oent->handle;
+			seen[x] = true;
+			ops[i] = WIREGUARD_IFACE_SYNC_KEEP;
+			continue;
+		}
+		iface_peer = &iface_peers[i];
+		wireguard_iface_peer_init(iface_peer);
+		r = CNF_fill_iface_peer_cached(cnf, iface_peer, i);
 		assert(r == 0);
-		old_peer = wireguard_iface_reusable_old_peer(old_peers,
-		    old_peers_count, &iface_peer);
-		if (old_peer == NULL) {
-			r = wireguard_iface_add_peer(device, &iface_peer,
+		if (oent != NULL) {
+			ent->handle = oent->handle;
+			seen[x] = true;
+			ops[i] = WIREGUARD_IFACE_SYNC_UPDATE;
+			continue;
+		}
+		iface_peer->need_public_key_dh = true;
+		ops[i] = WIREGUARD_IFACE_SYNC_CREATE;
+		n_create++;
+	}
+	/*
+	 * The old peers stay in place until every new peer has its keys
+	 * ready; after this point building the new ones is cheap.
+	 */
+	wireguard_iface_precompute(device, iface_peers, n_peers, n_create);
+	for (x = 0; x < wg_sync.n_ents; x++) {
+		if (seen[x])
+			continue;
+		peer = wireguard_peer_handle_resolve(device,
+		    &wg_sync.ents[x].handle);
+		if (peer == NULL)
+			continue;
+		wireguard_iface_peer_stat_reset(wg_sync.ents[x].handle.index);
+		wireguard_peer_slab_release(device, peer);
+		n_retire++;
+	}
+	if (!wireguard_peer_slab_reserve(device, n_create)) {
+		vtc_log(band_vl, 0,
+		    "BANDEC_00913: Failed to grow the peer table for"
+		    " %d peers.", n_create);
+	}
+	wireguard_iface_peer_stat_resize(device->peers_cap);
+	n_create = 0;
+	for (i = 0; i < n_peers; i++) {
+		ent = &ents[i];
+		iface_peer = &iface_peers[i];
+		switch (ops[i]) {
+		case WIREGUARD_IFACE_SYNC_KEEP:
+			n_keep++;
+			break;
+		case WIREGUARD_IFACE_SYNC_UPDATE:
+			peer = wireguard_peer_handle_resolve(device,
+			    &ent->handle);
+			AN(peer);
+			wireguard_iface_update_peer(peer, iface_peer);
+			n_update++;
+			break;
+		case WIREGUARD_IFACE_SYNC_CREATE:
+			r = wireguard_iface_add_peer(device, iface_peer,
 			    &peer_index);
 			if (r != 0) {
 				vtc_log(band_vl, 0,
 				    "BANDEC_00132: wireguard_iface_add_peer()"
 				    " failed: r %d", r);
 				n_failure++;
-				continue;
+				break;
 			}
 			assert(peer_index != WIREGUARD_IFACE_INVALID_INDEX);
 			r = wireguard_iface_connect(device, peer_index);
@@ -1796,48 +2812,85 @@ wireguard_iface_peers_update(struct wireguard_device *device, struct cnf *cnf)
 				    "BANDEC_00133: wireguard_iface_connect()"
 				    " failed: r %d", r);
 				n_failure++;
-				continue;
+				break;
 			}
+			wireguard_peer_handle_get(device,
+			    &device->peers[peer_index], &ent->handle);
 			n_create++;
-		} else {
-			new_peer = wireguard_peer_alloc(device);
-			AN(new_peer);
-			*new_peer = *old_peer;
-			wireguard_iface_timeout_update(new_peer);
-			wireguard_iface_otp_update(new_peer, &iface_peer);
-			n_reuse++;
+			break;
+		case WIREGUARD_IFACE_SYNC_SKIP:
+		default:
+			break;
 		}
 	}
-done:
-	if (old_peers != NULL)
-		free(old_peers);
+	if (n_create + n_update + n_retire > 0) {
+		wireguard_device_peers_index(device);
+		wireguard_peer_snapshot_sync(device);
+	}
+	free(wg_sync.ents);
+	free(wg_sync.hash);
+	wg_sync.ents = ents;
+	wg_sync.n_ents = n_peers;
+	wg_sync.hash = hash;
+	wg_sync.hash_mask = hash_mask;
+	free(seen);
+	free(ops);
+	free(iface_peers);
 	vtc_log(band_vl, 2,
 	    "Completed to update the wireguard peers information."
-	    " (%d peers %d create %d reuse %d failure)",
-	    n_peers, n_create, n_reuse, n_failure);
+	    " (%d peers %d create %d update %d keep %d retire %d failure)",
+	    n_peers, n_create, n_update, n_keep, n_retire, n_failure);
 }
 
 static void
 wireguard_iface_bpf_update(struct wireguard_device *device, struct cnf *cnf)
 {
 	struct wireguard_acl *acl;
+	struct wireguard_acl_program *acl_program;
+	size_t i, n_jitted = 0;
 
-	acl = CNF_acl_build(cnf->jroot);
+	acl = CNF_acl_build_cached(cnf);
 	if (acl == NULL)
 		return;
+	for (i = 0; i < acl->n_programs; i++) {
+		acl_program = &acl->programs[i];
+		if (mudband_bpf_jit_compile(&acl_program->jit,
+		    acl_program->insns, (int)acl_program->n_insns) == 0)
+			n_jitted++;
+	}
+	if (n_jitted != acl->n_programs)
+		vtc_log(band_vl, 3,
+		    "ACL: %zu of %zu programs use the BPF interpreter.",
+		    acl->n_programs - n_jitted, acl->n_programs);
+	for (i = 0; i < device->acl.n_programs; i++)
+		mudband_bpf_jit_free(&device->acl.programs[i].jit);
 	device->acl = *acl;
 	free(acl);
+	wireguard_iface_acl_flow_flush();
 }
 
+/*
+ * The config stays busy until the next sync replaces it as the base of
+ * the diff.
+ */
 static void
 wireguard_iface_sync(struct wireguard_device *device)
 {
 	struct cnf *cnf;
 
 	CNF_get(&cnf);
+	if (cnf == wg_sync.cnf) {
+		CNF_rel(&cnf);
+		return;
+	}
 	wireguard_iface_peers_update(device, cnf);
-	wireguard_iface_bpf_update(device, cnf);
-	CNF_rel(&cnf);
+	if (wg_sync.cnf == NULL ||
+	    !json_equal(json_object_get(wg_sync.cnf->jroot, "acl"),
+	    json_object_get(cnf->jroot, "acl")))
+		wireguard_iface_bpf_update(device, cnf);
+	if (wg_sync.cnf != NULL)
+		CNF_rel(&wg_sync.cnf);
+	wg_sync.cnf = cnf;
 }
 
 void
@@ -1902,8 +2955,6 @@ mudband_tunnel_init_chkconfig(void)
 {
 	int r;
 
-	/* load if there's a previous one before fetching the config. */
-	(void)CNF_check_and_read();
 	r = CNF_fetch("when_it_runs_first");
 	if (r < 0) {
 		vtc_log(band_vl, 1,
@@ -1926,23 +2977,120 @@ mudband_tunnel_init_chkconfig(void)
 	return (0);
 }
 
+/*
+ * Time spent in each startup phase, in seconds.
+ */
+struct mudband_tunnel_bootstrap {
+	double		t_start;
+	double		t_stun;
+	double		t_mqtt;
+	double		t_fetch;
+};
+
+static struct mudband_tunnel_bootstrap band_bootstrap;
+static odr_pthread_t band_bootstrap_tp;
+
+static void *
+mudband_tunnel_bootstrap_mqtt(void *arg)
+{
+	struct mudband_tunnel_bootstrap *bs = arg;
+	double t0;
+
+	t0 = VTIM_mono();
+	(void)MQTT_init();
+	bs->t_mqtt = VTIM_mono() - t0;
+	return (NULL);
+}
+
+/*
+ * Runs STUN and the config fetch while the MQTT connection is made on
+ * the other thread.  The fetch needs the STUN result and the MQTT
+ * subscription needs the config so only these are ordered.  The tasks
+ * thread calls MQTT_sync() so it's started once MQTT_init() returned.
+ */
+static int
+mudband_tunnel_bootstrap(struct mudband_tunnel_bootstrap *bs)
+{
+	odr_pthread_t tp;
+	double t0;
+	int r;
+
+	if (ODR_pthread_create(&tp, NULL, mudband_tunnel_bootstrap_mqtt,
+	    bs) != 0) {
+		vtc_log(band_vl, 1,
+		    "BANDEC_00920: Failed to create the MQTT connect thread."
+		    " Connecting on this thread.");
+		(void)mudband_tunnel_bootstrap_mqtt(bs);
+		tp = NULL;
+	}
+	t0 = VTIM_mono();
+	STUNC_init();
+	bs->t_stun = VTIM_mono() - t0;
+	t0 = VTIM_mono();
+	r = mudband_tunnel_init_chkconfig();
+	bs->t_fetch = VTIM_mono() - t0;
+	if (tp != NULL) {
+		AZ(ODR_pthread_join(tp, NULL));
+		ODR_pthread_free(tp);
+	}
+	MBT_init();
+	/*
+	 * Subscribes even if the fetch failed.  The tunnel could be up with
+	 * the previous config and the config change events are what tell it
+	 * to fetch again.
+	 */
+	MQTT_subscribe();
+	vtc_log(band_vl, 2,
+	    "Startup phases took %.3f secs (stun %.3f mqtt %.3f fetch %.3f)",
+	    VTIM_mono() - bs->t_start, bs->t_stun, bs->t_mqtt, bs->t_fetch);
+	return (r);
+}
+
+static void *
+mudband_tunnel_bootstrap_thread(void *arg)
+{
+	struct mudband_tunnel_bootstrap *bs = arg;
+	int r;
+
+	r = mudband_tunnel_bootstrap(bs);
+	if (r == 0)
+		__atomic_store_n(&band_need_iface_sync, 1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
 static int
 mudband_tunnel_init(void)
 {
+	struct mudband_tunnel_bootstrap *bs = &band_bootstrap;
 	int r;
 
+	bs->t_start = VTIM_mono();
 	r = MBE_check_and_read();
 	if (r == -1) {
 		vtc_log(band_vl, 0, "BANDEC_00136: Enrollment check failed.");
 		return (1);
 	}
-	STUNC_init();
-	MQTT_init();
-	MBT_init();
-	r = mudband_tunnel_init_chkconfig();
+	/*
+	 * If the previous config is usable, brings up the tunnel with it
+	 * and lets STUN, MQTT and the fetch run on the background.  The
+	 * fresh config is picked up by the iface sync when they're done.
+	 */
+	r = CNF_read_previous();
+	if (r == 0) {
+		r = ODR_pthread_create(&band_bootstrap_tp, NULL,
+		    mudband_tunnel_bootstrap_thread, bs);
+		if (r == 0) {
+			vtc_log(band_vl, 2,
+			    "Bringing up the tunnel with the previous config.");
+			return (0);
+		}
+		vtc_log(band_vl, 1,
+		    "BANDEC_00921: Failed to create the bootstrap thread.");
+		band_bootstrap_tp = NULL;
+	}
+	r = mudband_tunnel_bootstrap(bs);
 	if (r != 0)
 		return (1);
-	MQTT_subscribe();
 	return (0);
 }
 
@@ -1950,6 +3098,11 @@ static void
 mudband_tunnel_fini(void)
 {
 
+	/* The bootstrap could be still in STUN or in the fetch. */
+	if (band_bootstrap_tp != NULL) {
+		AZ(ODR_pthread_join(band_bootstrap_tp, NULL));
+		ODR_pthread_free(band_bootstrap_tp);
+	}
 	CNF_fini();
 	MBE_fini();
 	MBT_fini();
@@ -1965,67 +3118,25 @@ mudband_tunnel_proxy_handler(struct pbuf *p, struct wireguard_sockaddr *wsin)
 	assert(p->len > sizeof(*pkthdr));
 	pkthdr = (struct wireguard_proxy_pkthdr *)p->payload;
 	if (pkthdr->f_version != 1) {
-		wg_stat.n_udp_proxy_rx_errs++;
+		WG_STAT_INC(n_udp_proxy_rx_errs);
 		return (-1);
 	}
 	memcpy(&band_uuid, pkthdr->band_uuid,
 	    sizeof(band_uuid));
 	r = VUUID_compare(&band_uuid, MBE_get_uuid());
 	if (r != 0) {
-		wg_stat.n_udp_proxy_rx_errs++;
+		WG_STAT_INC(n_udp_proxy_rx_errs);
 		return (-1);
 	}
 	wsin->proxy.src_addr = pkthdr->src_addr;
 	wsin->proxy.dst_addr = pkthdr->dst_addr;
 	p->payload += sizeof(*pkthdr);
 	p->len -= sizeof(*pkthdr);
-	wg_stat.n_udp_proxy_rx_pkts++;
-	wg_stat.bytes_udp_proxy_rx += p->len;
+	WG_STAT_INC(n_udp_proxy_rx_pkts);
+	WG_STAT_ADD(bytes_udp_proxy_rx, p->len);
 	return (0);
 }
 
-static void
-wireguard_peer_snapshot_run(struct wireguard_device *device)
-{
-	struct wireguard_peer *peer;
-	struct wireguard_peer_snapshot *new_peer_snapshots = NULL;
-	int i, new_peer_snapshots_count = 0;
-
-	AN(device);
-	assert(device->peers_count >= 0);
-
-	if (device->peers_count == 0)
-               return;
-	if (device->peers_count >= 65536) {
-		vtc_log(band_vl, 0, "BANDEC_00867: Too many peers.");
-		return;
-	}
-       
-	new_peer_snapshots_count = device->peers_count;
-	new_peer_snapshots = malloc(sizeof(struct wireguard_peer_snapshot) *
-		new_peer_snapshots_count);
-	if (new_peer_snapshots == NULL) {
-		vtc_log(band_vl, 0,
-		    "BANDEC_00868: Failed to allocate memory for"
-		    " peer snapshots.");
-		return;
-	}
-	for (i = 0; i < new_peer_snapshots_count; i++) {
-		peer = &device->peers[i];
-
-		new_peer_snapshots[i].iface_addr = peer->iface_addr;
-		new_peer_snapshots[i].endpoint_ip = peer->endpoint_latest_ip;
-		new_peer_snapshots[i].endpoint_port =
-			peer->endpoint_latest_port;
-		new_peer_snapshots[i].endpoint_t_heartbeated =
-			peer->endpoint_latest_t_heartbeated;
-	}
-	if (mbt_peer_snapshots != NULL)
-		free(mbt_peer_snapshots);
-	mbt_peer_snapshots = new_peer_snapshots;
-	mbt_peer_snapshots_count = new_peer_snapshots_count;
-}
-
 static int
 mudband_tunnel(void)
 {
@@ -2047,6 +3158,21 @@ mudband_tunnel(void)
 	callout_reset(&wg_cb, &wg_stat_co, CALLOUT_SECTOTICKS(60),
 	    wireguard_iface_print_stat, NULL);
 	wireguard_init();
+	if (pbuf_pool_size > 0) {
+		struct pbuf_pool_stat pool_stat;
+
+		r = PBUF_pool_init(pbuf_pool_size);
+		if (r != 0) {
+			vtc_log(band_vl, 1,
+			    "BANDEC_00914: Failed to set up the packet buffer"
+			    " pool of %u buffers.", pbuf_pool_size);
+		} else {
+			PBUF_pool_stat(&pool_stat);
+			vtc_log(band_vl, 2,
+			    "Packet buffer pool: %u buffers (%s)",
+			    pool_stat.n_bufs, pool_stat.backing);
+		}
+	}
 
 	CNF_get(&cnf);
 	private_ip = CNF_get_interface_private_ip(cnf->jroot);
@@ -2067,19 +3193,18 @@ mudband_tunnel(void)
 	AN(device);
 	assert(device->udp_fd >= 0);
 	CNF_rel(&cnf);
+	STUNC_wg_enable();
+
+	vtc_log(band_vl, 2, "Brought up the tunnel in %.3f secs.",
+	    VTIM_mono() - band_bootstrap.t_start);
 
 	while (!wg_aborted) {
 		struct wireguard_iphdr *iphdr;
 		int maxfd;
 
-		if (band_need_iface_sync) {
-			band_need_iface_sync = 0;
+		if (__atomic_exchange_n(&band_need_iface_sync, 0,
+		    __ATOMIC_ACQUIRE))
 			wireguard_iface_sync(device);
-		}
-		if (band_need_peer_snapahot) {
-			wireguard_peer_snapshot_run(device);
-			band_need_peer_snapahot = 0;
-		}
 		if (band_mfa_authentication_required) {
 			ODR_msleep(1000);
 			continue;
@@ -2113,12 +3238,12 @@ mudband_tunnel(void)
 			p->len = (size_t)len;
 			iphdr = (struct wireguard_iphdr *)p->payload;
 			if (WIREGUARD_IPHDR_HI_BYTE(iphdr->verlen) != 4) {
-				wg_stat.n_no_ipv4_hdr++;
+				WG_STAT_INC(n_no_ipv4_hdr);
 				pbuf_free(p);
 				goto next;
 			}
-			wg_stat.n_tun_rx_pkts++;
-			wg_stat.bytes_tun_rx += p->len;
+			WG_STAT_INC(n_tun_rx_pkts);
+			WG_STAT_ADD(bytes_tun_rx, p->len);
 			wireguard_iface_output(device, p, iphdr->daddr);
 			pbuf_free(p);
 		}
@@ -2138,8 +3263,14 @@ next:
 			    (socklen_t*)&sinlen);
 			assert(len >= 0);
 			p->len = (size_t)len;
-			wg_stat.n_udp_rx_pkts++;
-			wg_stat.bytes_udp_rx += p->len;
+			WG_STAT_INC(n_udp_rx_pkts);
+			WG_STAT_ADD(bytes_udp_rx, p->len);
+			r = STUNC_input(p->payload, p->len, sin.sin_addr.s_addr,
+			    ntohs(sin.sin_port));
+			if (r == 0) {
+				pbuf_free(p);
+				goto done;
+			}
 			if (ntohs(sin.sin_port) == 82 /* proxy port */) {
 				from_proxy = true;
 				r = mudband_tunnel_proxy_handler(p, &wsin);
@@ -2188,6 +3319,10 @@ usage(void)
 	fprintf(stderr, FMT, "--acl-list", "Get the ACL list.");
 	fprintf(stderr, FMT, "-b <uuid>", "Specify the band UUID to use.");
 	fprintf(stderr, FMT_LONG, "   --band-uuid <uuid>");
+	fprintf(stderr, FMT, "--bench-crypto",
+	    "Benchmark the crypto primitives (JSON output).");
+	fprintf(stderr, FMT, "--bench-peers",
+	    "Benchmark the peer lookups (JSON output).");
 	fprintf(stderr, FMT, "-D, --daemon", "Run in background");
 	fprintf(stderr, FMT, "-e <token>", "Enroll with the given token.");
 	fprintf(stderr, FMT_LONG, "   --enroll-token <token>");
@@ -2199,6 +3334,8 @@ usage(void)
 	fprintf(stderr, FMT, "-n <device_name>",
 	    "Specify the device name.");
 	fprintf(stderr, FMT_LONG, "   --device-name <device_name>");
+	fprintf(stderr, FMT, "--pbuf-pool <n>",
+	    "Preallocate <n> packet buffers at startup.");
 	fprintf(stderr, FMT, "-P <pid_path>", "Specify the PID file path.");
 	fprintf(stderr, FMT_LONG, "   --pid <pid_path>");
 	fprintf(stderr, FMT, "-S, --syslog", "Log to the syslog.");
@@ -2222,12 +3359,15 @@ main(int argc, char *argv[])
 		{ "acl-list", vopt_long_no_argument, NULL, '#' },
 		{ "acl-priority", vopt_long_required_argument, NULL, '%' },
 		{ "band-uuid", vopt_long_required_argument, NULL, 'b' },
+		{ "bench-crypto", vopt_long_no_argument, NULL, '(' },
+		{ "bench-peers", vopt_long_no_argument, NULL, ')' },
 		{ "daemon", vopt_long_no_argument, NULL, 'D' },
 		{ "device-name", vopt_long_required_argument, NULL, 'n' },
 		{ "enroll-list", vopt_long_no_argument, NULL, '&' },
 		{ "enroll-secret", vopt_long_required_argument, NULL, '^' },
 		{ "enroll-token", vopt_long_required_argument, NULL, 'e' },
 		{ "help", vopt_long_no_argument, NULL, 'h' },
+		{ "pbuf-pool", vopt_long_required_argument, NULL, '+' },
 		{ "pid", vopt_long_required_argument, NULL, 'P' },
 		{ "status-snapshot", vopt_long_no_argument, NULL, '*' },
 		{ "syslog", vopt_long_no_argument, NULL, 'S' },
@@ -2236,6 +3376,8 @@ main(int argc, char *argv[])
 		{ NULL, 0, NULL, 0 }
 	};
 	unsigned acl_list_flag = 0;
+	unsigned bench_crypto_flag = 0;
+	unsigned bench_peers_flag = 0;
 	unsigned enroll_list_flag = 0;
 	unsigned W_flag = 0;
 	int ch;
@@ -2270,6 +3412,12 @@ main(int argc, char *argv[])
 		case '%':
 			acl_priority_arg = vopt_arg;
 			break;
+		case '(': /* bench-crypto */
+			bench_crypto_flag = 1 - bench_crypto_flag;
+			break;
+		case ')': /* bench-peers */
+			bench_peers_flag = 1 - bench_peers_flag;
+			break;
 		case '^':
 			enroll_secret_arg = vopt_arg;
 			break;
@@ -2279,6 +3427,9 @@ main(int argc, char *argv[])
 		case '*':
 			status_snapshot_flag = 1 - status_snapshot_flag;
 			break;
+		case '+': /* pbuf-pool */
+			pbuf_pool_size = (uint32_t)strtoul(vopt_arg, NULL, 10);
+			break;
 		case 'b':
 			band_b_arg = vopt_arg;
 			break;
@@ -2314,6 +3465,11 @@ main(int argc, char *argv[])
 	argv += vopt_ind;
 	argc -= vopt_ind;
 
+	if (bench_crypto_flag)
+		return (MBB_crypto());
+	if (bench_peers_flag)
+		return (MBB_peers());
+
 	mudband_init();
 
 	if (e_arg != NULL)
@@ -40,6 +40,7 @@
 
 /* mudband.c */
 #define	WIREGUARD_IFACE_PEER_ENDPOINTS_MAX	16
+#define	WIREGUARD_IFACE_KEEPALIVE_DEFAULT	(0xFFFF)
 struct wireguard_iface_peer {
 	const char *public_key;
 	/*
@@ -74,18 +75,31 @@ struct wireguard_iface_peer {
 	bool otp_enabled;
 	uint64_t otp_sender;
 	uint64_t otp_receiver[3];
+
+	/*
+	 * Static-static DH computed ahead of wireguard_iface_add_peer() by
+	 * the sync worker threads.  Ignored unless public_key_dh_valid.
+	 */
+	bool need_public_key_dh;
+	bool public_key_dh_valid;
+	uint8_t public_key_dh[WIREGUARD_PUBLIC_KEY_LEN];
+
+	/* public_key decoded, from the config cache. */
+	bool public_key_raw_valid;
+	uint8_t public_key_raw[WIREGUARD_PUBLIC_KEY_LEN];
 };
 extern const char *band_b_arg;
 extern char *band_confdir_root;
 extern char *band_confdir_enroll;
 extern int band_need_iface_sync;
-extern int band_need_peer_snapahot;
 extern unsigned status_snapshot_flag;
 extern int band_mfa_authentication_required;
 extern char band_mfa_authentication_url[512];
 int	mudband_log_printf(const char *id, int lvl, double t_elapsed,
 	    const char *msg);
 json_t *wireguard_iface_stat_to_json(void);
+struct wireguard_peer_snapshot;
+int	wireguard_peer_snapshot_get(struct wireguard_peer_snapshot **out);
 
 /* mudband_acl.c */
 int	ACL_init(void);
@@ -93,9 +107,15 @@ int	ACL_cmd(const char *acl_add_arg, const char *acl_priority_arg,
 	    unsigned acl_list_flag, const char *acl_del_arg,
 	    const char *acl_default_policy_arg);
 
+/* mudband_bench.c */
+int	MBB_crypto(void);
+int	MBB_peers(void);
+
 /* mudband_confmgr.c */
+struct cnf_cache;
 struct cnf {
 	json_t		*jroot;
+	struct cnf_cache *cache;
 	int		busy;
 	time_t		t_last;
 	VTAILQ_ENTRY(cnf) list;
@@ -104,11 +124,15 @@ int	CNF_init(void);
 void	CNF_fini(void);
 void	CNF_nuke(void);
 int	CNF_check_and_read(void);
+int	CNF_read_previous(void);
 int	CNF_get(struct cnf **cfp);
 void	CNF_rel(struct cnf **cfp);
 int	CNF_fill_iface_peer(json_t *, struct wireguard_iface_peer *peer,
 	    int idx);
+int	CNF_fill_iface_peer_cached(struct cnf *cnf,
+	    struct wireguard_iface_peer *peer, int idx);
 int	CNF_get_interface_mtu(json_t *);
+int	CNF_get_interface_nat_type(json_t *);
 int	CNF_get_interface_listen_port(json_t *);
 const char *
 	CNF_get_interface_private_ip(json_t *);
@@ -119,6 +143,8 @@ int	CNF_fetch(const char *fetch_type);
 int	CNF_get_peer_size(json_t *);
 struct wireguard_acl *
 	CNF_acl_build(json_t *jroot);
+struct wireguard_acl *
+	CNF_acl_build_cached(struct cnf *cnf);
 const char *
 	CNF_get_interface_device_uuid(json_t *jroot);
 
@@ -157,9 +183,12 @@ struct wireguard_peer_snapshot {
 	uint32_t	endpoint_ip;
 	uint16_t	endpoint_port;
 	time_t		endpoint_t_heartbeated;
+	uint64_t	n_rx_pkts;
+	uint64_t	n_tx_pkts;
+	uint64_t	n_drops;
+	uint64_t	bytes_rx;
+	uint64_t	bytes_tx;
 };
-extern struct wireguard_peer_snapshot *mbt_peer_snapshots;
-extern int mbt_peer_snapshots_count;
 int	MBT_init(void);
 void	MBT_fini(void);
 void	MBT_conf_fetcher_trigger(void);
@@ -0,0 +1,561 @@
+/*
+ * Copyright (c) 2024 Weongyo Jeong (weongyo@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * `mudband --bench-crypto` runs the data plane and handshake primitives in
+ * a loop and prints the numbers as JSON so they can be compared across
+ * releases and CPUs.  Cycle counts come from the TSC where available.
+ *
+ * `mudband --bench-peers` does the same for the per-packet peer lookups
+ * against a large band, with and without the hot peer index, and reports
+ * the cache misses per lookup where perf events are available.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mudband.h"
+
+#include "jansson.h"
+#include "odr.h"
+#include "vtim.h"
+
+#define	MBB_MIN_SECONDS		0.2
+
+typedef void mbb_func_t(void *arg);
+
+struct mbb_result {
+	uint64_t	iterations;
+	double		seconds;
+	uint64_t	cycles;
+};
+
+struct mbb_aead {
+	struct wireguard_keypair keypair;
+	uint8_t		*src;
+	uint8_t		*dst;
+	uint8_t		*ciphertext;
+	size_t		len;
+};
+
+struct mbb_blake2s {
+	uint8_t		*src;
+	size_t		len;
+};
+
+struct mbb_x25519 {
+	uint8_t		private_key[WIREGUARD_PRIVATE_KEY_LEN];
+	uint8_t		public_key[WIREGUARD_PUBLIC_KEY_LEN];
+};
+
+struct mbb_handshake {
+	struct wireguard_device initiator;
+	struct wireguard_device responder;
+	struct wireguard_peer initiator_peer;
+	struct wireguard_peer responder_peer;
+};
+
+#define	MBB_PEERS_COUNT		10000
+#define	MBB_PEERS_PROBES	4096	/* power of 2 */
+
+struct mbb_peers {
+	struct wireguard_device *device;
+	uint32_t	receivers[MBB_PEERS_PROBES];
+	uint32_t	addrs[MBB_PEERS_PROBES];
+	unsigned	i;
+};
+
+static const size_t mbb_sizes[] = { 64, 128, 512, 1420, 65535 };
+static const char *mbb_blake2s_impls[] = { "generic", "sse4.1", "avx" };
+
+static uint64_t
+mbb_cycles(void)
+{
+
+#if defined(__x86_64__) || defined(__i386__)
+	return (__rdtsc());
+#else
+	return (0);
+#endif
+}
+
+static int
+mbb_have_cycles(void)
+{
+
+#if defined(__x86_64__) || defined(__i386__)
+	return (1);
+#else
+	return (0);
+#endif
+}
+
+/*
+ * Doubles the iteration count until one batch takes at least
+ * MBB_MIN_SECONDS so short operations aren't dominated by timer noise.
+ */
+static void
+mbb_run(mbb_func_t *func, void *arg, struct mbb_result *res)
+{
+	uint64_t c0, i, n;
+	double t0;
+
+	func(arg);	/* warm up */
+	for (n = 1; ; n *= 2) {
+		t0 = VTIM_mono();
+		c0 = mbb_cycles();
+		for (i = 0; i < n; i++)
+			func(arg);
+		res->cycles = mbb_cycles() - c0;
+		res->seconds = VTIM_mono() - t0;
+		res->iterations = n;
+		if (res->seconds >= MBB_MIN_SECONDS || n >= (1ULL << 32))
+			break;
+	}
+}
+
+static void
+mbb_report(json_t *jresults, const char *name, const char *impl,
+    size_t bytes, const struct mbb_result *res)
+{
+	json_t *jr;
+	double iters;
+
+	iters = (double)res->iterations;
+	jr = json_object();
+	AN(jr);
+	json_object_set_new(jr, "name", json_string(name));
+	json_object_set_new(jr, "impl", json_string(impl));
+	if (bytes > 0)
+		json_object_set_new(jr, "bytes", json_integer(bytes));
+	json_object_set_new(jr, "iterations", json_integer(res->iterations));
+	json_object_set_new(jr, "ns_per_op",
+	    json_real(res->seconds * 1e9 / iters));
+	json_object_set_new(jr, "ops_per_sec",
+	    json_real(iters / res->seconds));
+	if (bytes > 0) {
+		json_object_set_new(jr, "mbytes_per_sec",
+		    json_real((double)bytes * iters / res->seconds / 1e6));
+	}
+	if (mbb_have_cycles()) {
+		json_object_set_new(jr, "cycles_per_op",
+		    json_real((double)res->cycles / iters));
+		if (bytes > 0) {
+			json_object_set_new(jr, "cycles_per_byte",
+			    json_real((double)res->cycles /
+			    (iters * (double)bytes)));
+		}
+	}
+	json_array_append_new(jresults, jr);
+}
+
+static void
+mbb_encrypt(void *arg)
+{
+	struct mbb_aead *a = arg;
+
+	wireguard_encrypt_packet(a->dst, a->src, a->len, &a->keypair);
+}
+
+static void
+mbb_decrypt(void *arg)
+{
+	struct mbb_aead *a = arg;
+	bool r;
+
+	r = wireguard_decrypt_packet(a->dst, a->ciphertext,
+	    a->len + WIREGUARD_AUTHTAG_LEN, 0, &a->keypair);
+	assert(r);
+}
+
+static void
+mbb_blake2s(void *arg)
+{
+	struct mbb_blake2s *b = arg;
+	uint8_t hash[WIREGUARD_HASH_LEN];
+
+	wireguard_blake2s(hash, sizeof(hash), NULL, 0, b->src, b->len);
+}
+
+static void
+mbb_x25519(void *arg)
+{
+	struct mbb_x25519 *x = arg;
+	uint8_t shared[WIREGUARD_PUBLIC_KEY_LEN];
+
+	(void)wireguard_x25519(shared, x->private_key, x->public_key);
+}
+
+static void
+mbb_handshake(void *arg)
+{
+	struct mbb_handshake *h = arg;
+	struct wireguard_msg_handshake_initiation init;
+	struct wireguard_msg_handshake_response resp;
+	struct wireguard_peer *peer;
+	bool r;
+
+	/* Every round reuses the same peers; skip replay/rate limits. */
+	memset(h->responder_peer.greatest_timestamp, 0,
+	    sizeof(h->responder_peer.greatest_timestamp));
+	h->responder_peer.last_initiation_rx = 0;
+
+	r = wireguard_create_handshake_initiation(&h->initiator,
+	    &h->initiator_peer, &init);
+	assert(r);
+	r = wireguard_check_mac1(&h->responder, (uint8_t *)&init,
+	    sizeof(init) - (2 * WIREGUARD_COOKIE_LEN), init.mac1);
+	assert(r);
+	peer = wireguard_process_initiation_message(&h->responder, &init);
+	AN(peer);
+	r = wireguard_create_handshake_response(&h->responder, peer, &resp);
+	assert(r);
+	r = wireguard_check_mac1(&h->initiator, (uint8_t *)&resp,
+	    sizeof(resp) - (2 * WIREGUARD_COOKIE_LEN), resp.mac1);
+	assert(r);
+	r = wireguard_process_handshake_response(&h->initiator,
+	    &h->initiator_peer, &resp);
+	assert(r);
+	wireguard_start_session(&h->initiator_peer, true);
+	wireguard_start_session(peer, false);
+}
+
+static void
+mbb_bench_aead(json_t *jresults)
+{
+	struct mbb_aead a;
+	struct mbb_result res;
+	size_t i;
+
+	for (i = 0; i < sizeof(mbb_sizes) / sizeof(mbb_sizes[0]); i++) {
+		memset(&a, 0, sizeof(a));
+		wireguard_random_bytes(a.keypair.sending_key,
+		    sizeof(a.keypair.sending_key));
+		memcpy(a.keypair.receiving_key, a.keypair.sending_key,
+		    sizeof(a.keypair.receiving_key));
+		a.len = mbb_sizes[i];
+		a.src = malloc(a.len);
+		AN(a.src);
+		a.dst = malloc(a.len + WIREGUARD_AUTHTAG_LEN);
+		AN(a.dst);
+		a.ciphertext = malloc(a.len + WIREGUARD_AUTHTAG_LEN);
+		AN(a.ciphertext);
+		wireguard_random_bytes(a.src, a.len);
+		wireguard_encrypt_packet(a.ciphertext, a.src, a.len,
+		    &a.keypair);
+
+		mbb_run(mbb_encrypt, &a, &res);
+		mbb_report(jresults, "encrypt", "chacha20poly1305", a.len,
+		    &res);
+		mbb_run(mbb_decrypt, &a, &res);
+		mbb_report(jresults, "decrypt", "chacha20poly1305", a.len,
+		    &res);
+
+		free(a.src);
+		free(a.dst);
+		free(a.ciphertext);
+	}
+}
+
+static void
+mbb_bench_blake2s(json_t *jresults)
+{
+	struct mbb_blake2s b;
+	struct mbb_result res;
+	const char *impl;
+	size_t i, j;
+
+	impl = blake2s_impl();
+	for (j = 0; j < sizeof(mbb_blake2s_impls) / sizeof(char *); j++) {
+		if (blake2s_impl_set(mbb_blake2s_impls[j]) != 0)
+			continue;
+		for (i = 0; i < sizeof(mbb_sizes) / sizeof(mbb_sizes[0]); i++) {
+			b.len = mbb_sizes[i];
+			b.src = malloc(b.len);
+			AN(b.src);
+			wireguard_random_bytes(b.src, b.len);
+			mbb_run(mbb_blake2s, &b, &res);
+			mbb_report(jresults, "blake2s", mbb_blake2s_impls[j],
+			    b.len, &res);
+			free(b.src);
+		}
+	}
+	AZ(blake2s_impl_set(impl));
+}
+
+static void
+mbb_bench_x25519(json_t *jresults)
+{
+	struct mbb_x25519 x;
+	struct mbb_result res;
+	uint8_t private_key[WIREGUARD_PRIVATE_KEY_LEN];
+
+	wireguard_generate_private_key(x.private_key);
+	wireguard_generate_private_key(private_key);
+	AN(wireguard_generate_public_key(x.public_key, private_key));
+	mbb_run(mbb_x25519, &x, &res);
+	mbb_report(jresults, "x25519", "x25519", 0, &res);
+}
+
+static void
+mbb_bench_handshake(json_t *jresults)
+{
+	struct mbb_handshake *h;
+	struct mbb_result res;
+	uint8_t private_key[WIREGUARD_PRIVATE_KEY_LEN];
+
+	h = calloc(1, sizeof(*h));
+	AN(h);
+	h->initiator.peers = &h->initiator_peer;
+	h->initiator.peers_count = 1;
+	h->responder.peers = &h->responder_peer;
+	h->responder.peers_count = 1;
+	wireguard_generate_private_key(private_key);
+	AN(wireguard_device_init(&h->initiator, private_key));
+	wireguard_generate_private_key(private_key);
+	AN(wireguard_device_init(&h->responder, private_key));
+	AN(wireguard_peer_init(&h->initiator, &h->initiator_peer,
+	    h->responder.public_key, NULL));
+	AN(wireguard_peer_init(&h->responder, &h->responder_peer,
+	    h->initiator.public_key, NULL));
+	mbb_run(mbb_handshake, h, &res);
+	mbb_report(jresults, "handshake", blake2s_impl(), 0, &res);
+	free(h);
+}
+
+int
+MBB_crypto(void)
+{
+	json_t *jroot, *jresults;
+	char *out;
+
+	wireguard_init();
+
+	jroot = json_object();
+	AN(jroot);
+	jresults = json_array();
+	AN(jresults);
+	json_object_set_new(jroot, "cycles_source",
+	    json_string(mbb_have_cycles() ? "tsc" : "none"));
+	json_object_set_new(jroot, "blake2s_impl", json_string(blake2s_impl()));
+
+	mbb_bench_aead(jresults);
+	mbb_bench_blake2s(jresults);
+	mbb_bench_x25519(jresults);
+	mbb_bench_handshake(jresults);
+	json_object_set_new(jroot, "results", jresults);
+
+	out = json_dumps(jroot, JSON_INDENT(2));
+	AN(out);
+	fprintf(stdout, "%s\n", out);
+	free(out);
+	json_decref(jroot);
+	return (0);
+}
+
+static void
+mbb_lookup_by_receiver(void *arg)
+{
+	struct mbb_peers *p = arg;
+
+	AN(wireguard_peer_lookup_by_receiver(p->device,
+	    p->receivers[p->i++ & (MBB_PEERS_PROBES - 1)]));
+}
+
+static void
+mbb_lookup_by_allowed_ip(void *arg)
+{
+	struct mbb_peers *p = arg;
+
+	AN(wireguard_peer_lookup_by_allowed_ip(p->device,
+	    p->addrs[p->i++ & (MBB_PEERS_PROBES - 1)]));
+}
+
+static int
+mbb_perf_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return ((int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+/*
+ * Counts the cache misses over one pass of the probes.  Returns a negative
+ * value if the counter isn't available (no PMU, perf_event_paranoid).
+ */
+static double
+mbb_cache_misses(int fd, mbb_func_t *func, void *arg)
+{
+	uint64_t count;
+	int i;
+
+	if (fd < 0)
+		return (-1.0);
+	AZ(ioctl(fd, PERF_EVENT_IOC_RESET, 0));
+	AZ(ioctl(fd, PERF_EVENT_IOC_ENABLE, 0));
+	for (i = 0; i < MBB_PEERS_PROBES; i++)
+		func(arg);
+	AZ(ioctl(fd, PERF_EVENT_IOC_DISABLE, 0));
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		return (-1.0);
+	return ((double)count / MBB_PEERS_PROBES);
+}
+
+static void
+mbb_bench_lookup(json_t *jresults, int fd, const char *name,
+    mbb_func_t *func, struct mbb_peers *p, bool hot)
+{
+	struct wireguard_device *device = p->device;
+	struct wireguard_peer *base;
+	struct mbb_result res;
+	double misses;
+	json_t *jr;
+
+	/* Hiding the index makes the lookups fall back to the full scan. */
+	base = device->peers_hot_base;
+	if (!hot)
+		device->peers_hot_base = NULL;
+	mbb_run(func, p, &res);
+	misses = mbb_cache_misses(fd, func, p);
+	device->peers_hot_base = base;
+	mbb_report(jresults, name, hot ? "hot" : "full", 0, &res);
+	jr = json_array_get(jresults, json_array_size(jresults) - 1);
+	AN(jr);
+	json_object_set_new(jr, "cache_misses_per_op",
+	    misses < 0 ? json_null() : json_real(misses));
+}
+
+int
+MBB_peers(void)
+{
+	struct wireguard_device *device;
+	struct wireguard_peer *peer;
+	struct mbb_peers *p;
+	json_t *jroot, *jresults;
+	uint8_t private_key[WIREGUARD_PRIVATE_KEY_LEN];
+	uint8_t public_key[WIREGUARD_PUBLIC_KEY_LEN];
+	uint8_t public_key_dh[WIREGUARD_PUBLIC_KEY_LEN];
+	uint32_t x;
+	char *out;
+	int fd, i;
+
+	wireguard_init();
+
+	device = calloc(1, sizeof(*device));
+	AN(device);
+	wireguard_generate_private_key(private_key);
+	AN(wireguard_device_init(device, private_key));
+	device->peers_count = MBB_PEERS_COUNT;
+	device->peers = calloc(device->peers_count, sizeof(*device->peers));
+	AN(device->peers);
+	/*
+	 * The DH result isn't used by the lookups so skip the x25519 for
+	 * each of the peers.
+	 */
+	wireguard_random_bytes(public_key_dh, sizeof(public_key_dh));
+	for (i = 0; i < device->peers_count; i++) {
+		peer = &device->peers[i];
+		wireguard_random_bytes(public_key, sizeof(public_key));
+		AN(wireguard_peer_init_dh(device, peer, public_key, NULL,
+		    public_key_dh));
+		peer->curr_keypair.valid = true;
+		peer->curr_keypair.local_index = (uint32_t)i * 2 + 1;
+		peer->prev_keypair.valid = true;
+		peer->prev_keypair.local_index = (uint32_t)i * 2 + 2;
+		peer->allowed_source_ips[0].valid = true;
+		peer->allowed_source_ips[0].ip = htonl(0x0a000000 | (i + 1));
+		peer->allowed_source_ips[0].mask = 0xffffffff;
+	}
+	wireguard_device_peers_index(device);
+	AN(device->peers_hot);
+
+	p = calloc(1, sizeof(*p));
+	AN(p);
+	p->device = device;
+	for (i = 0; i < MBB_PEERS_PROBES; i++) {
+		wireguard_random_bytes(&x, sizeof(x));
+		x %= MBB_PEERS_COUNT;
+		p->receivers[i] = x * 2 + 1;
+		p->addrs[i] = htonl(0x0a000000 | (x + 1));
+	}
+	fd = mbb_perf_open();
+
+	jroot = json_object();
+	AN(jroot);
+	jresults = json_array();
+	AN(jresults);
+	json_object_set_new(jroot, "cycles_source",
+	    json_string(mbb_have_cycles() ? "tsc" : "none"));
+	json_object_set_new(jroot, "cache_misses_source",
+	    json_string(fd >= 0 ? "perf" : "none"));
+	json_object_set_new(jroot, "peers", json_integer(MBB_PEERS_COUNT));
+	json_object_set_new(jroot, "peer_bytes",
+	    json_integer(sizeof(struct wireguard_peer)));
+	json_object_set_new(jroot, "peer_hot_bytes",
+	    json_integer(sizeof(struct wireguard_peer_hot)));
+
+	mbb_bench_lookup(jresults, fd, "lookup_by_receiver",
+	    mbb_lookup_by_receiver, p, false);
+	mbb_bench_lookup(jresults, fd, "lookup_by_receiver",
+	    mbb_lookup_by_receiver, p, true);
+	mbb_bench_lookup(jresults, fd, "lookup_by_allowed_ip",
+	    mbb_lookup_by_allowed_ip, p, false);
+	mbb_bench_lookup(jresults, fd, "lookup_by_allowed_ip",
+	    mbb_lookup_by_allowed_ip, p, true);
+	json_object_set_new(jroot, "results", jresults);
+
+	out = json_dumps(jroot, JSON_INDENT(2));
+	AN(out);
+	fprintf(stdout, "%s\n", out);
+	free(out);
+	json_decref(jroot);
+	if (fd >= 0)
+		(void)close(fd);
+	free(p);
+	free(device->peers_hot);
+	free(device->peers);
+	free(device);
+	return (0);
+}
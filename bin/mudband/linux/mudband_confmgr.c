@@ -28,6 +28,7 @@
 #include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <linux/if_tun.h>
 #include <arpa/inet.h>
@@ -52,6 +53,7 @@
 #include "vqueue.h"
 #include "vsock.h"
 #include "vtc_log.h"
+#include "vgz.h"
 
 #include "mudband_bpf.h"
 #include "callout.h"
@@ -229,37 +231,21 @@ cnf_get_interface_remote_addr_by_obj(json_t *jroot)
 	return (json_string_value(remote_addr));
 }
 
-int
-CNF_check_and_read(void)
+/*
+ * Checks whether the config was made for the current STUN result.
+ * Returns -3 if the NAT type changed or -4 if the mapped address changed.
+ */
+static int
+cnf_stun_check(json_t *jroot)
 {
-	json_t *jroot;
-	json_error_t jerror;
 	int nt1, nt2;
 	const char *ma1, *ma2;
-	char filepath[ODR_BUFSIZ];
 
-	vtc_log(cnf_vl, 2, "Checking the config.");
-
-	ODR_snprintf(filepath, sizeof(filepath), "%s/conf_%s.json",
-	    band_confdir_enroll, MBE_get_uuidstr());
-	if (ODR_access(filepath, ODR_ACCESS_F_OK) != 0) {
-		vtc_log(cnf_vl, 2, "Accesing to %s file failed: %s", filepath,
-		    strerror(errno));
-		return (-1);
-	}
-	jroot = json_load_file(filepath, 0, &jerror);
-	if (jroot == NULL) {
-		vtc_log(cnf_vl, 0, "json_load_file(%s) failed: %d %s",
-		    filepath, jerror.line, jerror.text);
-		return (-2);
-	}
-	assert(json_is_object(jroot));
 	nt1 = cnf_get_interface_nat_type_by_obj(jroot);
 	nt2 = (int)STUNC_get_nattype();
 	if (nt1 != nt2) {
 		vtc_log(cnf_vl, 2,
 		    "NAT type changed. Need to refresh the config.");
-		json_decref(jroot);
 		return (-3);
 	}
 	ma1 = STUNC_get_mappped_addr();
@@ -270,28 +256,8 @@ CNF_check_and_read(void)
 		    "Mapped address changed (%s -> %s)."
 		    " Need to refresh the config.",
 		    ma1, ma2);
-		json_decref(jroot);
 		return (-4);
 	}
-	{
-		struct cnf *cnf;
-
-		AZ(ODR_pthread_mutex_lock(&cnf_mtx));
-		cnf = calloc(1, sizeof(*cnf));
-		AN(cnf);
-		cnf->jroot = jroot;
-		cnf->t_last = time(NULL);
-		VTAILQ_INSERT_TAIL(&cnf_head, cnf, list);
-		cnf_active = cnf;
-		AZ(ODR_pthread_mutex_unlock(&cnf_mtx));
-	}
-	if (CNF_get_peer_size(jroot) == 0) {
-		vtc_log(cnf_vl, 2,
-		    "No peer found. Let's try refresh the config.");
-		/* no json_decref here. */
-		return (-5);
-	}
-	vtc_log(cnf_vl, 2, "Completed to read the config.");
 	return (0);
 }
 
@@ -326,8 +292,9 @@ CNF_get_peer_size(json_t *jroot)
 	return ((int)json_array_size(jpeers));
 }
 
-struct wireguard_acl *
-CNF_acl_build(json_t *jroot)
+/* Reads and validates the ACL programs. */
+static struct wireguard_acl *
+cnf_acl_parse(json_t *jroot)
 {
 	struct wireguard_acl *acl;
 	json_t *jacl, *jprograms, *jdefault_policy;
@@ -411,150 +378,683 @@ CNF_acl_build(json_t *jroot)
 	return (acl);
 }
 
+static void
+cnf_acl_compile(struct wireguard_acl *acl)
+{
+	size_t n_compiled;
+
+	n_compiled = wireguard_acl_compile(acl);
+	vtc_log(cnf_vl, 3,
+	    "ACL: %zu of %zu programs compiled into %zu rules (%zu tuples)",
+	    n_compiled, acl->n_programs, acl->classifier.n_rules,
+	    acl->classifier.n_tuples);
+}
+
+struct wireguard_acl *
+CNF_acl_build(json_t *jroot)
+{
+	struct wireguard_acl *acl;
+
+	acl = cnf_acl_parse(jroot);
+	if (acl == NULL)
+		return (NULL);
+	cnf_acl_compile(acl);
+	return (acl);
+}
+
 int
 CNF_fill_iface_peer(json_t *jroot, struct wireguard_iface_peer *peer,
     int idx)
 {
-	json_t *jpeers;
-	int i, interface_nat_type;
+	json_t *jpeers, *jpeer, *jprivate_ip;
+	json_t *jwireguard_pubkey, *jprivate_mask;
+	json_t *jdevice_addresses, *jdevice_address;
+	json_t *jnat_type, *jotp_sender, *jotp_receiver;
+	int interface_nat_type, peer_nat_type;
+	size_t x, z;
 
 	interface_nat_type = cnf_get_interface_nat_type_by_obj(jroot);
 	AN(jroot);
 	jpeers = json_object_get(jroot, "peers");
 	AN(jpeers);
 	assert(json_is_array(jpeers));
-	for (i = 0; i < (int)json_array_size(jpeers); i++) {
-		json_t *jpeer, *jprivate_ip;
-		json_t *jwireguard_pubkey, *jprivate_mask;
-		json_t *jdevice_addresses, *jdevice_address;
-		json_t *jnat_type, *jotp_sender, *jotp_receiver;
-		int peer_nat_type;
-		size_t x, z;
-
-		if (i != idx)
-			continue;
-		jpeer = json_array_get(jpeers, i);
-		AN(jpeer);
-		assert(json_is_object(jpeer));
-		/* otp_sender */
-		jotp_sender = json_object_get(jpeer, "otp_sender");
-		AN(jotp_sender);
-		assert(json_is_string(jotp_sender));
-		assert(json_string_length(jotp_sender) > 0);
-		/* otp_receiver */
-		jotp_receiver = json_object_get(jpeer, "otp_receiver");
-		AN(jotp_receiver);
-		assert(json_is_array(jotp_receiver));
-		assert(json_array_size(jotp_receiver) == 3);
-		/* wireguard_pubkey */
-		jwireguard_pubkey = json_object_get(jpeer, "wireguard_pubkey");
-		AN(jwireguard_pubkey);
-		assert(json_is_string(jwireguard_pubkey));
-		assert(json_string_length(jwireguard_pubkey) > 0);
-		/* private_ip */
-		jprivate_ip = json_object_get(jpeer, "private_ip");
-		AN(jprivate_ip);
-		assert(json_is_string(jprivate_ip));
-		assert(json_string_length(jprivate_ip) > 0);
-		cnf_ipv4_verify(json_string_value(jprivate_ip));
-		/* private_mask */
-		jprivate_mask = json_object_get(jpeer, "private_mask");
-		AN(jprivate_mask);
-		assert(json_is_string(jprivate_mask));
-		assert(json_string_length(jprivate_mask) > 0);
-		cnf_ipv4_verify(json_string_value(jprivate_mask));
-		/* nat_type */
-		jnat_type = json_object_get(jpeer, "nat_type");
-		AN(jnat_type);
-		assert(json_is_integer(jnat_type));
-		peer_nat_type = (int)json_integer_value(jnat_type);
+	if (idx < 0 || idx >= (int)json_array_size(jpeers))
+		return (-1);
+	jpeer = json_array_get(jpeers, idx);
+	AN(jpeer);
+	assert(json_is_object(jpeer));
+	/* otp_sender */
+	jotp_sender = json_object_get(jpeer, "otp_sender");
+	AN(jotp_sender);
+	assert(json_is_string(jotp_sender));
+	assert(json_string_length(jotp_sender) > 0);
+	/* otp_receiver */
+	jotp_receiver = json_object_get(jpeer, "otp_receiver");
+	AN(jotp_receiver);
+	assert(json_is_array(jotp_receiver));
+	assert(json_array_size(jotp_receiver) == 3);
+	/* wireguard_pubkey */
+	jwireguard_pubkey = json_object_get(jpeer, "wireguard_pubkey");
+	AN(jwireguard_pubkey);
+	assert(json_is_string(jwireguard_pubkey));
+	assert(json_string_length(jwireguard_pubkey) > 0);
+	/* private_ip */
+	jprivate_ip = json_object_get(jpeer, "private_ip");
+	AN(jprivate_ip);
+	assert(json_is_string(jprivate_ip));
+	assert(json_string_length(jprivate_ip) > 0);
+	cnf_ipv4_verify(json_string_value(jprivate_ip));
+	/* private_mask */
+	jprivate_mask = json_object_get(jpeer, "private_mask");
+	AN(jprivate_mask);
+	assert(json_is_string(jprivate_mask));
+	assert(json_string_length(jprivate_mask) > 0);
+	cnf_ipv4_verify(json_string_value(jprivate_mask));
+	/* nat_type */
+	jnat_type = json_object_get(jpeer, "nat_type");
+	AN(jnat_type);
+	assert(json_is_integer(jnat_type));
+	peer_nat_type = (int)json_integer_value(jnat_type);
+	if (interface_nat_type == 2 /* Open */ &&
+	    peer_nat_type == 2 /* Open */) {
+		/*
+		 * If the interface NAT type is Open and the peer NAT
+		 * type is also Open, we don't need to send a keepalive
+		 * packet.
+		 */
+		peer->keep_alive = 0;
+	}
+	/* device_addresses */
+	jdevice_addresses = json_object_get(jpeer, "device_addresses");
+	AN(jdevice_addresses);
+	assert(json_is_array(jdevice_addresses));
+	assert(json_array_size(jdevice_addresses) > 0);
+	for (x = 0; x < json_array_size(jdevice_addresses); x++) {
+		json_t *jport, *jaddress, *jtype;
+		const char *device_address;
+
+		jdevice_address = json_array_get(jdevice_addresses, x);
+		AN(jdevice_address);
+		assert(json_is_object(jdevice_address));
+		/* address */
+		jaddress = json_object_get(jdevice_address, "address");
+		AN(jaddress);
+		assert(json_is_string(jaddress));
+		assert(json_string_length(jaddress) > 0);
+		cnf_ipv4_verify(json_string_value(jaddress));
+		/* port */
+		jport = json_object_get(jdevice_address, "port");
+		AN(jport);
+		assert(json_is_integer(jport));
+		/* type */
+		jtype = json_object_get(jdevice_address, "type");
+		AN(jtype);
+		assert(json_is_string(jtype));
+		assert(json_string_length(jtype) > 0);
 		if (interface_nat_type == 2 /* Open */ &&
-		    peer_nat_type == 2 /* Open */) {
+		    peer_nat_type == 2 /* Open */ &&
+		    !strcmp(json_string_value(jtype), "proxy")) {
 			/*
-			 * If the interface NAT type is Open and the peer NAT
-			 * type is also Open, we don't need to send a keepalive
-			 * packet.
+			 * If the interface NAT type is Open and
+			 * the peer NAT type is also Open, we don't
+			 * need to use proxy.
 			 */
-			peer->keep_alive = 0;
+			continue;
 		}
-		/* device_addresses */
-		jdevice_addresses = json_object_get(jpeer, "device_addresses");
-		AN(jdevice_addresses);
-		assert(json_is_array(jdevice_addresses));
-		assert(json_array_size(jdevice_addresses) > 0);
-		for (x = 0; x < json_array_size(jdevice_addresses); x++) {
-			json_t *jport, *jaddress, *jtype;
-			const char *device_address;
-
-			jdevice_address = json_array_get(jdevice_addresses, x);
-			AN(jdevice_address);
-			assert(json_is_object(jdevice_address));
-			/* address */
-			jaddress = json_object_get(jdevice_address, "address");
-			AN(jaddress);
-			assert(json_is_string(jaddress));
-			assert(json_string_length(jaddress) > 0);
-			cnf_ipv4_verify(json_string_value(jaddress));
-			/* port */
-			jport = json_object_get(jdevice_address, "port");
-			AN(jport);
-			assert(json_is_integer(jport));
-			/* type */
-			jtype = json_object_get(jdevice_address, "type");
-			AN(jtype);
-			assert(json_is_string(jtype));
-			assert(json_string_length(jtype) > 0);
-			if (interface_nat_type == 2 /* Open */ &&
-			    peer_nat_type == 2 /* Open */ &&
-			    !strcmp(json_string_value(jtype), "proxy")) {
-				/*
-				 * If the interface NAT type is Open and
-				 * the peer NAT type is also Open, we don't
-				 * need to use proxy.
-				 */
-				continue;
-			}
 
-			device_address = json_string_value(jaddress);
-			peer->endpoints[peer->n_endpoints].ip =
-			    (uint32_t)inet_addr(device_address);
-			peer->endpoints[peer->n_endpoints].port =
-			    (uint16_t)json_integer_value(jport);
-			peer->endpoints[peer->n_endpoints].is_proxy = false;
-			if (!strcmp(json_string_value(jtype), "proxy"))
-				peer->endpoints[peer->n_endpoints].is_proxy =
-				    true;
-			peer->n_endpoints++;
+		device_address = json_string_value(jaddress);
+		peer->endpoints[peer->n_endpoints].ip =
+		    (uint32_t)inet_addr(device_address);
+		peer->endpoints[peer->n_endpoints].port =
+		    (uint16_t)json_integer_value(jport);
+		peer->endpoints[peer->n_endpoints].is_proxy = false;
+		if (!strcmp(json_string_value(jtype), "proxy"))
+			peer->endpoints[peer->n_endpoints].is_proxy =
+			    true;
+		peer->n_endpoints++;
+	}
+	peer->public_key = json_string_value(jwireguard_pubkey);
+	peer->allowed_ip =
+	    (uint32_t)inet_addr(json_string_value(jprivate_ip));
+	peer->allowed_mask =
+	    (uint32_t)inet_addr(json_string_value(jprivate_mask));
+	/* XXX */
+	peer->iface_addr = peer->allowed_ip;
+	peer->otp_sender =
+	    (uint64_t)strtoull(json_string_value(jotp_sender), NULL, 16);
+	for (z = 0; z < json_array_size(jotp_receiver); z++) {
+		json_t *jone;
+
+		jone = json_array_get(jotp_receiver, z);
+		AN(jone);
+		assert(json_is_string(jone));
+		assert(json_string_length(jone) > 0);
+		peer->otp_receiver[z] =
+		    (uint64_t)strtoull(json_string_value(jone), NULL,
+			16);
+	}
+	peer->otp_enabled = false;
+	if (peer->otp_receiver[0] != 0 ||
+	    peer->otp_receiver[1] != 0 ||
+	    peer->otp_receiver[2] != 0) {
+		peer->otp_enabled = true;
+	}
+	return (0);
+}
+
+static const char *
+cnf_get_etag(json_t *jroot)
+{
+	json_t *jetag;
+
+	AN(jroot);
+	jetag = json_object_get(jroot, "etag");
+	if (jetag == NULL)
+		return (NULL);
+	assert(json_is_string(jetag));
+	if (json_string_length(jetag) == 0)
+		return (NULL);
+	return (json_string_value(jetag));
+}
+
+static const char *
+cnf_peer_pubkey(json_t *jpeer)
+{
+	json_t *jpubkey;
+
+	if (!json_is_object(jpeer))
+		return (NULL);
+	jpubkey = json_object_get(jpeer, "wireguard_pubkey");
+	if (!json_is_string(jpubkey) || json_string_length(jpubkey) == 0)
+		return (NULL);
+	return (json_string_value(jpubkey));
+}
+
+/*
+ * Builds the new config by applying a delta response to the active one.
+ * The delta looks like
+ *
+ *	{ "base_etag": "...",
+ *	  "peers_remove": [ "<wireguard_pubkey>", ... ],
+ *	  "peers_modify": [ { <peer> }, ... ],
+ *	  "peers_add": [ { <peer> }, ... ],
+ *	  "interface": { ... }, "acl": { ... } }
+ *
+ * where every key but base_etag is optional and "interface" and "acl"
+ * replace the whole object.  Peers keep their order; added ones go last.
+ * Returns NULL if the active config isn't the base of the delta or the
+ * delta doesn't fit it, in which case the caller fetches the full config.
+ */
+static json_t *
+cnf_delta_apply(json_t *jdelta)
+{
+	struct cnf *cnf;
+	json_t *jconf = NULL, *jbase, *jpeers, *jnpeers, *jmap, *jops, *jpeer;
+	json_t *jobj;
+	const char *base_etag, *etag, *pubkey;
+	size_t i;
+	int r;
+
+	jbase = json_object_get(jdelta, "base_etag");
+	if (!json_is_string(jbase))
+		return (NULL);
+	base_etag = json_string_value(jbase);
+	r = CNF_get(&cnf);
+	if (r != 0)
+		return (NULL);
+	etag = cnf_get_etag(cnf->jroot);
+	if (etag != NULL && !strcmp(etag, base_etag))
+		jconf = json_deep_copy(cnf->jroot);
+	CNF_rel(&cnf);
+	if (jconf == NULL)
+		return (NULL);
+	/* The public key to peer map the operations work on. */
+	jmap = json_object();
+	AN(jmap);
+	jpeers = json_object_get(jconf, "peers");
+	AN(jpeers);
+	json_array_foreach(jpeers, i, jpeer) {
+		pubkey = cnf_peer_pubkey(jpeer);
+		if (pubkey == NULL)
+			goto fail;
+		json_object_set(jmap, pubkey, jpeer);
+	}
+	jops = json_object_get(jdelta, "peers_remove");
+	json_array_foreach(jops, i, jobj) {
+		if (!json_is_string(jobj) ||
+		    json_object_del(jmap, json_string_value(jobj)) != 0)
+			goto fail;
+	}
+	jops = json_object_get(jdelta, "peers_modify");
+	json_array_foreach(jops, i, jpeer) {
+		pubkey = cnf_peer_pubkey(jpeer);
+		if (pubkey == NULL || json_object_get(jmap, pubkey) == NULL)
+			goto fail;
+		json_object_set(jmap, pubkey, jpeer);
+	}
+	jnpeers = json_array();
+	AN(jnpeers);
+	json_array_foreach(jpeers, i, jpeer) {
+		pubkey = cnf_peer_pubkey(jpeer);
+		AN(pubkey);
+		jobj = json_object_get(jmap, pubkey);
+		if (jobj != NULL)
+			json_array_append(jnpeers, jobj);
+	}
+	jops = json_object_get(jdelta, "peers_add");
+	json_array_foreach(jops, i, jpeer) {
+		pubkey = cnf_peer_pubkey(jpeer);
+		if (pubkey == NULL || json_object_get(jmap, pubkey) != NULL) {
+			json_decref(jnpeers);
+			goto fail;
 		}
-		peer->public_key = json_string_value(jwireguard_pubkey);
-		peer->allowed_ip =
-		    (uint32_t)inet_addr(json_string_value(jprivate_ip));
-		peer->allowed_mask =
-		    (uint32_t)inet_addr(json_string_value(jprivate_mask));
-		/* XXX */
-		peer->iface_addr = peer->allowed_ip;
-		peer->otp_sender =
-		    (uint64_t)strtoull(json_string_value(jotp_sender), NULL, 16);
-		for (z = 0; z < json_array_size(jotp_receiver); z++) {
-			json_t *jone;
-
-			jone = json_array_get(jotp_receiver, z);
-			AN(jone);
-			assert(json_is_string(jone));
-			assert(json_string_length(jone) > 0);
-			peer->otp_receiver[z] =
-			    (uint64_t)strtoull(json_string_value(jone), NULL,
-				16);
+		json_object_set(jmap, pubkey, jpeer);
+		json_array_append(jnpeers, jpeer);
+	}
+	json_object_set_new(jconf, "peers", jnpeers);
+	jobj = json_object_get(jdelta, "interface");
+	if (json_is_object(jobj))
+		json_object_set(jconf, "interface", jobj);
+	jobj = json_object_get(jdelta, "acl");
+	if (json_is_object(jobj))
+		json_object_set(jconf, "acl", jobj);
+	json_object_del(jconf, "etag");
+	json_decref(jmap);
+	return (jconf);
+fail:
+	json_decref(jmap);
+	json_decref(jconf);
+	return (NULL);
+}
+
+/*
+ * A binary copy of what the sync reads out of a config, written next to
+ * conf_<uuid>.json after each fetch: a fixed layout peer table with the
+ * public keys already decoded and the ACL programs already validated.
+ * It's mapped when the JSON is read and used only if its checksum, its
+ * layout and the etag match, so the sync doesn't walk and check every
+ * peer's JSON again at startup.
+ */
+#define	CNF_CACHE_MAGIC		0x4d424343
+#define	CNF_CACHE_VERSION	1
+
+struct cnf_cache_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	hdrlen;
+	uint32_t	peerlen;
+	uint32_t	crc;		/* of everything after the header */
+	uint32_t	n_peers;
+	uint32_t	n_programs;
+	uint32_t	default_policy;
+	uint32_t	nat_type;
+	char		etag[68];
+};
+
+struct cnf_cache_peer {
+	uint8_t		public_key[WIREGUARD_PUBLIC_KEY_LEN];
+	uint32_t	allowed_ip;	/* network order */
+	uint32_t	allowed_mask;
+	uint64_t	otp_sender;
+	uint64_t	otp_receiver[3];
+	struct {
+		uint32_t	ip;	/* network order */
+		uint16_t	port;
+		uint8_t		is_proxy;
+		uint8_t		unused;
+	} endpoints[WIREGUARD_IFACE_PEER_ENDPOINTS_MAX];
+	uint16_t	keep_alive;
+	uint8_t		n_endpoints;
+	uint8_t		otp_enabled;
+	uint8_t		unused[4];
+};
+
+/* Followed by the programs, each a uint32_t n_insns and its insns. */
+
+struct cnf_cache {
+	void		*base;
+	size_t		len;
+	const struct cnf_cache_hdr *hdr;
+	const struct cnf_cache_peer *peers;
+	const uint8_t	*programs;
+};
+
+static void
+cnf_cache_path(char *buf, size_t buflen, const char *suffix)
+{
+
+	ODR_snprintf(buf, buflen, "%s/conf_%s.bin%s", band_confdir_enroll,
+	    MBE_get_uuidstr(), suffix);
+}
+
+static void
+cnf_cache_write(json_t *jconf)
+{
+	struct cnf_cache_hdr *hdr;
+	struct cnf_cache_peer *cp;
+	struct wireguard_acl *acl;
+	struct wireguard_iface_peer p;
+	size_t len, off, public_key_len;
+	uint32_t n_insns;
+	uint8_t *buf;
+	const char *etag;
+	char filepath[ODR_BUFSIZ], tmppath[ODR_BUFSIZ];
+	int fd, i, n_peers, r;
+	uint8_t x;
+
+	etag = cnf_get_etag(jconf);
+	if (etag == NULL || strlen(etag) >= sizeof(hdr->etag))
+		return;
+	acl = cnf_acl_parse(jconf);
+	if (acl == NULL)
+		return;
+	n_peers = CNF_get_peer_size(jconf);
+	len = sizeof(*hdr) + n_peers * sizeof(*cp);
+	for (i = 0; i < (int)acl->n_programs; i++) {
+		len += sizeof(n_insns) +
+		    acl->programs[i].n_insns * sizeof(struct mudband_bpf_insn);
+	}
+	buf = calloc(1, len);
+	AN(buf);
+	hdr = (struct cnf_cache_hdr *)buf;
+	hdr->magic = CNF_CACHE_MAGIC;
+	hdr->version = CNF_CACHE_VERSION;
+	hdr->hdrlen = sizeof(*hdr);
+	hdr->peerlen = sizeof(*cp);
+	hdr->n_peers = n_peers;
+	hdr->n_programs = acl->n_programs;
+	hdr->default_policy = acl->default_policy;
+	hdr->nat_type = cnf_get_interface_nat_type_by_obj(jconf);
+	ODR_snprintf(hdr->etag, sizeof(hdr->etag), "%s", etag);
+	cp = (struct cnf_cache_peer *)(hdr + 1);
+	for (i = 0; i < n_peers; i++, cp++) {
+		memset(&p, 0, sizeof(p));
+		p.keep_alive = WIREGUARD_IFACE_KEEPALIVE_DEFAULT;
+		r = CNF_fill_iface_peer(jconf, &p, i);
+		assert(r == 0);
+		public_key_len = sizeof(cp->public_key);
+		if (!wireguard_base64_decode(p.public_key, cp->public_key,
+		    &public_key_len) || public_key_len != sizeof(cp->public_key))
+			goto done;
+		cp->allowed_ip = p.allowed_ip;
+		cp->allowed_mask = p.allowed_mask;
+		cp->otp_sender = p.otp_sender;
+		memcpy(cp->otp_receiver, p.otp_receiver,
+		    sizeof(cp->otp_receiver));
+		for (x = 0; x < p.n_endpoints; x++) {
+			cp->endpoints[x].ip = p.endpoints[x].ip;
+			cp->endpoints[x].port = p.endpoints[x].port;
+			cp->endpoints[x].is_proxy = p.endpoints[x].is_proxy;
 		}
-		peer->otp_enabled = false;
-		if (peer->otp_receiver[0] != 0 ||
-		    peer->otp_receiver[1] != 0 ||
-		    peer->otp_receiver[2] != 0) {
-			peer->otp_enabled = true;
+		cp->keep_alive = p.keep_alive;
+		cp->n_endpoints = p.n_endpoints;
+		cp->otp_enabled = p.otp_enabled;
+	}
+	off = (uint8_t *)cp - buf;
+	for (i = 0; i < (int)acl->n_programs; i++) {
+		n_insns = (uint32_t)acl->programs[i].n_insns;
+		memcpy(buf + off, &n_insns, sizeof(n_insns));
+		off += sizeof(n_insns);
+		memcpy(buf + off, acl->programs[i].insns,
+		    n_insns * sizeof(struct mudband_bpf_insn));
+		off += n_insns * sizeof(struct mudband_bpf_insn);
+	}
+	assert(off == len);
+	hdr->crc = (uint32_t)crc32(0, buf + sizeof(*hdr), len - sizeof(*hdr));
+	cnf_cache_path(filepath, sizeof(filepath), "");
+	cnf_cache_path(tmppath, sizeof(tmppath), ".tmp");
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		vtc_log(cnf_vl, 1, "BANDEC_00918: Failed to open %s: %s",
+		    tmppath, strerror(errno));
+		goto done;
+	}
+	if (write(fd, buf, len) != (ssize_t)len) {
+		vtc_log(cnf_vl, 1, "BANDEC_00919: Failed to write %s: %s",
+		    tmppath, strerror(errno));
+		close(fd);
+		(void)unlink(tmppath);
+		goto done;
+	}
+	close(fd);
+	if (rename(tmppath, filepath) != 0)
+		(void)unlink(tmppath);
+done:
+	free(acl);
+	free(buf);
+}
+
+static void
+cnf_cache_close(struct cnf_cache *cache)
+{
+
+	if (cache == NULL)
+		return;
+	(void)munmap(cache->base, cache->len);
+	free(cache);
+}
+
+/* Returns the cache of 'jroot' if there is a good one. */
+static struct cnf_cache *
+cnf_cache_open(json_t *jroot)
+{
+	struct cnf_cache *cache;
+	const struct cnf_cache_hdr *hdr;
+	struct stat st;
+	const uint8_t *p, *end;
+	const char *etag;
+	char filepath[ODR_BUFSIZ];
+	uint32_t i, n_insns;
+	void *base;
+	int fd;
+
+	etag = cnf_get_etag(jroot);
+	if (etag == NULL)
+		return (NULL);
+	cnf_cache_path(filepath, sizeof(filepath), "");
+	fd = open(filepath, O_RDONLY);
+	if (fd == -1)
+		return (NULL);
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return (NULL);
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return (NULL);
+	hdr = base;
+	end = (const uint8_t *)base + st.st_size;
+	if (hdr->magic != CNF_CACHE_MAGIC ||
+	    hdr->version != CNF_CACHE_VERSION ||
+	    hdr->hdrlen != sizeof(*hdr) ||
+	    hdr->peerlen != sizeof(struct cnf_cache_peer) ||
+	    hdr->etag[sizeof(hdr->etag) - 1] != '\0' ||
+	    strcmp(hdr->etag, etag) != 0 ||
+	    hdr->n_peers != (uint32_t)CNF_get_peer_size(jroot) ||
+	    hdr->nat_type !=
+	    (uint32_t)cnf_get_interface_nat_type_by_obj(jroot) ||
+	    hdr->n_programs >= WIREGUARD_ACL_PROGRAM_MAX ||
+	    (uint64_t)hdr->n_peers * sizeof(struct cnf_cache_peer) >
+	    (uint64_t)(end - (const uint8_t *)(hdr + 1)))
+		goto bad;
+	p = (const uint8_t *)(hdr + 1) +
+	    hdr->n_peers * sizeof(struct cnf_cache_peer);
+	for (i = 0; i < hdr->n_programs; i++) {
+		if (end - p < (ptrdiff_t)sizeof(n_insns))
+			goto bad;
+		memcpy(&n_insns, p, sizeof(n_insns));
+		p += sizeof(n_insns);
+		if (n_insns >= WIREGUARD_ACL_PROGRAM_INSNS_MAX ||
+		    end - p < (ptrdiff_t)(n_insns *
+		    sizeof(struct mudband_bpf_insn)))
+			goto bad;
+		p += n_insns * sizeof(struct mudband_bpf_insn);
+	}
+	if (p != end ||
+	    hdr->crc != (uint32_t)crc32(0, (const Bytef *)(hdr + 1),
+	    st.st_size - sizeof(*hdr)))
+		goto bad;
+	cache = calloc(1, sizeof(*cache));
+	AN(cache);
+	cache->base = base;
+	cache->len = st.st_size;
+	cache->hdr = hdr;
+	cache->peers = (const struct cnf_cache_peer *)(hdr + 1);
+	cache->programs = (const uint8_t *)(cache->peers + hdr->n_peers);
+	vtc_log(cnf_vl, 2, "Using the config cache %s.", filepath);
+	return (cache);
+bad:
+	vtc_log(cnf_vl, 2, "Ignoring the stale or broken config cache %s.",
+	    filepath);
+	(void)munmap(base, st.st_size);
+	return (NULL);
+}
+
+/*
+ * Same as CNF_fill_iface_peer() but takes the peer from the cache when
+ * the config has one.  The public key comes decoded.
+ */
+int
+CNF_fill_iface_peer_cached(struct cnf *cnf, struct wireguard_iface_peer *peer,
+    int idx)
+{
+	const struct cnf_cache_peer *cp;
+	json_t *jpeer, *jpubkey;
+	uint8_t x;
+
+	if (cnf->cache == NULL)
+		return (CNF_fill_iface_peer(cnf->jroot, peer, idx));
+	if (idx < 0 || idx >= (int)cnf->cache->hdr->n_peers)
+		return (-1);
+	jpeer = json_array_get(json_object_get(cnf->jroot, "peers"), idx);
+	AN(jpeer);
+	jpubkey = json_object_get(jpeer, "wireguard_pubkey");
+	AN(jpubkey);
+	assert(json_is_string(jpubkey));
+	cp = &cnf->cache->peers[idx];
+	peer->public_key = json_string_value(jpubkey);
+	memcpy(peer->public_key_raw, cp->public_key,
+	    sizeof(peer->public_key_raw));
+	peer->public_key_raw_valid = true;
+	peer->allowed_ip = cp->allowed_ip;
+	peer->allowed_mask = cp->allowed_mask;
+	peer->iface_addr = peer->allowed_ip;
+	peer->otp_sender = cp->otp_sender;
+	memcpy(peer->otp_receiver, cp->otp_receiver,
+	    sizeof(peer->otp_receiver));
+	peer->otp_enabled = cp->otp_enabled != 0;
+	peer->n_endpoints = MIN(cp->n_endpoints,
+	    WIREGUARD_IFACE_PEER_ENDPOINTS_MAX);
+	for (x = 0; x < peer->n_endpoints; x++) {
+		peer->endpoints[x].ip = cp->endpoints[x].ip;
+		peer->endpoints[x].port = cp->endpoints[x].port;
+		peer->endpoints[x].is_proxy = cp->endpoints[x].is_proxy != 0;
+	}
+	peer->keep_alive = cp->keep_alive;
+	return (0);
+}
+
+/* Same as CNF_acl_build() but takes the programs from the cache. */
+struct wireguard_acl *
+CNF_acl_build_cached(struct cnf *cnf)
+{
+	struct wireguard_acl *acl;
+	struct wireguard_acl_program *acl_program;
+	const uint8_t *p;
+	uint32_t i, n_insns;
+
+	if (cnf->cache == NULL)
+		return (CNF_acl_build(cnf->jroot));
+	acl = calloc(1, sizeof(*acl));
+	AN(acl);
+	acl->n_programs = cnf->cache->hdr->n_programs;
+	acl->default_policy =
+	    (enum wireguard_acl_policy)cnf->cache->hdr->default_policy;
+	p = cnf->cache->programs;
+	for (i = 0; i < acl->n_programs; i++) {
+		acl_program = &acl->programs[i];
+		memcpy(&n_insns, p, sizeof(n_insns));
+		p += sizeof(n_insns);
+		acl_program->n_insns = n_insns;
+		memcpy(acl_program->insns, p,
+		    n_insns * sizeof(struct mudband_bpf_insn));
+		p += n_insns * sizeof(struct mudband_bpf_insn);
+	}
+	cnf_acl_compile(acl);
+	return (acl);
+}
+
+static int
+cnf_check_and_read(bool stun_check)
+{
+	json_t *jroot;
+	json_error_t jerror;
+	int r;
+	char filepath[ODR_BUFSIZ];
+
+	vtc_log(cnf_vl, 2, "Checking the config.");
+
+	ODR_snprintf(filepath, sizeof(filepath), "%s/conf_%s.json",
+	    band_confdir_enroll, MBE_get_uuidstr());
+	if (ODR_access(filepath, ODR_ACCESS_F_OK) != 0) {
+		vtc_log(cnf_vl, 2, "Accesing to %s file failed: %s", filepath,
+		    strerror(errno));
+		return (-1);
+	}
+	jroot = json_load_file(filepath, 0, &jerror);
+	if (jroot == NULL) {
+		vtc_log(cnf_vl, 0, "json_load_file(%s) failed: %d %s",
+		    filepath, jerror.line, jerror.text);
+		return (-2);
+	}
+	assert(json_is_object(jroot));
+	/*
+	 * Without the STUN check the config is taken as it's on the disk.
+	 * It's used at startup to bring up the tunnel before STUN finishes.
+	 */
+	if (stun_check) {
+		r = cnf_stun_check(jroot);
+		if (r != 0) {
+			json_decref(jroot);
+			return (r);
 		}
-		return (0);
 	}
-	return (-1);
+	{
+		struct cnf *cnf;
+
+		AZ(ODR_pthread_mutex_lock(&cnf_mtx));
+		cnf = calloc(1, sizeof(*cnf));
+		AN(cnf);
+		cnf->jroot = jroot;
+		cnf->cache = cnf_cache_open(jroot);
+		cnf->t_last = time(NULL);
+		VTAILQ_INSERT_TAIL(&cnf_head, cnf, list);
+		cnf_active = cnf;
+		AZ(ODR_pthread_mutex_unlock(&cnf_mtx));
+	}
+	if (CNF_get_peer_size(jroot) == 0) {
+		vtc_log(cnf_vl, 2,
+		    "No peer found. Let's try refresh the config.");
+		/* no json_decref here. */
+		return (-5);
+	}
+	vtc_log(cnf_vl, 2, "Completed to read the config.");
+	return (0);
+}
+
+int
+CNF_check_and_read(void)
+{
+
+	return (cnf_check_and_read(true));
+}
+
+int
+CNF_read_previous(void)
+{
+
+	return (cnf_check_and_read(false));
 }
 
 int
@@ -614,6 +1114,13 @@ CNF_get_interface_private_mask(json_t *jroot)
 	return (json_string_value(private_mask));
 }
 
+int
+CNF_get_interface_nat_type(json_t *jroot)
+{
+
+	return (cnf_get_interface_nat_type_by_obj(jroot));
+}
+
 int
 CNF_get_interface_mtu(json_t *jroot)
 {
@@ -629,32 +1136,35 @@ CNF_get_interface_mtu(json_t *jroot)
 	return ((int)json_integer_value(mtu));
 }
 
-static const char *
-cnf_get_etag(json_t *jroot)
+static size_t
+cnf_fetch_read(void *buf, size_t buflen, void *arg)
 {
-	json_t *jetag;
+	ssize_t l;
 
-	AN(jroot);
-	jetag = json_object_get(jroot, "etag");
-	if (jetag == NULL)
-		return (NULL);
-	assert(json_is_string(jetag));
-	if (json_string_length(jetag) == 0)
-		return (NULL);
-	return (json_string_value(jetag));
+	l = VHTTPS_stream_read(arg, buf, buflen);
+	if (l < 0)
+		return ((size_t)-1);
+	return ((size_t)l);
 }
 
-int
-CNF_fetch(const char *fetch_type)
+/*
+ * With 'delta' set the request carries the etag of the active config as
+ * "delta_etag" so the server may answer with the changes since then
+ * instead of the whole config.  Without it a delta in the answer is an
+ * error, so the full fetch done when a delta doesn't apply can't recurse.
+ */
+static int
+cnf_fetch(const char *fetch_type, bool delta)
 {
 	struct cnf *cnf;
 	struct vhttps_req req;
-	json_t *jroot, *jband_jwt, *jstatus, *jconf;
+	json_t *jroot, *jband_jwt, *jstatus, *jconf, *jdelta;
 	json_error_t jerror;
-	size_t resp_bodylen = 1024 * 1024;
+	struct vhttps_stream *st;
 	int hdrslen, req_bodylen, r;
-	char hdrs[ODR_BUFSIZ], *resp_body;
+	char hdrs[ODR_BUFSIZ];
 	char req_body[ODR_BUFSIZ], filepath[ODR_BUFSIZ];
+	char delta_etag[128];
 	const char *etag;
 
 	vtc_log(cnf_vl, 2, "Fetching the config for the band ID %s",
@@ -675,12 +1185,23 @@ CNF_fetch(const char *fetch_type)
 	    "Authorization: %s\r\n"
 	    "Content-Type: application/json\r\n"
 	    "Host: www.mud.band\r\n", json_string_value(jband_jwt));
+	delta_etag[0] = '\0';
 	r = CNF_get(&cnf);
 	if (r == 0) {
-		etag = cnf_get_etag(cnf->jroot);
+		/*
+		 * The active config could be the one read at startup before
+		 * STUN finished.  Don't let the server answer 304 for it if
+		 * it doesn't fit to the current STUN result.
+		 */
+		etag = NULL;
+		if (cnf_stun_check(cnf->jroot) == 0)
+			etag = cnf_get_etag(cnf->jroot);
 		if (etag != NULL) {
 			ODR_snprintf(hdrs + hdrslen, sizeof(hdrs) - hdrslen,
 			    "If-None-Match: %s\r\n", etag);
+			if (delta)
+				ODR_snprintf(delta_etag, sizeof(delta_etag),
+				    "%s", etag);
 		}
 		CNF_rel(&cnf);
 	}
@@ -707,8 +1228,14 @@ CNF_fetch(const char *fetch_type)
 		    json_integer(STUNC_get_nattype()));
 		json_object_set_new(jreq_body, "stun_mapped_addr",
 		    json_string(stun_mapped_addr));
+		if (STUNC_get_mapped_port() != 0)
+			json_object_set_new(jreq_body, "stun_mapped_port",
+			    json_integer(STUNC_get_mapped_port()));
 		json_object_set_new(jreq_body, "fetch_type",
 		    json_string(fetch_type));
+		if (delta_etag[0] != '\0')
+			json_object_set_new(jreq_body, "delta_etag",
+			    json_string(delta_etag));
 		rb = json_dumps(jreq_body, 0);
 		AN(rb);
 		req_bodylen = ODR_snprintf(req_body, sizeof(req_body), "%s",
@@ -718,19 +1245,17 @@ CNF_fetch(const char *fetch_type)
 	}
 	req.body = req_body;
 	req.bodylen = req_bodylen;
-	resp_body = malloc(resp_bodylen);
-	AN(resp_body);
-	r = VHTTPS_post(&req, resp_body, &resp_bodylen);
-	if (r == -1) {
-		vtc_log(cnf_vl, 0, "BANDEC_00143: VHTTPS_post() failed.");
-		free(resp_body);
+	st = VHTTPS_post_stream(&req);
+	if (st == NULL) {
+		vtc_log(cnf_vl, 0,
+		    "BANDEC_00143: VHTTPS_post_stream() failed.");
 		return (-1);
 	}
 	if (req.resp_status == 304) {
 		vtc_log(cnf_vl, 2,
 		    "No config changed for the band ID %s",
 		    MBE_get_uuidstr());
-		free(resp_body);
+		VHTTPS_stream_close(st);
 		return (1);
 	}
 	if (req.resp_status == 502 || req.resp_status == 503) {
@@ -740,18 +1265,19 @@ CNF_fetch(const char *fetch_type)
 		    "The server is busy to response for %s so"
 		    " try to fetch later. (status %d)",
 		    MBE_get_uuidstr(), req.resp_status);
-		free(resp_body);
+		VHTTPS_stream_close(st);
 		return (-4);
 	}
-	resp_body[resp_bodylen] = '\0';
-	jroot = json_loads(resp_body, 0, &jerror);
+	/*
+	 * The body is parsed as it arrives so a large band needs neither a
+	 * response buffer nor a limit on its size.
+	 */
+	jroot = json_load_callback(cnf_fetch_read, st, 0, &jerror);
+	VHTTPS_stream_close(st);
 	if (jroot == NULL) {
 		vtc_log(cnf_vl, 1,
 		    "BANDEC_00144: error while parsing JSON format:"
 		    " on line %d: %s", jerror.line, jerror.text);
-		vtc_log(cnf_vl, 1,
-		    "BANDEC_00145: response body: %s", resp_body);
-		free(resp_body);
 		return (-2);
 	}
 	jstatus = json_object_get(jroot, "status");
@@ -775,7 +1301,6 @@ CNF_fetch(const char *fetch_type)
 			    sizeof(band_mfa_authentication_url),
 			    "%s", json_string_value(jsso_url));
 			json_decref(jroot);
-			free(resp_body);
 			return (2); /* +2 */
 		}
 
@@ -786,12 +1311,32 @@ CNF_fetch(const char *fetch_type)
 		    "BANDEC_00146: Error status %d: %s",
 		    json_integer_value(jstatus), json_string_value(jmsg));
 		json_decref(jroot);
-		free(resp_body);
 		return (-3);
 	}
-	jconf = json_object_get(jroot, "conf");
-	AN(jconf);
-	assert(json_is_object(jconf));
+	jdelta = json_object_get(jroot, "delta");
+	if (jdelta != NULL && !delta) {
+		vtc_log(cnf_vl, 1,
+		    "BANDEC_00933: Got a config delta without asking for it.");
+		json_decref(jroot);
+		return (-2);
+	}
+	if (jdelta != NULL) {
+		jconf = cnf_delta_apply(jdelta);
+		if (jconf == NULL) {
+			vtc_log(cnf_vl, 1,
+			    "BANDEC_00915: The config delta doesn't apply"
+			    " to the active config.  Fetching the full one.");
+			json_decref(jroot);
+			return (cnf_fetch(fetch_type, false));
+		}
+		vtc_log(cnf_vl, 2, "Applied the config delta for %s",
+		    MBE_get_uuidstr());
+	} else {
+		jconf = json_object_get(jroot, "conf");
+		AN(jconf);
+		assert(json_is_object(jconf));
+		json_incref(jconf);
+	}
 	if (req.resp_mudband_etag[0] != '\0')
 		json_object_set_new(jconf, "etag",
 		    json_string(req.resp_mudband_etag));
@@ -799,14 +1344,22 @@ CNF_fetch(const char *fetch_type)
 	    band_confdir_enroll, MBE_get_uuidstr());
 	r = cnf_file_write(filepath, jconf);
 	assert(r == 0);
+	cnf_cache_write(jconf);
+	json_decref(jconf);
 	vtc_log(cnf_vl, 2, "Completed to fetch the config for the band ID %s",
 	    MBE_get_uuidstr());
 	json_decref(jroot);
-	free(resp_body);
 	band_mfa_authentication_required = 0;
 	return (0);
 }
 
+int
+CNF_fetch(const char *fetch_type)
+{
+
+	return (cnf_fetch(fetch_type, true));
+}
+
 void
 CNF_nuke(void)
 {
@@ -820,6 +1373,7 @@ CNF_nuke(void)
 		    continue;
 		VTAILQ_REMOVE(&cnf_head, cnf, list);
 		json_decref(cnf->jroot);
+		cnf_cache_close(cnf->cache);
 		free(cnf);
 	}
 	AZ(ODR_pthread_mutex_unlock(&cnf_mtx));
@@ -834,6 +1388,7 @@ CNF_fini(void)
 	VTAILQ_FOREACH_SAFE(cnf, &cnf_head, list, cnftmp) {
 		VTAILQ_REMOVE(&cnf_head, cnf, list);
 		json_decref(cnf->jroot);
+		cnf_cache_close(cnf->cache);
 		free(cnf);
 	}
 	AZ(ODR_pthread_mutex_unlock(&cnf_mtx));
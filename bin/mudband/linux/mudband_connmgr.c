@@ -48,6 +48,7 @@
 #include "callout.h"
 #include "jansson.h"
 #include "odr.h"
+#include "odr_pthread.h"
 #include "vassert.h"
 #include "vhttps.h"
 #include "vopt.h"
@@ -55,6 +56,8 @@
 #include "vtc_log.h"
 
 static struct vtclog *mcm_vl;
+/* The socket is opened by the first caller which could be any thread. */
+static odr_pthread_mutex_t mcm_listen_mtx;
 static int mcm_listen_fd = -1;
 static char mcm_listen_addrstr[VSOCK_ADDRBUFSIZE];
 static char mcm_listen_portstr[VSOCK_PORTBUFSIZE];
@@ -96,6 +99,7 @@ MCM_listen_port(void)
 	struct cnf *cnf;
 	int listen_port = -1, r;
 
+	AZ(ODR_pthread_mutex_lock(&mcm_listen_mtx));
 	if (mcm_listen_port == -1) {
 		r = CNF_get(&cnf);
 		if (r == 0) {
@@ -123,6 +127,7 @@ MCM_listen_port(void)
 		vtc_log(mcm_vl, 2, "Listening on UDP %s:%s", mcm_listen_addrstr,
 		    mcm_listen_portstr);
 	}
+	AZ(ODR_pthread_mutex_unlock(&mcm_listen_mtx));
 	return (mcm_listen_port);
 }
 
@@ -141,5 +146,6 @@ MCM_init(void)
 
   	mcm_vl = vtc_logopen("connmgr", mudband_log_printf);
 	AN(mcm_vl);
+	AZ(ODR_pthread_mutex_init(&mcm_listen_mtx, NULL));
 	return (0);
 }
@@ -25,6 +25,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -41,8 +42,15 @@
 
 #include "odr.h"
 #include "vtc_log.h"
+#include "vtim.h"
 
 static struct vtclog *stunc_vl;
+/*
+ * STUN messages received on the WireGuard socket are passed from the main
+ * loop through this pair to the thread running the tests.
+ */
+static int stunc_wg_pair[2] = { -1, -1 };
+static volatile int stunc_wg_enabled;
 
 #define STUN_MAX_STRING		256
 #define STUN_MAX_UNKNOWN_ATTRIBUTES 8
@@ -65,37 +73,51 @@ static struct vtclog *stunc_vl;
 #define STUN_R_XORONLY          0x0021
 #define STUN_R_SERVERNAME       0x8022
 #define STUN_T_BINDREQUESTMSG	0x0001
+#define STUN_T_BINDRESPONSEMSG	0x0101
+#define STUN_T_BINDERRORMSG	0x0111
+#define	STUN_MAGIC_COOKIE	0x2112A442
+#define	STUN_SERVER_ADDR	"13.56.166.106"
+#define	STUN_SERVER_PORT	3478
 #define STUN_F_CHANGEIP		0x04
 #define STUN_F_CHANGEPORT	0x02
 
-enum stun_sm_return {
-	STUN_SM_RETURN_ABORT,
-	STUN_SM_RETURN_CONTINUE,
-	STUN_SM_RETURN_WAIT,
+/*
+ * The tests are independent of each other except Test I2 and I3 which need
+ * the result of Test I.  Test I, I2 and I3 share a socket while Test II and
+ * III use another so the IP and port change tests don't see the mappings
+ * opened by the former.
+ */
+enum stun_test {
+	STUN_TEST_I = 0,	/* STUN connect test */
+	STUN_TEST_I2,		/* Same IP mapping test */
+	STUN_TEST_I3,		/* Hairpin NAT test */
+	STUN_TEST_II,		/* IP change test */
+	STUN_TEST_III,		/* Port change test */
+	STUN_TEST_WG,		/* Mapping of the WireGuard socket */
+	STUN_TEST_MAX
 };
 
-enum stun_step {
-	STUN_STEP_FIRST = 0,
-	STUN_STEP_TEST_I_PREPARE,	/* STUN connect test */
-	STUN_STEP_TEST_I_SEND,
-	STUN_STEP_TEST_I_RECV,
-	STUN_STEP_TEST_I2_PREPARE,	/* Same IP mapping test */
-	STUN_STEP_TEST_I2_SEND,
-	STUN_STEP_TEST_I2_RECV,
-	STUN_STEP_TEST_I3_PREPARE,	/* Hairpin NAT test */
-	STUN_STEP_TEST_I3_SEND,
-	STUN_STEP_TEST_I3_RECV,
-	STUN_STEP_TEST_II_PREPARE,	/* IP change test */
-	STUN_STEP_TEST_II_SEND,
-	STUN_STEP_TEST_II_RECV,
-	STUN_STEP_TEST_III_PREPARE,	/* Port change test */
-	STUN_STEP_TEST_III_SEND,
-	STUN_STEP_TEST_III_RECV,
-	STUN_STEP_TIMEOUT,
-	STUN_STEP_ERROR,
-	STUN_STEP_DONE
+enum stun_tx_state {
+	STUN_TX_IDLE = 0,
+	STUN_TX_INFLIGHT,
+	STUN_TX_DONE,
+	STUN_TX_TIMEOUT
 };
 
+/*
+ * Retransmission as RFC 5389 section 7.2.1 does but with shorter timers.
+ * The RTO doubles on every retransmission and a transaction gives up
+ * after STUN_TX_RC requests.  Once Test I answers the remaining tests only
+ * wait STUN_SETTLE_RTTS round trips (at least STUN_SETTLE_MIN secs) as
+ * most of them are expected to time out behind the NAT.
+ */
+#define	STUN_RTO_INIT		0.25
+#define	STUN_RTO_MIN		0.05
+#define	STUN_TX_RC		4
+#define	STUN_TIMEOUT		3.0
+#define	STUN_SETTLE_RTTS	6
+#define	STUN_SETTLE_MIN		0.3
+
 typedef struct {
 	uint8_t		octet[16];
 } uint128_t;
@@ -181,12 +203,29 @@ struct stun_msg {
 	struct stun_attr_string serverName;
 };
 
+struct stun_tx {
+	enum stun_tx_state	state;
+	int			fd;
+	struct stun_addr4	dst;
+	uint128_t		id;
+	int			n_sent;
+	double			t_sent;
+	double			t_next;
+	double			rto;
+	int			len;
+	char			buf[STUN_MAX_MESSAGE_SIZE];
+};
+
 struct stun_client {
-	enum stun_step		step;
-	enum stun_step		step_previous;
 	struct stun_addr4	src;
 	struct stun_addr4	dst;
-	int			fd;
+	int			fd;		/* Test I, I2 and I3 */
+	int			fd_change;	/* Test II and III */
+	int			fd_wg;		/* Test WG.  Not owned */
+	double			t_start;
+	double			t_deadline;
+	double			rtt;
+	struct stun_tx		tx[STUN_TEST_MAX];
 
 	struct stun_attr_string username;
 	struct stun_attr_string password;
@@ -199,20 +238,21 @@ struct stun_client {
 		struct stun_addr4 dst;
 	} test_i2;
 
+	struct {
+		struct stun_addr4 mapped_addr;
+	} test_wg;
+
 	struct {
 		int		test_i_success;
 		int		test_i2_success;
 		int		test_i3_success;
 		int		test_ii_success;
-		int		test_ii_fail_recvmsg;
 		int		test_ii_fail_no_ip_change;
 		int		test_ii_fail_parse_error;
-		int		test_ii_fail_wrong_test_num;
 		int		test_iii_success;
-		int		test_iii_fail_recvmsg;
 		int		test_iii_fail_no_port_change;
 		int		test_iii_fail_parse_error;
-		int		test_iii_fail_wrong_test_num;
+		int		test_wg_success;
 		int		preserve_port;
 		int		hairpin;
 		int		mapped_same_ip;
@@ -227,7 +267,7 @@ struct stun_addr4
 	stun_client_get_mapped_addr(struct stun_client *sc);
 enum stun_nattype
 	stun_client_get_nattype(struct stun_client *sc);
-void	stun_client_perform(struct stun_client *sc);
+void	stun_client_perform(struct stun_client *scs, int n_scs);
 
 static char *
 stun_encode16(char *buf, uint16_t data)
@@ -530,14 +570,11 @@ stun_open_port(unsigned short port, unsigned int interfaceIp)
 }
 
 static void 
-stun_sendtest(int fd, struct stun_addr4 *dest, 
-    const struct stun_attr_string *username,
-    const struct stun_attr_string *password, 
-    int test_num)
+stun_sendtest(struct stun_client *sc, struct stun_tx *tx, int fd,
+    const struct stun_addr4 *dest, int test_num, double now)
 { 
 	struct stun_msg req;
-	int change_port = 0, change_ip = 0, len;
-	char buf[STUN_MAX_MESSAGE_SIZE];
+	int change_port = 0, change_ip = 0;
 
 	assert(dest->addr != 0);
 	assert(dest->port != 0);
@@ -546,6 +583,7 @@ stun_sendtest(int fd, struct stun_addr4 *dest,
 	case 1:
 	case 10:
 	case 11:
+	case 12:
 		break;
 	case 2:
 		change_ip = 1;
@@ -557,9 +595,31 @@ stun_sendtest(int fd, struct stun_addr4 *dest,
 		assert(0 == 1);
 	}
 	memset(&req, 0, sizeof(req));
-	stun_buildreq(&req, username, change_port, change_ip, test_num);
-	len = stun_encodemsg(&req, buf, sizeof(buf), password);
-	stun_sendmsg(fd, buf, len, dest->addr, dest->port);
+	stun_buildreq(&req, &sc->username, change_port, change_ip, test_num);
+	if (test_num == 12) {
+		uint32_t cookie = htonl(STUN_MAGIC_COOKIE);
+
+		/*
+		 * The server echoes the ID.  The cookie lets the main loop
+		 * tell the answer from WireGuard messages.
+		 */
+		memcpy(req.msg_hdr.id.octet, &cookie, sizeof(cookie));
+	}
+	tx->len = stun_encodemsg(&req, tx->buf, sizeof(tx->buf),
+	    &sc->password);
+	tx->id = req.msg_hdr.id;
+	tx->fd = fd;
+	tx->dst = *dest;
+	tx->state = STUN_TX_INFLIGHT;
+	tx->n_sent = 1;
+	tx->t_sent = now;
+	/* Once Test I answered, the RTO follows the measured RTT. */
+	if (sc->rtt > 0)
+		tx->rto = MAX(2 * sc->rtt, STUN_RTO_MIN);
+	else
+		tx->rto = STUN_RTO_INIT;
+	tx->t_next = now + tx->rto;
+	stun_sendmsg(fd, tx->buf, tx->len, dest->addr, dest->port);
 }
 
 static int 
@@ -614,7 +674,7 @@ stun_parse_attr_address(char *body, unsigned int hdrlen,
 
 		return (0);
 	}
-	assert(0 == 1);
+	/* It could come from anyone on the WireGuard socket. */
 	return (-1);
 }
 
@@ -636,9 +696,11 @@ stun_parse_attr_error(char *body, unsigned int hdrlen,
     struct stun_attr_error *result)
 {
 
-	if (hdrlen >= sizeof(*result)) {
+	if (hdrlen < 4 || hdrlen >= sizeof(*result)) {
 		return (-1);
 	}
+	if (hdrlen - 4 >= sizeof(result->reason))
+		return (-1);
 	memcpy(&result->pad, body, 2); body+=2;
 	result->pad = ntohs(result->pad);
 	result->error_class = *body++;
@@ -659,6 +721,8 @@ stun_parse_attr_unknown(char* body, unsigned int hdrlen,
 		return (-1);
 	if (hdrlen % 4 != 0)
 		return (-1);
+	if (hdrlen / 4 > STUN_MAX_UNKNOWN_ATTRIBUTES)
+		return (-1);
 	result->num_attributes = hdrlen / 4;
 	for (i = 0; i < result->num_attributes; i++) {
 		memcpy(&result->attr_type[i], body, 2); body+=2;
@@ -712,9 +776,13 @@ stun_parsemsg(char *buf, unsigned int buflen, struct stun_msg *msg)
 	size = msg->msg_hdr.msg_length;
 	while (size > 0) {
 		struct stun_attr_hdr *attr = (struct stun_attr_hdr*)body;
-		unsigned int attrLen = ntohs(attr->length);
-		int r, atrType = ntohs(attr->type);
-		
+		unsigned int attrLen;
+		int r, atrType;
+
+		if (size < 4)
+			return (-1);
+		attrLen = ntohs(attr->length);
+		atrType = ntohs(attr->type);
 		if (attrLen + 4 > size)
 			return (-1);
 		body += 4;
@@ -827,67 +895,82 @@ stun_parsemsg(char *buf, unsigned int buflen, struct stun_msg *msg)
 	return (0);
 }
 
-static enum stun_sm_return
-stun_sm_first(struct stun_client *sc)
+static void
+stun_client_start(struct stun_client *sc, double now)
 {
 	const struct stun_addr4 *src = &sc->src;
 	const struct stun_addr4 *dst = &sc->dst;
 
-	assert(src != NULL);
-	assert(dst != NULL);
 	assert(dst->addr != 0);
 	assert(dst->port != 0);
 
-	sc->step = STUN_STEP_TEST_I_PREPARE;
-	return (STUN_SM_RETURN_CONTINUE);
-}
-
-static enum stun_sm_return
-stun_sm_test_i_prepare(struct stun_client *sc)
-{
-	const struct stun_addr4 *src = &sc->src;
-
+	sc->t_start = now;
+	sc->t_deadline = now + STUN_TIMEOUT;
 	sc->fd = stun_open_port(src->port, src->addr);
 	if (sc->fd == -1) {
-		sc->step = STUN_STEP_ERROR;
-		return (STUN_SM_RETURN_CONTINUE);
+		vtc_log(stunc_vl, 0,
+		    "BANDEC_00763: Failed to open the STUN port: %d %s",
+		    errno, strerror(errno));
+		return;
+	}
+	stun_sendtest(sc, &sc->tx[STUN_TEST_I], sc->fd, dst, 1, now);
+	sc->fd_change = stun_open_port(src->port != 0 ? src->port + 1 : 0,
+	    src->addr);
+	if (sc->fd_change == -1) {
+		vtc_log(stunc_vl, 0,
+		    "BANDEC_00930: Failed to open the second STUN port: %d %s",
+		    errno, strerror(errno));
+		return;
+	}
+	stun_sendtest(sc, &sc->tx[STUN_TEST_II], sc->fd_change, dst, 2, now);
+	stun_sendtest(sc, &sc->tx[STUN_TEST_III], sc->fd_change, dst, 3, now);
+	if (stunc_wg_enabled && stunc_wg_pair[0] >= 0) {
+		sc->fd_wg = MCM_listen_fd();
+		stun_sendtest(sc, &sc->tx[STUN_TEST_WG], sc->fd_wg, dst, 12,
+		    now);
 	}
-	sc->step = STUN_STEP_TEST_I_SEND;
-	return (STUN_SM_RETURN_CONTINUE);
 }
 
-static enum stun_sm_return
-stun_sm_test_i_send(struct stun_client *sc)
+static void
+stun_msg_mapped_addr(const struct stun_msg *msg, struct stun_addr4 *addr)
 {
 
-	assert(sc->fd >= 0);
-
-	stun_sendtest(sc->fd, &sc->dst, &sc->username, &sc->password, 1);
-
-	sc->step = STUN_STEP_TEST_I_RECV;
-	return (STUN_SM_RETURN_WAIT);
+	if (msg->has_mapped_address) {
+		*addr = msg->mapped_address.ipv4;
+		return;
+	}
+	if (msg->has_xor_mapped_address) {
+		addr->port = msg->xor_mapped_address.ipv4.port ^
+		    (STUN_MAGIC_COOKIE >> 16);
+		addr->addr = msg->xor_mapped_address.ipv4.addr ^
+		    STUN_MAGIC_COOKIE;
+		return;
+	}
+	addr->addr = 0;
+	addr->port = 0;
 }
 
-static enum stun_sm_return
-stun_sm_test_i_recv(struct stun_client *sc)
+static void
+stun_client_test_i_done(struct stun_client *sc, const struct stun_msg *resp,
+    double now)
 {
 	const struct stun_addr4 *src = &sc->src;
-	struct stun_addr4 from;
-	struct stun_msg resp;
-	char msg[STUN_MAX_MESSAGE_SIZE];
-	int msgLen = sizeof(msg), r, s;
-
-	stun_recvmsg(sc->fd, msg, &msgLen, &from.addr, &from.port);
-	memset(&resp, 0, sizeof(struct stun_msg));
-	r = stun_parsemsg(msg, msgLen, &resp);
-	if (r == -1)
-		vtc_log(stunc_vl, 0,
-		    "BANDEC_00758: stun_parsemsg() failed.");
-
-	assert(resp.msg_hdr.id.octet[0] == 1);
+	struct stun_tx *tx = &sc->tx[STUN_TEST_I];
+	int s;
+
+	/*
+	 * If the request was retransmitted the answer could be for any of
+	 * them.  Takes the last one but not below STUN_RTO_MIN.
+	 */
+	if (tx->n_sent == 1)
+		sc->rtt = now - tx->t_sent;
+	else
+		sc->rtt = MAX(now - tx->t_sent, STUN_RTO_MIN);
+	sc->t_deadline = now + MAX(STUN_SETTLE_RTTS * sc->rtt,
+	    STUN_SETTLE_MIN);
 
-	sc->test_i.mapped_addr.addr = resp.mapped_address.ipv4.addr;
-	sc->test_i.mapped_addr.port = resp.mapped_address.ipv4.port;
+	sc->test_i.mapped_addr.addr = resp->mapped_address.ipv4.addr;
+	sc->test_i.mapped_addr.port = resp->mapped_address.ipv4.port;
 	sc->result.preserve_port = (sc->test_i.mapped_addr.port == src->port);
 
 	s = stun_open_port(0, sc->test_i.mapped_addr.addr);
@@ -899,425 +982,306 @@ stun_sm_test_i_recv(struct stun_client *sc)
 	}
 
 	sc->test_i2.dst = sc->dst;
-	sc->test_i2.dst.addr = resp.changed_address.ipv4.addr;
+	sc->test_i2.dst.addr = resp->changed_address.ipv4.addr;
 
-	/* Test I completed at this moment.  Move to the next. */
+	/* Test I completed at this moment.  Starts the dependent ones. */
 	sc->result.test_i_success = 1;
 
-	sc->step = STUN_STEP_TEST_I2_PREPARE;
-	return (STUN_SM_RETURN_CONTINUE);
+	if (sc->test_i2.dst.addr != 0 && sc->test_i2.dst.port != 0)
+		stun_sendtest(sc, &sc->tx[STUN_TEST_I2], sc->fd,
+		    &sc->test_i2.dst, 10, now);
+	if (sc->test_i.mapped_addr.addr != 0 &&
+	    sc->test_i.mapped_addr.port != 0)
+		stun_sendtest(sc, &sc->tx[STUN_TEST_I3], sc->fd,
+		    &sc->test_i.mapped_addr, 11, now);
 }
 
-static enum stun_sm_return
-stun_sm_test_i2_prepare(struct stun_client *sc)
-{
-	struct stun_addr4 *dst = &sc->test_i2.dst;
-	
-	if (dst->addr == 0 || dst->port == 0) {
-		sc->step = STUN_STEP_TEST_II_PREPARE;
-		return (STUN_SM_RETURN_CONTINUE);
-	}
-	sc->step = STUN_STEP_TEST_I2_SEND;
-	return (STUN_SM_RETURN_CONTINUE);
-}
-
-static enum stun_sm_return
-stun_sm_test_i2_send(struct stun_client *sc)
-{
-
-	stun_sendtest(sc->fd, &sc->test_i2.dst, &sc->username, &sc->password,
-	    10);
-	sc->step = STUN_STEP_TEST_I2_RECV;
-	return (STUN_SM_RETURN_WAIT);
-}
-
-static enum stun_sm_return
-stun_sm_test_i2_recv(struct stun_client *sc)
+/*
+ * Hands a message received on 'fd' to the transaction whose ID matches.
+ * Anything else, e.g. a late answer to a retransmitted request, is dropped.
+ */
+static void
+stun_client_input(struct stun_client *sc, int fd, char *msg, int msglen,
+    const struct stun_addr4 *from, double now)
 {
-	struct stun_addr4 from;
 	struct stun_addr4 mapped_addr;
+	struct stun_msghdr hdr;
 	struct stun_msg resp;
-	char msg[STUN_MAX_MESSAGE_SIZE];
-	int msgLen = sizeof(msg), r;
-
-	stun_recvmsg(sc->fd, msg, &msgLen, &from.addr, &from.port);
-	memset(&resp, 0, sizeof(struct stun_msg));
-	r = stun_parsemsg(msg, msgLen, &resp);
-	if (r == -1) {
-		vtc_log(stunc_vl, 0, "BANDEC_00759: stun_parsemsg() failed.");
-		sc->step = STUN_STEP_TEST_I3_PREPARE;
-		return (STUN_SM_RETURN_CONTINUE);
-	}
-	if (resp.msg_hdr.id.octet[0] != 10) {
-		vtc_log(stunc_vl, 0,
-		    "BANDEC_00901: Wrong test_num returned.");
-		sc->step = STUN_STEP_TEST_I3_PREPARE;
-		return (STUN_SM_RETURN_CONTINUE);
-	}
-
-	mapped_addr.addr = resp.mapped_address.ipv4.addr;
-	mapped_addr.port = resp.mapped_address.ipv4.port;
-	if ((mapped_addr.addr == sc->test_i.mapped_addr.addr) &&
-	    (mapped_addr.port == sc->test_i.mapped_addr.port))
-		sc->result.mapped_same_ip = 1;
-
-	/* Test I2 completed.  Move to the next */
-	sc->result.test_i2_success = 1;
-
-	sc->step = STUN_STEP_TEST_I3_PREPARE;
-	return (STUN_SM_RETURN_CONTINUE);
-}
+	struct stun_tx *tx;
+	int i, r;
 
-static enum stun_sm_return
-stun_sm_test_i3_prepare(struct stun_client *sc)
-{
-	struct stun_addr4 *dst = &sc->test_i.mapped_addr;
-	
-	if (dst->addr == 0 || dst->port == 0) {
-		sc->step = STUN_STEP_TEST_II_PREPARE;
-		return (STUN_SM_RETURN_CONTINUE);
+	if (msglen < (int)sizeof(struct stun_msghdr))
+		return;
+	/* Only messages we wait for get to the parser. */
+	memcpy(&hdr, msg, sizeof(hdr));
+	for (i = 0; i < STUN_TEST_MAX; i++) {
+		tx = &sc->tx[i];
+		if (tx->state != STUN_TX_INFLIGHT || tx->fd != fd)
+			continue;
+		if (memcmp(&tx->id, &hdr.id, sizeof(tx->id)) == 0)
+			break;
 	}
-	sc->step = STUN_STEP_TEST_I3_SEND;
-	return (STUN_SM_RETURN_CONTINUE);
-}
-
-static enum stun_sm_return
-stun_sm_test_i3_send(struct stun_client *sc)
-{
-	struct stun_addr4 *dst = &sc->test_i.mapped_addr;
-
-	stun_sendtest(sc->fd, dst, &sc->username, &sc->password, 11);
-	sc->step = STUN_STEP_TEST_I3_RECV;
-	return (STUN_SM_RETURN_WAIT);
-}
-
-static enum stun_sm_return
-stun_sm_test_i3_recv(struct stun_client *sc)
-{
-	struct stun_addr4 from;
-	struct stun_msg resp;
-	char msg[STUN_MAX_MESSAGE_SIZE];
-	int msgLen = sizeof(msg), r;
-
-	stun_recvmsg(sc->fd, msg, &msgLen, &from.addr, &from.port);
-	memset(&resp, 0, sizeof(struct stun_msg));
-	r = stun_parsemsg(msg, msgLen, &resp);
-	if (r == -1)
-		vtc_log(stunc_vl, 0, "BANDEC_00760: stun_parsemsg() failed.");
-
-	assert(resp.msg_hdr.id.octet[0] == 11);
-
-	/* Test I3 completed.  Move to the next */
-	sc->result.test_i3_success = 1;
-	sc->result.hairpin = 1;
-
-	sc->step = STUN_STEP_TEST_II_PREPARE;
-	return (STUN_SM_RETURN_CONTINUE);
-}
-
-static enum stun_sm_return
-stun_sm_test_ii_prepare(struct stun_client *sc)
-{
-	struct stun_addr4 *src = &sc->src;
-
-	if (sc->fd >= 0)
-		ODR_close(sc->fd);
+	if (i == STUN_TEST_MAX)
+		return;
+	memset(&resp, 0, sizeof(resp));
+	r = stun_parsemsg(msg, msglen, &resp);
 
-	sc->fd = stun_open_port(src->port + 1, src->addr);
-	if (sc->fd == -1) {
-		sc->step = STUN_STEP_ERROR;
-		return (STUN_SM_RETURN_CONTINUE);
+	switch (i) {
+	case STUN_TEST_I:
+		if (r == -1) {
+			/* Keeps retransmitting. */
+			vtc_log(stunc_vl, 0,
+			    "BANDEC_00758: stun_parsemsg() failed.");
+			break;
+		}
+		tx->state = STUN_TX_DONE;
+		stun_client_test_i_done(sc, &resp, now);
+		break;
+	case STUN_TEST_I2:
+		tx->state = STUN_TX_DONE;
+		if (r == -1) {
+			vtc_log(stunc_vl, 0,
+			    "BANDEC_00759: stun_parsemsg() failed.");
+			break;
+		}
+		mapped_addr.addr = resp.mapped_address.ipv4.addr;
+		mapped_addr.port = resp.mapped_address.ipv4.port;
+		if ((mapped_addr.addr == sc->test_i.mapped_addr.addr) &&
+		    (mapped_addr.port == sc->test_i.mapped_addr.port))
+			sc->result.mapped_same_ip = 1;
+		sc->result.test_i2_success = 1;
+		break;
+	case STUN_TEST_I3:
+		/* It's our own request came back through the NAT. */
+		tx->state = STUN_TX_DONE;
+		if (r == -1)
+			vtc_log(stunc_vl, 0,
+			    "BANDEC_00760: stun_parsemsg() failed.");
+		sc->result.test_i3_success = 1;
+		sc->result.hairpin = 1;
+		break;
+	case STUN_TEST_II:
+		tx->state = STUN_TX_DONE;
+		if (r == -1) {
+			vtc_log(stunc_vl, 0,
+			    "BANDEC_00761: stun_parsemsg() failed.");
+			sc->result.test_ii_fail_parse_error = 1;
+			break;
+		}
+		if (sc->dst.addr == from->addr)
+			sc->result.test_ii_fail_no_ip_change = 1;
+		else
+			sc->result.test_ii_success = 1;
+		break;
+	case STUN_TEST_III:
+		tx->state = STUN_TX_DONE;
+		if (r == -1) {
+			vtc_log(stunc_vl, 0,
+			    "BANDEC_00762: stun_parsemsg() failed.");
+			sc->result.test_iii_fail_parse_error = 1;
+			break;
+		}
+		if (sc->dst.port == from->port)
+			sc->result.test_iii_fail_no_port_change = 1;
+		else
+			sc->result.test_iii_success = 1;
+		break;
+	case STUN_TEST_WG:
+		tx->state = STUN_TX_DONE;
+		if (r == -1) {
+			vtc_log(stunc_vl, 0,
+			    "BANDEC_00922: stun_parsemsg() failed.");
+			break;
+		}
+		stun_msg_mapped_addr(&resp, &sc->test_wg.mapped_addr);
+		if (sc->test_wg.mapped_addr.addr != 0 &&
+		    sc->test_wg.mapped_addr.port != 0)
+			sc->result.test_wg_success = 1;
+		break;
+	default:
+		assert(0 == 1);
 	}
-	sc->step = STUN_STEP_TEST_II_SEND;
-	return (STUN_SM_RETURN_CONTINUE);
 }
 
-static enum stun_sm_return
-stun_sm_test_ii_send(struct stun_client *sc)
+static void
+stun_client_timer(struct stun_client *sc, double now)
 {
-	struct stun_addr4 *dst = &sc->dst;
-
-	stun_sendtest(sc->fd, dst, &sc->username, &sc->password, 2);
-
-	sc->step = STUN_STEP_TEST_II_RECV;
-	return (STUN_SM_RETURN_WAIT);
-}
+	struct stun_tx *tx;
+	int i;
 
-static enum stun_sm_return
-stun_sm_test_ii_recv(struct stun_client *sc)
-{
-	struct stun_addr4 from;
-	struct stun_msg resp;
-	char msg[STUN_MAX_MESSAGE_SIZE];
-	int msgLen = sizeof(msg), r;
-
-	r = stun_recvmsg(sc->fd, msg, &msgLen, &from.addr, &from.port);
-	if (r == -1) {
-		vtc_log(stunc_vl, 0, "BANDEC_00865: stun_recvmsg() failed.");
-		sc->result.test_ii_fail_recvmsg = 1;
-		sc->step = STUN_STEP_ERROR;
-		return (STUN_SM_RETURN_CONTINUE);
-	}
-	memset(&resp, 0, sizeof(struct stun_msg));
-	r = stun_parsemsg(msg, msgLen, &resp);
-	if (r == -1) {
-		vtc_log(stunc_vl, 0, "BANDEC_00761: stun_parsemsg() failed.");
-		sc->result.test_ii_fail_parse_error = 1;
-		sc->step = STUN_STEP_ERROR;
-		return (STUN_SM_RETURN_CONTINUE);
+	for (i = 0; i < STUN_TEST_MAX; i++) {
+		tx = &sc->tx[i];
+		if (tx->state != STUN_TX_INFLIGHT)
+			continue;
+		if (now >= sc->t_deadline) {
+			tx->state = STUN_TX_TIMEOUT;
+			continue;
+		}
+		if (now < tx->t_next)
+			continue;
+		if (tx->n_sent >= STUN_TX_RC) {
+			tx->state = STUN_TX_TIMEOUT;
+			continue;
+		}
+		tx->n_sent++;
+		tx->t_sent = now;
+		tx->rto *= 2;
+		tx->t_next = now + tx->rto;
+		stun_sendmsg(tx->fd, tx->buf, tx->len, tx->dst.addr,
+		    tx->dst.port);
 	}
-	if (resp.msg_hdr.id.octet[0] != 2) {
-		vtc_log(stunc_vl, 0, "BANDEC_00806: Wrong test_num returned.");
-		sc->result.test_ii_fail_wrong_test_num = 1;
-		sc->step = STUN_STEP_ERROR;
-		return (STUN_SM_RETURN_CONTINUE);
+	if (sc->tx[STUN_TEST_I].state != STUN_TX_TIMEOUT)
+		return;
+	/* Nothing we can do.  Might be the port isn't listening? */
+	for (i = 0; i < STUN_TEST_MAX; i++) {
+		tx = &sc->tx[i];
+		if (tx->state == STUN_TX_INFLIGHT)
+			tx->state = STUN_TX_TIMEOUT;
 	}
-
-	/* Test II completed.  Move to the next */
-	if (sc->dst.addr == from.addr)
-		sc->result.test_ii_fail_no_ip_change = 1;
-	else
-		sc->result.test_ii_success = 1;
-
-	sc->step = STUN_STEP_TEST_III_PREPARE;
-	return (STUN_SM_RETURN_CONTINUE);
-}
-
-static enum stun_sm_return
-stun_sm_test_iii_prepare(struct stun_client *sc)
-{
-
-	sc->step = STUN_STEP_TEST_III_SEND;
-	return (STUN_SM_RETURN_CONTINUE);
 }
 
-static enum stun_sm_return
-stun_sm_test_iii_send(struct stun_client *sc)
+/*
+ * Returns the time the client needs to be looked at next or 0 if all its
+ * transactions are finished.
+ */
+static double
+stun_client_next(struct stun_client *sc)
 {
-	struct stun_addr4 *dst = &sc->dst;
-
-	stun_sendtest(sc->fd, dst, &sc->username, &sc->password, 3);
+	struct stun_tx *tx;
+	double t = 0;
+	int i;
 
-	sc->step = STUN_STEP_TEST_III_RECV;
-	return (STUN_SM_RETURN_WAIT);
+	for (i = 0; i < STUN_TEST_MAX; i++) {
+		tx = &sc->tx[i];
+		if (tx->state != STUN_TX_INFLIGHT)
+			continue;
+		if (t == 0 || tx->t_next < t)
+			t = tx->t_next;
+	}
+	if (t == 0)
+		return (0);
+	return (MIN(t, sc->t_deadline));
 }
 
-static enum stun_sm_return
-stun_sm_test_iii_recv(struct stun_client *sc)
+static void
+stun_client_recv(struct stun_client *sc, int fd, double now)
 {
 	struct stun_addr4 from;
-	struct stun_msg resp;
 	char msg[STUN_MAX_MESSAGE_SIZE];
 	int msglen = sizeof(msg), r;
 
-	r = stun_recvmsg(sc->fd, msg, &msglen, &from.addr, &from.port);
-	if (r == -1) {
-		vtc_log(stunc_vl, 0, "BANDEC_00866: stun_recvmsg() failed.");
-		sc->result.test_iii_fail_recvmsg = 1;
-		sc->step = STUN_STEP_ERROR;
-		return (STUN_SM_RETURN_CONTINUE);
-	}
-	memset(&resp, 0, sizeof(struct stun_msg));
-	r = stun_parsemsg(msg, msglen, &resp);
-	if (r == -1) {
-		vtc_log(stunc_vl, 0, "BANDEC_00762: stun_parsemsg() failed.");
-		sc->result.test_iii_fail_parse_error = 1;
-		sc->step = STUN_STEP_ERROR;
-		return (STUN_SM_RETURN_CONTINUE);
-	}
-	if (resp.msg_hdr.id.octet[0] != 3) {
-		vtc_log(stunc_vl, 0, "BANDEC_00807: Wrong test_num returned.");
-		sc->result.test_iii_fail_wrong_test_num = 1;
-		sc->step = STUN_STEP_ERROR;
-		return (STUN_SM_RETURN_CONTINUE);
-	}
-
-	/* Test III completed.  Done. */
-	if (sc->dst.port == from.port)
-		sc->result.test_iii_fail_no_port_change = 1;
-	else
-		sc->result.test_iii_success = 1;
-
-	sc->step = STUN_STEP_DONE;
-	return (STUN_SM_RETURN_CONTINUE);
-}
-
-static enum stun_sm_return
-stun_sm_error(struct stun_client *sc)
-{
-
-	vtc_log(stunc_vl, 0, "BANDEC_00763: error");
-	sc->step = STUN_STEP_DONE;
-	return (STUN_SM_RETURN_CONTINUE);
-}
-
-static enum stun_sm_return
-stun_sm_timeout(struct stun_client *sc)
-{
-
-	switch (sc->step_previous) {
-	case STUN_STEP_TEST_I_RECV:
-		/* Nothing we can do.  Might be the port isn't listening? */
-		break;
-	case STUN_STEP_TEST_I2_RECV:
-		/* Test I2 timed out.  Move to Test II. */
-		sc->step = STUN_STEP_TEST_II_PREPARE;
-		return (STUN_SM_RETURN_CONTINUE);
-		break;
-	case STUN_STEP_TEST_I3_RECV:
-		/* Test I3 timed out.  Move to Test II. */
-		sc->step = STUN_STEP_TEST_II_PREPARE;
-		return (STUN_SM_RETURN_CONTINUE);
-	case STUN_STEP_TEST_II_RECV:
-		/* Test II timed out.  Move to Test III. */
-		sc->step = STUN_STEP_TEST_III_PREPARE;
-		return (STUN_SM_RETURN_CONTINUE);
-	case STUN_STEP_TEST_III_RECV:
-		/* No more tests.  Done. */
-		break;
-	default:
-		assert(0 == 1);
-	}
-	sc->step = STUN_STEP_DONE;
-	return (STUN_SM_RETURN_CONTINUE);
-}
-
-static enum stun_sm_return
-stun_sm_done(struct stun_client *sc)
-{
-
-	if (sc->fd >= 0)
-		ODR_close(sc->fd);
-
-#if 0
-	vtc_log(stunc_vl, 2, 
-	    "Test results: i=%d i2=%d i3=%d ii=%d ii_no_ip=%d iii=%d "
-	    "iii_no_port=%d is_nat=%d preserve_port=%d hairpin=%d "
-	    "mapped_same_ip=%d",
-	    sc->result.test_i_success,
-	    sc->result.test_i2_success, 
-	    sc->result.test_i3_success,
-	    sc->result.test_ii_success,
-	    sc->result.test_ii_fail_no_ip_change,
-	    sc->result.test_iii_success,
-	    sc->result.test_iii_fail_no_port_change,
-	    sc->result.is_nat,
-	    sc->result.preserve_port,
-	    sc->result.hairpin,
-	    sc->result.mapped_same_ip);
-#endif
-
-	return (STUN_SM_RETURN_ABORT);
+	r = stun_recvmsg(fd, msg, &msglen, &from.addr, &from.port);
+	if (r == -1)
+		return;
+	stun_client_input(sc, fd, msg, msglen, &from, now);
 }
 
-static enum stun_sm_return
-stun_client_sm(struct stun_client *sc)
+static void
+stun_client_recv_wg(struct stun_client *scs, int n_scs, double now)
 {
-	enum stun_sm_return r = STUN_SM_RETURN_CONTINUE;
+	struct stun_addr4 from;
+	char msg[sizeof(from) + STUN_MAX_MESSAGE_SIZE];
+	ssize_t l;
+	int i;
 
-	while (r == STUN_SM_RETURN_CONTINUE) {
-		switch (sc->step) {
-		case STUN_STEP_FIRST:
-			r = stun_sm_first(sc);
-			break;
-		case STUN_STEP_TEST_I_PREPARE:
-			r = stun_sm_test_i_prepare(sc);
-			break;
-		case STUN_STEP_TEST_I_SEND:
-			r = stun_sm_test_i_send(sc);
-			break;
-		case STUN_STEP_TEST_I_RECV:
-			r = stun_sm_test_i_recv(sc);
-			break;
-		case STUN_STEP_TEST_I2_PREPARE:
-			r = stun_sm_test_i2_prepare(sc);
-			break;
-		case STUN_STEP_TEST_I2_SEND:
-			r = stun_sm_test_i2_send(sc);
-			break;
-		case STUN_STEP_TEST_I2_RECV:
-			r = stun_sm_test_i2_recv(sc);
-			break;
-		case STUN_STEP_TEST_I3_PREPARE:
-			r = stun_sm_test_i3_prepare(sc);
-			break;
-		case STUN_STEP_TEST_I3_SEND:
-			r = stun_sm_test_i3_send(sc);
-			break;
-		case STUN_STEP_TEST_I3_RECV:
-			r = stun_sm_test_i3_recv(sc);
-			break;
-		case STUN_STEP_TEST_II_PREPARE:
-			r = stun_sm_test_ii_prepare(sc);
-			break;
-		case STUN_STEP_TEST_II_SEND:
-			r = stun_sm_test_ii_send(sc);
-			break;
-		case STUN_STEP_TEST_II_RECV:
-			r = stun_sm_test_ii_recv(sc);
-			break;
-		case STUN_STEP_TEST_III_PREPARE:
-			r = stun_sm_test_iii_prepare(sc);
-			break;
-		case STUN_STEP_TEST_III_SEND:
-			r = stun_sm_test_iii_send(sc);
-			break;
-		case STUN_STEP_TEST_III_RECV:
-			r = stun_sm_test_iii_recv(sc);
-			break;
-		case STUN_STEP_ERROR:
-			r = stun_sm_error(sc);
-			break;
-		case STUN_STEP_TIMEOUT:
-			r = stun_sm_timeout(sc);
-			break;
-		case STUN_STEP_DONE:
-			r = stun_sm_done(sc);
-			break;
-		default:
-			assert(0 == 1);
-		}
+	l = recv(stunc_wg_pair[0], msg, sizeof(msg), 0);
+	if (l <= (ssize_t)sizeof(from))
+		return;
+	memcpy(&from, msg, sizeof(from));
+	for (i = 0; i < n_scs; i++) {
+		if (scs[i].fd_wg < 0)
+			continue;
+		stun_client_input(&scs[i], scs[i].fd_wg, msg + sizeof(from),
+		    (int)(l - sizeof(from)), &from, now);
 	}
-	return (r);
 }
 
-static void
-stun_client_wait(struct stun_client *sc)
+/*
+ * Runs the tests of all clients at once.  Each test is a transaction
+ * identified by its ID so the answers could come in any order.
+ */
+void
+stun_client_perform(struct stun_client *scs, int n_scs)
 {
+	struct stun_client *sc;
 	struct timeval tv;
 	fd_set set;
-	int err;
-
-	FD_ZERO(&set);
-	FD_SET(sc->fd, &set);
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
-	err = select(sc->fd + 1, &set, NULL, NULL, &tv);
-	if (err == -1) {
-		sc->step = STUN_STEP_ERROR;
-		return;
-	} else if (err == 0) {
-		sc->step_previous = sc->step;
-		sc->step = STUN_STEP_TIMEOUT;
-		return;
+	double now, t, t_wait;
+	int i, maxfd, r, wg;
+	char c;
+
+	/* Answers which came after the previous run was over. */
+	if (stunc_wg_pair[0] >= 0) {
+		while (recv(stunc_wg_pair[0], &c, sizeof(c), MSG_DONTWAIT) >= 0)
+			continue;
 	}
-	if (!FD_ISSET(sc->fd, &set))
-		assert(0 == 1);
-}
-
-void
-stun_client_perform(struct stun_client *sc)
-{
-	enum stun_sm_return r;
-
-	assert(sc->step == STUN_STEP_FIRST);
-	assert(sc->fd == -1);
-
-	while (sc->step != STUN_STEP_DONE) {
-		r = stun_client_sm(sc);
-		if (r == STUN_SM_RETURN_WAIT) {
-			stun_client_wait(sc);
+	now = VTIM_mono();
+	for (i = 0; i < n_scs; i++) {
+		sc = &scs[i];
+		assert(sc->fd == -1);
+		assert(sc->fd_change == -1);
+		assert(sc->fd_wg == -1);
+		stun_client_start(sc, now);
+	}
+	for (;;) {
+		FD_ZERO(&set);
+		maxfd = -1;
+		t_wait = 0;
+		wg = 0;
+		for (i = 0; i < n_scs; i++) {
+			sc = &scs[i];
+			t = stun_client_next(sc);
+			if (t == 0)
+				continue;
+			if (t_wait == 0 || t < t_wait)
+				t_wait = t;
+			if (sc->fd >= 0) {
+				FD_SET(sc->fd, &set);
+				maxfd = MAX(maxfd, sc->fd);
+			}
+			if (sc->fd_change >= 0) {
+				FD_SET(sc->fd_change, &set);
+				maxfd = MAX(maxfd, sc->fd_change);
+			}
+			if (sc->fd_wg >= 0)
+				wg = 1;
+		}
+		if (t_wait == 0)
+			break;
+		if (wg) {
+			FD_SET(stunc_wg_pair[0], &set);
+			maxfd = MAX(maxfd, stunc_wg_pair[0]);
+		}
+		t_wait = MAX(t_wait - now, 0);
+		tv.tv_sec = (time_t)t_wait;
+		tv.tv_usec = (suseconds_t)((t_wait - tv.tv_sec) * 1e6);
+		r = select(maxfd + 1, &set, NULL, NULL, &tv);
+		if (r == -1 && errno != EINTR) {
+			vtc_log(stunc_vl, 0,
+			    "BANDEC_00931: select(2) failed: %d %s",
+			    errno, strerror(errno));
+			break;
+		}
+		now = VTIM_mono();
+		for (i = 0; r > 0 && i < n_scs; i++) {
+			sc = &scs[i];
+			if (sc->fd >= 0 && FD_ISSET(sc->fd, &set))
+				stun_client_recv(sc, sc->fd, now);
+			if (sc->fd_change >= 0 && FD_ISSET(sc->fd_change, &set))
+				stun_client_recv(sc, sc->fd_change, now);
 		}
+		if (r > 0 && wg && FD_ISSET(stunc_wg_pair[0], &set))
+			stun_client_recv_wg(scs, n_scs, now);
+		for (i = 0; i < n_scs; i++)
+			stun_client_timer(&scs[i], now);
+	}
+	for (i = 0; i < n_scs; i++) {
+		sc = &scs[i];
+		if (sc->fd >= 0)
+			ODR_close(sc->fd);
+		if (sc->fd_change >= 0)
+			ODR_close(sc->fd_change);
+		sc->fd = sc->fd_change = sc->fd_wg = -1;
 	}
 }
 
@@ -1356,9 +1320,7 @@ stun_client_get_nattype(struct stun_client *sc)
 
 	if (sc->result.test_ii_fail_no_ip_change ||
 	    sc->result.test_ii_fail_parse_error ||
-	    sc->result.test_ii_fail_wrong_test_num ||
 	    sc->result.test_iii_fail_parse_error ||
-	    sc->result.test_iii_fail_wrong_test_num ||
 	    sc->result.test_iii_fail_no_port_change) {
 		/*
 		 * If we're here, it means something is wrong while performing
@@ -1386,11 +1348,16 @@ stun_client_get_nattype(struct stun_client *sc)
 struct stun_addr4
 stun_client_get_mapped_addr(struct stun_client *sc)
 {
-	struct stun_addr4 error = { 0, 0 };
+	struct stun_addr4 error = { 0, 0 }, addr;
 
 	if (!sc->result.test_i_success)
 		return (error);
-	return (sc->test_i.mapped_addr);
+	if (sc->result.test_wg_success)
+		return (sc->test_wg.mapped_addr);
+	/* The port of Test I isn't the one peers send to. */
+	addr = sc->test_i.mapped_addr;
+	addr.port = 0;
+	return (addr);
 }
 
 enum stun_nattype
@@ -1419,28 +1386,38 @@ STUNC_get_mappped_addr(void)
 	return (inet_ntoa(addr));
 }
 
+/*
+ * All attempts run at the same time.  Each has its own sockets so they
+ * don't disturb each other.
+ */
 static int
 stunc_test_loop(struct stun_addr4 *mapped_addr, enum stun_nattype *nattype,
     int times)
 {
 	struct stun_addr4 next_mapped_addr;
 	enum stun_nattype next_nattype;
-	struct stun_client sc;
+	struct stun_client *scs, *sc;
 	int i;
 
 	AN(mapped_addr);
 	AN(nattype);
 	assert(times >= 1);
 
-	memset(&sc, 0, sizeof(sc));
-	sc.step = STUN_STEP_FIRST;
-	sc.dst.addr = ntohl(inet_addr("13.56.166.106"));
-	sc.dst.port = 3478;
-	sc.fd = -1;
-	stun_client_perform(&sc);
+	scs = calloc(times, sizeof(*scs));
+	AN(scs);
+	for (i = 0; i < times; i++) {
+		sc = &scs[i];
+		sc->dst.addr = ntohl(inet_addr(STUN_SERVER_ADDR));
+		sc->dst.port = STUN_SERVER_PORT;
+		sc->fd = -1;
+		sc->fd_change = -1;
+		sc->fd_wg = -1;
+	}
+	stun_client_perform(scs, times);
 
-	*nattype = stun_client_get_nattype(&sc);
-	*mapped_addr = stun_client_get_mapped_addr(&sc);
+	sc = &scs[0];
+	*nattype = stun_client_get_nattype(sc);
+	*mapped_addr = stun_client_get_mapped_addr(sc);
 	if (times == 1 &&
 	    (mapped_addr->addr == INADDR_ANY ||
 	     *nattype == STUN_NATTYPE_FAILURE)) {
@@ -1449,15 +1426,9 @@ stunc_test_loop(struct stun_addr4 *mapped_addr, enum stun_nattype *nattype,
 		goto print_error;
 	}
 	for (i = 1; i < times; i++) {
-		memset(&sc, 0, sizeof(sc));
-		sc.step = STUN_STEP_FIRST;
-		sc.dst.addr = ntohl(inet_addr("13.56.166.106"));
-		sc.dst.port = 3478;
-		sc.fd = -1;
-		stun_client_perform(&sc);
-
-		next_nattype = stun_client_get_nattype(&sc);
-		next_mapped_addr = stun_client_get_mapped_addr(&sc);
+		sc = &scs[i];
+		next_nattype = stun_client_get_nattype(sc);
+		next_mapped_addr = stun_client_get_mapped_addr(sc);
 		if (*nattype != next_nattype) {
 			vtc_log(stunc_vl, 1,
 			    "BANDEC_00905: NAT type changed from %s to %s "
@@ -1480,32 +1451,34 @@ stunc_test_loop(struct stun_addr4 *mapped_addr, enum stun_nattype *nattype,
 			goto print_error;
 		}
 	}
+	free(scs);
 	return (0);
 
 print_error:
 	vtc_log(stunc_vl, 1, 
 	    "BANDEC_00765: test results:"
 	    " i=%d i2=%d i3=%d"
-	    " ii=%d ii_no_ip=%d ii_parse_error=%d ii_test_num=%d"
+	    " ii=%d ii_no_ip=%d ii_parse_error=%d"
 	    " iii=%d"
-	    " iii_no_port=%d iii_parse_error=%d iii_test_num=%d"
+	    " iii_no_port=%d iii_parse_error=%d"
+	    " wg=%d"
 	    " is_nat=%d preserve_port=%d hairpin=%d"
 	    " mapped_same_ip=%d",
-	    sc.result.test_i_success,
-	    sc.result.test_i2_success, 
-	    sc.result.test_i3_success,
-	    sc.result.test_ii_success,
-	    sc.result.test_ii_fail_no_ip_change,
-	    sc.result.test_ii_fail_parse_error,
-	    sc.result.test_ii_fail_wrong_test_num,
-	    sc.result.test_iii_success,
-	    sc.result.test_iii_fail_no_port_change,
-	    sc.result.test_iii_fail_parse_error,
-	    sc.result.test_iii_fail_wrong_test_num,
-	    sc.result.is_nat,
-	    sc.result.preserve_port,
-	    sc.result.hairpin,
-	    sc.result.mapped_same_ip);
+	    sc->result.test_i_success,
+	    sc->result.test_i2_success, 
+	    sc->result.test_i3_success,
+	    sc->result.test_ii_success,
+	    sc->result.test_ii_fail_no_ip_change,
+	    sc->result.test_ii_fail_parse_error,
+	    sc->result.test_iii_success,
+	    sc->result.test_iii_fail_no_port_change,
+	    sc->result.test_iii_fail_parse_error,
+	    sc->result.test_wg_success,
+	    sc->result.is_nat,
+	    sc->result.preserve_port,
+	    sc->result.hairpin,
+	    sc->result.mapped_same_ip);
+	free(scs);
 	return (-1);
 }
 
@@ -1515,11 +1488,12 @@ STUNC_test(int times)
 	struct stun_addr4 mapped_addr;
 	enum stun_nattype nattype;
 	struct in_addr in;
+	double t0;
 	int rv;
 
-	vtc_log(stunc_vl, 2,
-	    "Starting to test the STUN client. It takes some seconds.");
+	vtc_log(stunc_vl, 2, "Starting to test the STUN client.");
 
+	t0 = VTIM_mono();
 	mapped_addr.addr = INADDR_ANY;
 	nattype = STUN_NATTYPE_UNKNOWN;
 	rv = stunc_test_loop(&mapped_addr, &nattype, times);
@@ -1537,9 +1511,11 @@ STUNC_test(int times)
 		return (-1);
 	}
 	vtc_log(stunc_vl, 2,
-	    "STUN client test completed. (nat_type %s mapped_addr %s)",
+	    "STUN client test completed in %.3f secs."
+	    " (nat_type %s mapped_addr %s mapped_port %u)",
+	    VTIM_mono() - t0,
 	    STUNC_nattypestr(nattype),
-	    inet_ntoa(in));
+	    inet_ntoa(in), mapped_addr.port);
 	if (stunc_result_inited) {
 		uint32_t naddr = htonl(mapped_addr.addr);
 
@@ -1564,20 +1540,100 @@ STUNC_test(int times)
 			    addr1p, addr2p);
 			stunc_result.mapped_addr = naddr;
 		}
+		if (stunc_result.mapped_port != mapped_addr.port) {
+			vtc_log(stunc_vl, 2,
+			    "Mapped port changed from %u to %u",
+			    stunc_result.mapped_port, mapped_addr.port);
+			stunc_result.mapped_port = mapped_addr.port;
+		}
 	} else {
 		stunc_result.nattype = nattype;
 		stunc_result.mapped_addr = htonl(mapped_addr.addr);
+		stunc_result.mapped_port = mapped_addr.port;
 		stunc_result_inited = 1;
 	}
 	return (0);
 }
 
+/*
+ * Called by the main loop for every packet on the WireGuard socket.
+ * Returns 0 if it was a STUN answer and consumed.  'addr' is in network
+ * and 'port' is in host byte order.
+ */
+int
+STUNC_input(const void *buf, size_t len, uint32_t addr, uint16_t port)
+{
+	struct stun_addr4 from;
+	struct iovec iov[2];
+	struct msghdr mh;
+	const uint8_t *p = buf;
+	uint32_t cookie;
+	uint16_t type;
+
+	if (len < sizeof(struct stun_msghdr))
+		return (-1);
+	memcpy(&type, p, sizeof(type));
+	type = ntohs(type);
+	if (type != STUN_T_BINDRESPONSEMSG && type != STUN_T_BINDERRORMSG)
+		return (-1);
+	memcpy(&cookie, p + 4, sizeof(cookie));
+	if (ntohl(cookie) != STUN_MAGIC_COOKIE)
+		return (-1);
+	if (addr != inet_addr(STUN_SERVER_ADDR) || port != STUN_SERVER_PORT)
+		return (-1);
+	if (stunc_wg_pair[1] < 0 || len > STUN_MAX_MESSAGE_SIZE)
+		return (0);
+	from.addr = ntohl(addr);
+	from.port = port;
+	iov[0].iov_base = &from;
+	iov[0].iov_len = sizeof(from);
+	iov[1].iov_base = (void *)(uintptr_t)buf;
+	iov[1].iov_len = len;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	/*
+	 * Queued for the running test, or for the next one to drain.  Dropped
+	 * if the pair is full.
+	 */
+	(void)sendmsg(stunc_wg_pair[1], &mh, MSG_DONTWAIT);
+	return (0);
+}
+
+/*
+ * Called once the main loop reads the WireGuard socket.  Until then the
+ * WireGuard test could only time out, and opening the socket for it would
+ * bind it before the listen port of the config is known.
+ */
+void
+STUNC_wg_enable(void)
+{
+
+	stunc_wg_enabled = 1;
+}
+
+uint16_t
+STUNC_get_mapped_port(void)
+{
+
+	if (!stunc_result_inited)
+		return (0);
+	return (stunc_result.mapped_port);
+}
+
 int
 STUNC_init(void)
 {
 
 	stunc_vl = vtc_logopen("stunc", mudband_log_printf);
 	AN(stunc_vl);
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, stunc_wg_pair) != 0) {
+		vtc_log(stunc_vl, 1,
+		    "BANDEC_00923: socketpair(2) failed: %d %s."
+		    " STUN over the WireGuard socket is disabled.",
+		    errno, strerror(errno));
+		stunc_wg_pair[0] = stunc_wg_pair[1] = -1;
+	}
 	STUNC_test(1);
 	return (0);
 }
@@ -42,6 +42,7 @@ enum stun_nattype {
 struct stun_client_result {
 	enum stun_nattype	nattype;
 	uint32_t		mapped_addr;
+	uint16_t		mapped_port;	/* of the WireGuard socket */
 };
 
 int	STUNC_init(void);
@@ -50,6 +51,11 @@ enum stun_nattype
 	STUNC_get_nattype(void);
 const char *
 	STUNC_get_mappped_addr(void);
+uint16_t
+	STUNC_get_mapped_port(void);
+int	STUNC_input(const void *buf, size_t len, uint32_t addr,
+	    uint16_t port);
+void	STUNC_wg_enable(void);
 const char *
 	STUNC_nattypestr(enum stun_nattype t);
 
@@ -46,8 +46,6 @@
 #include "odr_pthread.h"
 #include "vtc_log.h"
 
-struct wireguard_peer_snapshot *mbt_peer_snapshots;
-int mbt_peer_snapshots_count;
 static struct vtclog *mbt_vl;
 static struct callout_block mbt_cb;
 static struct callout mbt_stun_client_co;
@@ -99,7 +97,7 @@ mbt_conf_fetcher(void *arg)
 	case -5:	/* no peers exist */
 		break;
 	case 0:
-		band_need_iface_sync = 1;
+		__atomic_store_n(&band_need_iface_sync, 1, __ATOMIC_RELEASE);
 		break;
 	default:
 		vtc_log(mbt_vl, 2,
@@ -138,25 +136,14 @@ MBT_conf_fetcher_trigger(void)
 static void
 mbt_status_snapshot(void *arg)
 {
+	struct wireguard_peer_snapshot *snaps;
 	json_t *jroot, *jstats, *jstatus;
-	int i;
+	int i, n_snaps;
 	const char *default_band_uuid;
 	char filepath[PATH_MAX];
 
 	(void)arg;
 
-	band_need_peer_snapahot = 1;	/* trigger a peer snapshot. */
-	for (i = 0; i < 3; i++) {
-		if (band_need_peer_snapahot == 0)
-			break;
-		ODR_msleep(1000);
-	}
-	if (band_need_peer_snapahot == 1) {
-		vtc_log(mbt_vl, 1,
-		    "BANDEC_00869: No peer snapshot performed within"
-		    " 3 seconds.");
-		goto done;
-	}
 	default_band_uuid = MPC_get_default_band_uuid();
 	if (default_band_uuid == NULL) {
 		vtc_log(mbt_vl, 1, "BANDEC_00870: No default band UUID.");
@@ -166,10 +153,11 @@ mbt_status_snapshot(void *arg)
 	AN(jroot);
 	json_object_set_new(jroot, "band_uuid", json_string(default_band_uuid));
 	/* peers */
-	assert(mbt_peer_snapshots_count >= 0);
+	n_snaps = wireguard_peer_snapshot_get(&snaps);
+	assert(n_snaps >= 0);
 	json_t *jpeers = json_array();
 	AN(jpeers);
-	for (i = 0; i < mbt_peer_snapshots_count; i++) {
+	for (i = 0; i < n_snaps; i++) {
 		struct in_addr addr;
 		json_t *jpeer;
 		const char *ip_ptr;
@@ -178,22 +166,33 @@ mbt_status_snapshot(void *arg)
 		jpeer = json_object();
 		AN(jpeer);
 		/* Convert iface_addr to string */
-		addr.s_addr = mbt_peer_snapshots[i].iface_addr;
+		addr.s_addr = snaps[i].iface_addr;
 		ip_ptr = inet_ntop(AF_INET, &addr, ip_str, sizeof(ip_str));
 		AN(ip_ptr);
 		json_object_set_new(jpeer, "iface_addr", json_string(ip_str));
 		/* Convert endpoint_ip to string */
-		addr.s_addr = mbt_peer_snapshots[i].endpoint_ip;
+		addr.s_addr = snaps[i].endpoint_ip;
 		ip_ptr = inet_ntop(AF_INET, &addr, ip_str, sizeof(ip_str));
 		AN(ip_ptr);
 		json_object_set_new(jpeer, "endpoint_ip", json_string(ip_str));
 		json_object_set_new(jpeer, "endpoint_port", 
-		    json_integer(mbt_peer_snapshots[i].endpoint_port));
+		    json_integer(snaps[i].endpoint_port));
 		json_object_set_new(jpeer, "endpoint_t_heartbeated", 
-		    json_integer(mbt_peer_snapshots[i].endpoint_t_heartbeated));
+		    json_integer(snaps[i].endpoint_t_heartbeated));
+		json_object_set_new(jpeer, "n_rx_pkts",
+		    json_integer(snaps[i].n_rx_pkts));
+		json_object_set_new(jpeer, "n_tx_pkts",
+		    json_integer(snaps[i].n_tx_pkts));
+		json_object_set_new(jpeer, "n_drops",
+		    json_integer(snaps[i].n_drops));
+		json_object_set_new(jpeer, "bytes_rx",
+		    json_integer(snaps[i].bytes_rx));
+		json_object_set_new(jpeer, "bytes_tx",
+		    json_integer(snaps[i].bytes_tx));
 		json_array_append_new(jpeers, jpeer);
 	}
 	json_object_set_new(jroot, "peers", jpeers);
+	free(snaps);
 	/* stats */
 	jstats = wireguard_iface_stat_to_json();
 	AN(jstats);
@@ -64,6 +64,42 @@
 #  define TBLS 1
 #endif /* BYFOUR */
 
+/*
+  Hardware CRC-32 for the same polynomial: carry-less multiplication
+  (PCLMULQDQ) on x86-64 and the CRC32 instructions of ARMv8.  Both are
+  chosen at run time; CPUs without them use the tables below.
+ */
+#ifndef NOHWCRC
+#  if defined(__GNUC__) && defined(__x86_64__)
+#    include <cpuid.h>
+#    include <emmintrin.h>
+#    include <smmintrin.h>
+#    include <wmmintrin.h>
+#    define CRC32_PCLMUL
+#  endif
+#  if defined(__GNUC__) && defined(__aarch64__)
+#    include <arm_acle.h>
+#    if defined(__linux__)
+#      include <sys/auxv.h>
+#      ifndef HWCAP_CRC32
+#        define HWCAP_CRC32 (1 << 7)
+#      endif
+#    endif
+#    define CRC32_ARMV8
+#  endif
+#endif /* !NOHWCRC */
+
+#if defined(CRC32_PCLMUL) || defined(CRC32_ARMV8)
+#  define CRC32_HW
+   local int crc32_hw_enabled OF((void));
+   local unsigned long crc32_hw OF((unsigned long,
+                        const unsigned char FAR *, unsigned));
+#endif
+#ifdef CRC32_PCLMUL
+   local unsigned int crc32_pclmul OF((unsigned int,
+                        const unsigned char FAR *, unsigned));
+#endif
+
 /* Local functions for crc concatenation */
 local unsigned long gf2_matrix_times OF((unsigned long *mat,
                                          unsigned long vec));
@@ -230,6 +266,11 @@ unsigned long ZEXPORT crc32(crc, buf, len)
         make_crc_table();
 #endif /* DYNAMIC_CRC_TABLE */
 
+#ifdef CRC32_HW
+    if (len >= 64 && crc32_hw_enabled())
+        return crc32_hw(crc, buf, len);
+#endif /* CRC32_HW */
+
 #ifdef BYFOUR
     if (sizeof(void *) == sizeof(ptrdiff_t)) {
         u4 endian;
@@ -340,6 +381,184 @@ local unsigned long crc32_big(crc, buf, len)
 
 #define GF2_DIM 32      /* dimension of GF(2) vectors (length of CRC) */
 
+#ifdef CRC32_HW
+
+/* ========================================================================= */
+local int crc32_hw_enabled(void)
+{
+    /* Racing threads all store the same answer. */
+    local volatile int enabled = -1;
+
+    if (enabled == -1) {
+#ifdef CRC32_PCLMUL
+        unsigned int a, b, c, d;
+
+        enabled = __get_cpuid(1, &a, &b, &c, &d) &&
+            (c & bit_PCLMUL) != 0 && (c & bit_SSE4_1) != 0;
+#endif /* CRC32_PCLMUL */
+#ifdef CRC32_ARMV8
+#  if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+        enabled = 1;
+#  elif defined(__linux__)
+        enabled = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#  else
+        enabled = 0;
+#  endif
+#endif /* CRC32_ARMV8 */
+    }
+    return enabled;
+}
+
+#ifdef CRC32_PCLMUL
+
+/* ========================================================================= */
+/*
+  Folds 64 bytes at a time with carry-less multiplication and reduces the
+  result to 32 bits with Barrett reduction, as in "Fast CRC Computation for
+  Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009).  The
+  constants are those of the bit-reflected CRC-32 polynomial.  len must be
+  a multiple of 16 and at least 64.  crc is the shift register, i.e. not
+  pre- or post-conditioned.
+ */
+__attribute__((target("pclmul,sse4.1")))
+local unsigned int crc32_pclmul(crc, buf, len)
+    unsigned int crc;
+    const unsigned char FAR *buf;
+    unsigned len;
+{
+    static const unsigned long long k1k2[2] __attribute__((aligned(16))) =
+        { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const unsigned long long k3k4[2] __attribute__((aligned(16))) =
+        { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const unsigned long long k5k0[2] __attribute__((aligned(16))) =
+        { 0x0163cd6124ULL, 0x0000000000ULL };
+    static const unsigned long long poly[2] __attribute__((aligned(16))) =
+        { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold four lanes of 128 bits in parallel */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* fold the remaining blocks of 16 bytes */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 bits to 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (unsigned int)_mm_extract_epi32(x1, 1);
+}
+
+/* ========================================================================= */
+local unsigned long crc32_hw(crc, buf, len)
+    unsigned long crc;
+    const unsigned char FAR *buf;
+    unsigned len;
+{
+    unsigned n;
+
+    n = len & ~15U;
+    crc = ~crc32_pclmul((unsigned int)~crc, buf, n) & 0xffffffffUL;
+    return crc32(crc, buf + n, len - n);
+}
+
+#endif /* CRC32_PCLMUL */
+
+#ifdef CRC32_ARMV8
+
+/* ========================================================================= */
+#  ifdef __clang__
+__attribute__((target("crc")))
+#  else
+__attribute__((target("arch=armv8-a+crc")))
+#  endif
+local unsigned long crc32_hw(crc, buf, len)
+    unsigned long crc;
+    const unsigned char FAR *buf;
+    unsigned len;
+{
+    unsigned int c;
+
+    c = (unsigned int)crc ^ 0xffffffffU;
+    while (len && ((ptrdiff_t)buf & 7)) {
+        c = __crc32b(c, *buf++);
+        len--;
+    }
+    while (len >= 8) {
+        c = __crc32d(c, *(const unsigned long long *)(const void *)buf);
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = __crc32b(c, *buf++);
+    return (unsigned long)(c ^ 0xffffffffU);
+}
+
+#endif /* CRC32_ARMV8 */
+
+#endif /* CRC32_HW */
+
 /* ========================================================================= */
 local unsigned long gf2_matrix_times(mat, vec)
     unsigned long *mat;
@@ -41,8 +41,10 @@
 #include "vhttps.h"
 #include "vgz.h"
 #include "vsb.h"
+#include "vqueue.h"
 #include "vsock.h"
 #include "vtc_log.h"
+#include "vtim.h"
 
 #define	AN(foo)		do { assert((foo) != 0); } while (0)
 #define	AZ(foo)		do { assert((foo) == 0); } while (0)
@@ -58,6 +60,31 @@ static struct vhttps_internal *
 static void	vhttps_free(struct vhttps_internal *hp);
 static int	vhttps_rxbody(struct vhttps_internal *hp);
 
+/*
+ * A connection to the server kept open after a response was read to its
+ * end so the next request to the same server skips the DNS lookup, the
+ * TCP handshake and the TLS handshake.
+ */
+struct vhttps_conn {
+	unsigned		magic;
+#define	VHTTPS_CONN_MAGIC	0x41c7e25d
+	char			*server;
+	char			*domain;
+	int			fd;
+	struct vssl		*ssl;
+	double			t_idle;
+	unsigned		f_reused : 1;
+	VTAILQ_ENTRY(vhttps_conn) list;
+};
+/* Below the idle timeout of the usual load balancers. */
+#define	VHTTPS_CONN_IDLE_MAX	50.0
+#define	VHTTPS_CONN_POOL_MAX	4
+
+static VTAILQ_HEAD(, vhttps_conn) vhttps_conn_pool =
+    VTAILQ_HEAD_INITIALIZER(vhttps_conn_pool);
+static int vhttps_conn_npool;
+static odr_pthread_mutex_t vhttps_conn_mtx;
+
 
 static void
 vhttps_splitheader(struct vhttps_internal *hp, int req)
@@ -133,17 +160,20 @@ vhttps_splitheader(struct vhttps_internal *hp, int req)
 	}
 }
 
+/*
+ * One read(2) of at most n bytes.  Returns the number of bytes, 0 on EOF
+ * or timeout, or -1.
+ */
 static int
-vhttps_rxcharForSocket(struct vhttps_internal *hp, int n, int eof)
+vhttps_recv(struct vhttps_internal *hp, void *buf, int n, int eof)
 {
 	fd_set set;
 	int i;
+	struct timeval tv;
 
-	while (n > 0) {
-		struct timeval tv;
-
+	if (hp->ssl == NULL || VSSL_pending(hp->ssl) <= 0) {
 		tv.tv_sec = hp->timeout;
-                tv.tv_usec = 0;
+		tv.tv_usec = 0;
 		FD_ZERO(&set);
 		FD_SET(hp->fd, &set);
 		i = select(hp->fd + 1, &set, NULL, NULL, &tv);
@@ -159,26 +189,78 @@ vhttps_rxcharForSocket(struct vhttps_internal *hp, int n, int eof)
 			    hp->fd, strerror(errno));
 			return (i);
 		}
-		assert(i > 0);
+	}
+	if (hp->ssl != NULL)
+		i = VSSL_read(hp->ssl, buf, n);
+	else
+		i = recv(hp->fd, buf, n, 0);
+	if (i == 0 && eof)
+		return (i);
+	if (i == 0) {
+		vtc_log(hp->vl, 1,
+		    "BANDEC_00012: HTTP rx EOF (r:%d fd:%d read: %s)",
+		    i, hp->fd, strerror(errno));
+		return (i);
+	}
+	if (i < 0) {
+		vtc_log(hp->vl, 1,
+		    "BANDEC_00013: HTTP rx failed (fd:%d read: %s)",
+		    hp->fd, strerror(errno));
+		return (-1);
+	}
+	return (i);
+}
+
+/*
+ * Refills the read-ahead buffer with whatever one read(2) returns, which
+ * for TLS is usually a whole record.  Returns the number of buffered
+ * bytes, 0 on EOF or timeout, or -1.
+ */
+static int
+vhttps_fill(struct vhttps_internal *hp, int eof)
+{
+	int i;
+
+	if (hp->rabufoff < hp->rabuflen)
+		return (hp->rabuflen - hp->rabufoff);
+	hp->rabufoff = hp->rabuflen = 0;
+	i = vhttps_recv(hp, hp->rabuf, hp->nrabuf, eof);
+	if (i > 0)
+		hp->rabuflen = i;
+	return (i);
+}
+
+/*
+ * At most n bytes, taken from the read-ahead buffer first.  Returns the
+ * number of bytes, 0 on EOF or timeout, or -1.
+ */
+static int
+vhttps_read(struct vhttps_internal *hp, void *buf, int n, int eof)
+{
+	int i;
+
+	/* Large reads skip the copy. */
+	if (hp->rabufoff == hp->rabuflen && n >= hp->nrabuf)
+		return (vhttps_recv(hp, buf, n, eof));
+	i = vhttps_fill(hp, eof);
+	if (i <= 0)
+		return (i);
+	i = MIN(i, n);
+	memcpy(buf, hp->rabuf + hp->rabufoff, i);
+	hp->rabufoff += i;
+	return (i);
+}
+
+static int
+vhttps_rxcharForSocket(struct vhttps_internal *hp, int n, int eof)
+{
+	int i;
+
+	while (n > 0) {
 		assert(hp->prxbuf + n < hp->nrxbuf);
-		if (hp->ssl != NULL)
-			i = VSSL_read(hp->ssl, hp->rxbuf + hp->prxbuf, n);
-		else
-			i = recv(hp->fd, hp->rxbuf + hp->prxbuf, n, 0);
-		if (i == 0 && eof)
+		i = vhttps_read(hp, hp->rxbuf + hp->prxbuf, n, eof);
+		if (i <= 0)
 			return (i);
-		if (i == 0) {
-			vtc_log(hp->vl, 1,
-			    "BANDEC_00012: HTTP rx EOF (r:%d fd:%d read: %s)",
-			    i, hp->fd, strerror(errno));
-			return (i);
-		}
-		if (i < 0) {
-			vtc_log(hp->vl, 1,
-			    "BANDEC_00013: HTTP rx failed (fd:%d read: %s)",
-			    hp->fd, strerror(errno));
-			return (i);
-		}
 		hp->prxbuf += i;
 		hp->rxbuf[hp->prxbuf] = '\0';
 		n -= i;
@@ -215,31 +297,40 @@ vhttps_rxchar(struct vhttps_internal *hp, int n, int eof)
 	return (vhttps_rxcharForBuffer(hp, n, eof));
 }
 
+/*
+ * Moves the header out of the read-ahead buffer up to the empty line.
+ * The bytes after it are left there for the body.
+ */
 static int
 vhttps_rxhdr(struct vhttps_internal *hp)
 {
-	int i, r;
-	char *p;
+	int nl, r;
+	char c;
 
 	CHECK_OBJ_NOTNULL(hp, VHTTPS_MAGIC);
+	assert(hp->type == VHTTPS_T_SOCKET);
 	hp->prxbuf = 0;
 	hp->body = NULL;
-	while (1) {
-		r = vhttps_rxchar(hp, 1, 0);
-		if (r <= 0)
+	nl = 0;
+	while (nl < 2) {
+		if (hp->rabufoff == hp->rabuflen) {
+			r = vhttps_fill(hp, 0);
+			if (r <= 0)
+				return (-1);
+		}
+		if (hp->prxbuf + 1 >= hp->nrxbuf) {
+			vtc_log(hp->vl, 1,
+			    "BANDEC_00924: Too large HTTP header.");
 			return (-1);
-		p = hp->rxbuf + hp->prxbuf - 1;
-		for (i = 0; p > hp->rxbuf; p--) {
-			if (*p != '\n')
-				break;
-			if (p - 1 > hp->rxbuf && p[-1] == '\r')
-				p--;
-			if (++i == 2)
-				break;
 		}
-		if (i == 2)
-			break;
+		c = hp->rabuf[hp->rabufoff++];
+		hp->rxbuf[hp->prxbuf++] = c;
+		if (c == '\n')
+			nl++;
+		else if (c != '\r')
+			nl = 0;
 	}
+	hp->rxbuf[hp->prxbuf] = '\0';
 	vtc_dump(hp->vl, 4, "rxhdr", hp->rxbuf, -1);
 	return (0);
 }
@@ -337,7 +428,8 @@ vhttps_swallow_body(struct vhttps_internal *hp, char * const *hh, int body)
 	p = vhttps_find_header(hh, "content-length");
 	if (p != NULL) {
 		l = strtoul(p, NULL, 0);
-		(void)vhttps_rxchar(hp, l, 0);
+		if (vhttps_rxchar(hp, l, 0) > 0)
+			hp->keepalive = 1;
 		vtc_dump(hp->vl, 4, "body", hp->body, l);
 		hp->bodylen = l;
 		sprintf(hp->bodylenstr, "%d", l);
@@ -352,6 +444,7 @@ vhttps_swallow_body(struct vhttps_internal *hp, char * const *hh, int body)
 			    "BANDEC_XXXXX: Error reading chunked body.");
 			return;
 		}
+		hp->keepalive = 1;
 		vtc_dump(hp->vl, 4, "body", hp->body, ll);
 		ll = (int)(hp->rxbuf + hp->prxbuf - hp->body);
 		hp->bodylen = ll;
@@ -365,7 +458,8 @@ vhttps_swallow_body(struct vhttps_internal *hp, char * const *hh, int body)
 			ll += i;
 		} while (i > 0);
 		vtc_dump(hp->vl, 4, "rxeof", hp->body, ll);
-	}
+	} else if (!strcmp(hh[1], "204") || !strcmp(hh[1], "304"))
+		hp->keepalive = 1;
 	hp->bodylen = ll;
 	sprintf(hp->bodylenstr, "%d", ll);
 }
@@ -382,6 +476,9 @@ vhttps_allocCommon(struct vtclog *vl)
 	hp->vsb = vsb_newauto();
 	hp->rxbuf = malloc(hp->nrxbuf);		/* XXX */
 	AN(hp->rxbuf);
+	hp->nrabuf = 16 * 1024;
+	hp->rabuf = malloc(hp->nrabuf);
+	AN(hp->rabuf);
 	hp->vl = vl;
 	AN(hp->rxbuf);
 	AN(hp->vsb);
@@ -425,262 +522,731 @@ vhttps_free(struct vhttps_internal *hp)
 	if (hp == NULL)
 		return;
 	free(hp->rxbuf);
+	free(hp->rabuf);
 	free(hp->gzipbody);
 	vsb_delete(hp->vsb);
 	free(hp);
 }
 
+/*
+ * Inflates the body in one pass.  The output buffer starts from a guess
+ * and doubles whenever inflate(3) fills it.
+ */
 static int
 vhttps_rxbody_gzip(struct vhttps_internal *hp)
 {
 	z_stream strm;
-	Bytef *out = NULL;
+	Bytef *out, *p;
 	uLong outlen, new_outlen;
 	int ret;
 
 	if (hp->bodylen == 0)
 		return (0);
-	outlen = hp->bodylen * 10;
-	while (outlen < (1UL << 30)) {
-		memset(&strm, 0, sizeof(strm));
-		ret = inflateInit2(&strm, 31); // 31 = 15 (max window bits) + 16 (gzip format)
-		if (ret != Z_OK) {
-			vtc_log(hp->vl, 1,
-			    "BANDEC_00796: inflateInit2 failed: %d", ret);
-			return (-1);
-		}
-		if (out != NULL) {
-			free(out);
-			new_outlen = outlen * 10;
-			if (new_outlen < outlen) {
-				vtc_log(hp->vl, 1,
-				    "BANDEC_00797: Buffer size overflow");
-				inflateEnd(&strm);
-				return (-1);
-			}
-			outlen = new_outlen;
+	memset(&strm, 0, sizeof(strm));
+	/* 31 = 15 (max window bits) + 16 (gzip format) */
+	ret = inflateInit2(&strm, 31);
+	if (ret != Z_OK) {
+		vtc_log(hp->vl, 1, "BANDEC_00796: inflateInit2 failed: %d", ret);
+		return (-1);
+	}
+	outlen = MAX((uLong)hp->bodylen * 4, 16384);
+	out = (Bytef *)malloc(outlen);
+	if (out == NULL) {
+		vtc_log(hp->vl, 1,
+		    "BANDEC_00798: Failed to allocate decompression buffer");
+		goto error;
+	}
+	strm.next_in = (Bytef *)hp->body;
+	strm.avail_in = hp->bodylen;
+	strm.next_out = out;
+	strm.avail_out = (uInt)outlen;
+	while (1) {
+		ret = inflate(&strm, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END)
+			break;
+		if ((ret != Z_OK && ret != Z_BUF_ERROR) ||
+		    strm.avail_out != 0) {
+			/* Broken or truncated. */
+			vtc_log(hp->vl, 1, "BANDEC_00799: inflate failed: %d",
+			    ret);
+			goto error;
 		}
-		out = (Bytef *)malloc(outlen);
-		if (out == NULL) {
-			inflateEnd(&strm);
+		new_outlen = outlen * 2;
+		if (new_outlen > (1UL << 30)) {
 			vtc_log(hp->vl, 1,
-			    "BANDEC_00798: Failed to allocate decompression"
-			    " buffer");
-			return (-1);
+			    "BANDEC_00797: Buffer size overflow");
+			goto error;
 		}
-		strm.next_in = (Bytef *)hp->body;
-		strm.avail_in = hp->bodylen;
-		strm.next_out = out;
-		strm.avail_out = outlen;
-		ret = inflate(&strm, Z_FINISH);
-		if (ret == Z_BUF_ERROR) {
-			inflateEnd(&strm);
-			continue;
+		p = (Bytef *)realloc(out, new_outlen);
+		if (p == NULL) {
+			vtc_log(hp->vl, 1,
+			    "BANDEC_00932: Failed to grow decompression buffer"
+			    " to %zu bytes", (size_t)new_outlen);
+			goto error;
 		}
-		break;
-	}
-	if (ret != Z_STREAM_END) {
-		free(out);
-		inflateEnd(&strm);
-		vtc_log(hp->vl, 1, "BANDEC_00799: inflate failed: %d", ret);
-		return (-1);
+		out = p;
+		strm.next_out = out + strm.total_out;
+		strm.avail_out = (uInt)(new_outlen - strm.total_out);
+		outlen = new_outlen;
 	}
-	outlen = strm.total_out;
 	hp->gzipbody = (char *)out;
-	hp->gzipbodylen = (unsigned)outlen;
+	hp->gzipbodylen = (unsigned)strm.total_out;
 	hp->body = hp->gzipbody;
 	hp->bodylen = hp->gzipbodylen;
 	sprintf(hp->bodylenstr, "%d", hp->bodylen);
 	inflateEnd(&strm);
 	return (0);
+error:
+	free(out);
+	inflateEnd(&strm);
+	return (-1);
+}
+
+/*
+ * Whether the server lets the connection stay open after this response.
+ * The body framing is checked by the caller.
+ */
+static int
+vhttps_persistent(struct vhttps_internal *hp)
+{
+	char *p;
+
+	if (strcmp(hp->resp[0], "HTTP/1.1"))
+		return (0);
+	p = vhttps_find_header(hp->resp, "connection");
+	if (p != NULL && !ODR_strncasecmp(p, "close", 5))
+		return (0);
+	return (1);
 }
 
+/* Reads the body of the response whose header is in hp->resp. */
 int
 vhttps_rxbody(struct vhttps_internal *hp)
 {
 	char *p;
 
-	if (vhttps_rxhdr(hp) != 0) {
-		vtc_log(hp->vl, 1, "BANDEC_00017: vhttps_rxhdr error.");
-		return (-1);
-	}
-	vhttps_splitheader(hp, 0);
+	hp->keepalive = 0;
 	hp->body = hp->rxbuf + hp->prxbuf;
 	if (!strcmp(hp->resp[1], "200"))
 		vhttps_swallow_body(hp, hp->resp, 1);
 	else
 		vhttps_swallow_body(hp, hp->resp, 0);
+	/* Nothing may follow the response. */
+	if (!vhttps_persistent(hp) || hp->rabufoff != hp->rabuflen)
+		hp->keepalive = 0;
 	p = vhttps_find_header(hp->resp, "content-encoding");
 	if (p != NULL && strstr(p, "gzip") != NULL)
 		return (vhttps_rxbody_gzip(hp));
 	return (0);
 }
 
-int
-VHTTPS_get(struct vhttps_req *req, char *respbuf, size_t *resplen)
+static struct vhttps_conn *
+vhttps_conn_open(struct vhttps_req *req, const char *method, int timeout)
 {
-	struct vsb *vsb;
+	struct vhttps_conn *conn;
 	enum vss_error error;
-	struct vssl *ssl;
-	size_t l;
 	int errornum, fd, r;
-	int timeout = 30;
 
 	fd = VSS_open(req->server, 10, &error, &errornum);
 	if (fd == -1) {
-		vtc_log(req->vl, 1,
-		    "BANDEC_00018: Failed to communicate with server %s:"
-		    " %d %d", req->server, error, errornum);
-		return (-1);
+		if (!strcmp(method, "GET"))
+			vtc_log(req->vl, 1,
+			    "BANDEC_00018: Failed to communicate with server"
+			    " %s: %d %d", req->server, error, errornum);
+		else
+			vtc_log(req->vl, 1,
+			    "BANDEC_00023: Failed to communicate with server"
+			    " (%s): %d %d", req->server, error, errornum);
+		return (NULL);
 	}
 	VSOCK_blocking(fd);
 	VSOCK_setTimeout(fd, timeout);
-	vsb = vsb_newauto();
-	AN(vsb);
-	ssl = VSSL_new(req->vl, fd, req->domain);
-	AN(ssl);
-	r = VSSL_connect(ssl);
+	ALLOC_OBJ(conn, VHTTPS_CONN_MAGIC);
+	AN(conn);
+	conn->fd = fd;
+	conn->server = ODR_strdup(req->server);
+	AN(conn->server);
+	conn->domain = ODR_strdup(req->domain);
+	AN(conn->domain);
+	conn->ssl = VSSL_new(req->vl, fd, req->domain);
+	AN(conn->ssl);
+	r = VSSL_connect(conn->ssl);
 	if (r == -1) {
-		vtc_log(req->vl, 1, "BANDEC_00019: VSSL_connect(3) failed.");
-		goto error;
+		if (!strcmp(method, "GET"))
+			vtc_log(req->vl, 1,
+			    "BANDEC_00019: VSSL_connect(3) failed.");
+		else
+			vtc_log(req->vl, 1,
+			    "BANDEC_00024: VSSL_connect(3) failed.");
+		VSSL_free(conn->ssl);
+		close(conn->fd);
+		free(conn->server);
+		free(conn->domain);
+		FREE_OBJ(conn);
+		return (NULL);
 	}
-	vsb_printf(vsb, "GET %s HTTP/1.1\r\n", req->url);
-	vsb_printf(vsb, "Connection: close\r\n");
+	return (conn);
+}
+
+/*
+ * 'clean' is set only for an idle connection which had no error on it.
+ * close_notify is sent for it.
+ */
+static void
+vhttps_conn_close(struct vhttps_conn *conn, int clean)
+{
+
+	CHECK_OBJ_NOTNULL(conn, VHTTPS_CONN_MAGIC);
+	if (clean)
+		VSSL_shutdown(conn->ssl);
+	VSSL_free(conn->ssl);
+	close(conn->fd);
+	free(conn->server);
+	free(conn->domain);
+	FREE_OBJ(conn);
+}
+
+/*
+ * An idle connection must have nothing to read.  If it's readable the
+ * server closed it or sent something we didn't ask for.
+ */
+static int
+vhttps_conn_alive(struct vhttps_conn *conn)
+{
+	fd_set set;
+	struct timeval tv;
+
+	if (VSSL_pending(conn->ssl) > 0)
+		return (0);
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	FD_ZERO(&set);
+	FD_SET(conn->fd, &set);
+	return (select(conn->fd + 1, &set, NULL, NULL, &tv) == 0);
+}
+
+/*
+ * Returns an idle connection to the server of 'req' from the pool, or a
+ * new one.
+ */
+static struct vhttps_conn *
+vhttps_conn_get(struct vhttps_req *req, const char *method, int timeout)
+{
+	struct vhttps_conn *conn, *conn2;
+	VTAILQ_HEAD(, vhttps_conn) stale = VTAILQ_HEAD_INITIALIZER(stale);
+	double now;
+
+	now = VTIM_mono();
+	AZ(ODR_pthread_mutex_lock(&vhttps_conn_mtx));
+	VTAILQ_FOREACH_SAFE(conn, &vhttps_conn_pool, list, conn2) {
+		if (now - conn->t_idle <= VHTTPS_CONN_IDLE_MAX)
+			continue;
+		VTAILQ_REMOVE(&vhttps_conn_pool, conn, list);
+		vhttps_conn_npool--;
+		VTAILQ_INSERT_TAIL(&stale, conn, list);
+	}
+	VTAILQ_FOREACH_SAFE(conn, &vhttps_conn_pool, list, conn2) {
+		if (strcmp(conn->server, req->server) ||
+		    strcmp(conn->domain, req->domain))
+			continue;
+		VTAILQ_REMOVE(&vhttps_conn_pool, conn, list);
+		vhttps_conn_npool--;
+		if (vhttps_conn_alive(conn))
+			break;
+		VTAILQ_INSERT_TAIL(&stale, conn, list);
+	}
+	AZ(ODR_pthread_mutex_unlock(&vhttps_conn_mtx));
+	while ((conn2 = VTAILQ_FIRST(&stale)) != NULL) {
+		VTAILQ_REMOVE(&stale, conn2, list);
+		vhttps_conn_close(conn2, vhttps_conn_alive(conn2));
+	}
+	if (conn != NULL) {
+		conn->f_reused = 1;
+		return (conn);
+	}
+	return (vhttps_conn_open(req, method, timeout));
+}
+
+/*
+ * Gives the connection back to the pool if the response was read to its
+ * end and the server didn't ask to close it.
+ */
+static void
+vhttps_conn_put(struct vhttps_conn *conn, int keepalive)
+{
+
+	CHECK_OBJ_NOTNULL(conn, VHTTPS_CONN_MAGIC);
+	if (!keepalive) {
+		vhttps_conn_close(conn, 0);
+		return;
+	}
+	AZ(ODR_pthread_mutex_lock(&vhttps_conn_mtx));
+	if (vhttps_conn_npool >= VHTTPS_CONN_POOL_MAX) {
+		AZ(ODR_pthread_mutex_unlock(&vhttps_conn_mtx));
+		vhttps_conn_close(conn, 1);
+		return;
+	}
+	conn->t_idle = VTIM_mono();
+	VTAILQ_INSERT_HEAD(&vhttps_conn_pool, conn, list);
+	vhttps_conn_npool++;
+	AZ(ODR_pthread_mutex_unlock(&vhttps_conn_mtx));
+}
+
+static int
+vhttps_send(struct vhttps_req *req, const char *method,
+    struct vhttps_conn *conn)
+{
+	struct vsb *vsb;
+	size_t l;
+
+	vsb = vsb_newauto();
+	AN(vsb);
+	vsb_printf(vsb, "%s %s HTTP/1.1\r\n", method, req->url);
+	if (strcmp(method, "GET"))
+		vsb_printf(vsb, "Content-Length: %d\r\n", req->bodylen);
 	if (req->hdrs != NULL)
 		vsb_printf(vsb, "%s", req->hdrs);
 	vsb_printf(vsb, "\r\n");
+	if (strcmp(method, "GET") && req->body != NULL)
+		vsb_printf(vsb, "%s", req->body);
 	vsb_finish(vsb);
 	vtc_log(req->vl, 4, "%.*s", (int)vsb_len(vsb), vsb_data(vsb));
-	l = VSSL_write(ssl, vsb_data(vsb), vsb_len(vsb));
+	l = VSSL_write(conn->ssl, vsb_data(vsb), vsb_len(vsb));
 	if (l != vsb_len(vsb)) {
-		vtc_log(req->vl, 1,
-		    "BANDEC_00020: VHTTPS_get send(2) failed: %ld %d",
-		    l, errno);
-		goto error;
-	} else {
-		struct vhttps_internal *hp;
+		if (!strcmp(method, "GET"))
+			vtc_log(req->vl, conn->f_reused ? 2 : 1,
+			    "BANDEC_00020: VHTTPS_get send(2) failed: %ld %d",
+			    l, errno);
+		else
+			vtc_log(req->vl, conn->f_reused ? 2 : 1,
+			    "BANDEC_00025: VHTTPS %s send(2) failed: %ld %d",
+			    method, l, errno);
+		vsb_delete(vsb);
+		return (-1);
+	}
+	vsb_delete(vsb);
+	return (0);
+}
 
-		hp = vhttps_allocForSocket(req->vl, fd, ssl, timeout);
-		AN(hp);
-		if (vhttps_rxbody(hp) != 0) {
-			vtc_log(req->vl, 1,
-			    "BANDEC_00021: vhttps_rxbody() error."
-				" (server %s url %s)",
-			    req->server, req->url);
-			vhttps_free(hp);
-			goto error;
-		}
-		AN(resplen);
-		if (hp->bodylen > *resplen) {
-			vtc_log(req->vl, 1,
-			    "BANDEC_00022: Not enough buffer space");
+/*
+ * Sends the request and reads the response header into hp->resp.  On
+ * success the caller owns *connp and gives it back with
+ * vhttps_conn_put().
+ *
+ * The server may close an idle connection at any time, so if a reused
+ * one fails the request is sent once more over a new connection.  A GET
+ * is resent if no byte of the response arrived.  Other methods are only
+ * resent if writing the request failed: once it's out the server may
+ * have acted on it even if the response never came.  Idle connections
+ * found dead before sending are dropped by vhttps_conn_get().
+ */
+static struct vhttps_internal *
+vhttps_request(struct vhttps_req *req, const char *method, int timeout,
+    struct vhttps_conn **connp)
+{
+	struct vhttps_internal *hp;
+	struct vhttps_conn *conn;
+	int nrx, resend, retry, sent;
+
+	for (retry = 0;; retry++) {
+		conn = vhttps_conn_get(req, method, timeout);
+		if (conn == NULL)
+			return (NULL);
+		sent = vhttps_send(req, method, conn) == 0;
+		if (sent) {
+			hp = vhttps_allocForSocket(req->vl, conn->fd,
+			    conn->ssl, timeout);
+			AN(hp);
+			if (vhttps_rxhdr(hp) == 0) {
+				vhttps_splitheader(hp, 0);
+				*connp = conn;
+				return (hp);
+			}
+			nrx = hp->prxbuf;
 			vhttps_free(hp);
-			goto error;
+			resend = !strcmp(method, "GET") && nrx == 0;
+		} else
+			resend = 1;
+		if (!conn->f_reused || !resend || retry > 0) {
+			if (sent)
+				vtc_log(req->vl, 1,
+				    "BANDEC_00017: vhttps_rxhdr error."
+				    " (server %s url %s)", req->server,
+				    req->url);
+			else
+				vtc_log(req->vl, 1,
+				    "BANDEC_00934: Failed to send the request."
+				    " (server %s url %s)", req->server,
+				    req->url);
+			vhttps_conn_close(conn, 0);
+			return (NULL);
 		}
-		*resplen = hp->bodylen;
-		memcpy(respbuf, hp->body, hp->bodylen);
-		if (req->f_need_resp_status)
-			req->resp_status = atoi(hp->resp[1]);
-		vhttps_free(hp);
+		vtc_log(req->vl, 2,
+		    "Idle connection to %s was closed. Retrying.",
+		    req->server);
+		vhttps_conn_close(conn, 0);
 	}
-	vsb_delete(vsb);
-	VSSL_free(ssl);
-	close(fd);
+}
+
+int
+VHTTPS_get(struct vhttps_req *req, char *respbuf, size_t *resplen)
+{
+	struct vhttps_internal *hp;
+	struct vhttps_conn *conn;
+	int timeout = 30;
+
+	hp = vhttps_request(req, "GET", timeout, &conn);
+	if (hp == NULL)
+		return (-1);
+	if (vhttps_rxbody(hp) != 0) {
+		vtc_log(req->vl, 1,
+		    "BANDEC_00021: vhttps_rxbody() error."
+			" (server %s url %s)",
+		    req->server, req->url);
+		goto error;
+	}
+	AN(resplen);
+	if (hp->bodylen > *resplen) {
+		vtc_log(req->vl, 1,
+		    "BANDEC_00022: Not enough buffer space");
+		goto error;
+	}
+	*resplen = hp->bodylen;
+	memcpy(respbuf, hp->body, hp->bodylen);
+	if (req->f_need_resp_status)
+		req->resp_status = atoi(hp->resp[1]);
+	vhttps_conn_put(conn, hp->keepalive);
+	vhttps_free(hp);
 	return (0);
 error:
-	vsb_delete(vsb);
-	VSSL_free(ssl);
-	close(fd);
+	vhttps_conn_close(conn, 0);
+	vhttps_free(hp);
 	return (-1);
 }
 
+static void
+vhttps_resp_fill(struct vhttps_req *req, struct vhttps_internal *hp)
+{
+	char *p;
+
+	if (req->f_need_resp_status)
+		req->resp_status = atoi(hp->resp[1]);
+	if (req->f_need_resp_mudband_etag) {
+		p = vhttps_find_header(hp->resp, "mudband-etag");
+		if (p != NULL) {
+			ODR_snprintf(req->resp_mudband_etag,
+			    sizeof(req->resp_mudband_etag), "%s", p);
+		}
+	}
+}
+
 int
 VHTTPS_post(struct vhttps_req *req, char *respbuf, size_t *resplen)
 {
-	struct vsb *vsb;
-	enum vss_error error;
-	struct vssl *ssl;
-	size_t l;
-	int errornum, fd, r;
+	struct vhttps_internal *hp;
+	struct vhttps_conn *conn;
 	int timeout = 30;
 
-	fd = VSS_open(req->server, 10, &error, &errornum);
-	if (fd == -1) {
-		vtc_log(req->vl, 1,
-		    "BANDEC_00023: Failed to communicate with server (%s):"
-		    " %d %d", req->server, error, errornum);
+	hp = vhttps_request(req, "POST", timeout, &conn);
+	if (hp == NULL)
 		return (-1);
-	}
-	VSOCK_blocking(fd);
-	VSOCK_setTimeout(fd, timeout);
-	vsb = vsb_newauto();
-	AN(vsb);
-	ssl = VSSL_new(req->vl, fd, req->domain);
-	AN(ssl);
-	r = VSSL_connect(ssl);
-	if (r == -1) {
-		vtc_log(req->vl, 1, "BANDEC_00024: VSSL_connect(3) failed.");
+	if (vhttps_rxbody(hp) != 0) {
+		vtc_log(req->vl, 1, "BANDEC_00026: vhttps_rxbody error");
 		goto error;
 	}
-	vsb_printf(vsb, "POST %s HTTP/1.1\r\n", req->url);
-	vsb_printf(vsb, "Connection: close\r\n");
-	vsb_printf(vsb, "Content-Length: %d\r\n", req->bodylen);
-	if (req->hdrs != NULL)
-		vsb_printf(vsb, "%s", req->hdrs);
-	vsb_printf(vsb, "\r\n");
-	vsb_printf(vsb, "%s", req->body);
-	vsb_finish(vsb);
-	vtc_log(req->vl, 4, "%.*s", (int)vsb_len(vsb), vsb_data(vsb));
-	l = VSSL_write(ssl, vsb_data(vsb), vsb_len(vsb));
-	if (l != vsb_len(vsb)) {
+	AN(resplen);
+	if (hp->bodylen > *resplen) {
 		vtc_log(req->vl, 1,
-		    "BANDEC_00025: VHTTPS_get send(2) failed: %ld %d",
-		    l, errno);
+		    "BANDEC_00027: Not enough buffer space. %d/%d",
+		    (int)hp->bodylen, (int)*resplen);
 		goto error;
-	} else {
-		struct vhttps_internal *hp;
+	}
+	*resplen = hp->bodylen;
+	memcpy(respbuf, hp->body, hp->bodylen);
+	vhttps_resp_fill(req, hp);
+	vhttps_conn_put(conn, hp->keepalive);
+	vhttps_free(hp);
+	return (0);
+error:
+	vhttps_conn_close(conn, 0);
+	vhttps_free(hp);
+	return (-1);
+}
 
-		hp = vhttps_allocForSocket(req->vl, fd, ssl, timeout);
-		AN(hp);
-		if (vhttps_rxbody(hp) != 0) {
-			vtc_log(req->vl, 1, "BANDEC_00026: vhttps_rxbody error");
-			vhttps_free(hp);
-			goto error;
+/*
+ * A response whose body is handed out as it arrives instead of being
+ * collected in rxbuf, so its size has no limit.  The chunked transfer
+ * coding and the gzip content coding are undone on the way.
+ */
+struct vhttps_stream {
+	unsigned		magic;
+#define	VHTTPS_STREAM_MAGIC	0x5e0b93a1
+	struct vhttps_internal	*hp;
+	struct vhttps_conn	*conn;
+	int			mode;
+#define	VHTTPS_STREAM_M_LENGTH	1
+#define	VHTTPS_STREAM_M_CHUNKED	2
+#define	VHTTPS_STREAM_M_EOF	3
+	uint64_t		left;	/* in the body or the current chunk */
+	unsigned		f_eof : 1,
+				f_error : 1,
+				f_chunk_tail : 1,
+				f_gzip : 1,
+				f_gzip_end : 1,
+				f_keepalive : 1;
+	z_stream		strm;
+	unsigned char		zbuf[16384];
+};
+
+static int
+vhttps_stream_line(struct vhttps_stream *st, char *line, size_t linelen)
+{
+	size_t l = 0;
+
+	do {
+		if (l == linelen - 1) {
+			vtc_log(st->hp->vl, 1,
+			    "BANDEC_00916: Too long chunk line.");
+			return (-1);
+		}
+		if (vhttps_read(st->hp, line + l, 1, 0) != 1)
+			return (-1);
+	} while (line[l++] != '\n');
+	line[l] = '\0';
+	return ((int)l);
+}
+
+/* Reads up to the data of the next chunk. */
+static int
+vhttps_stream_chunk(struct vhttps_stream *st)
+{
+	char line[128], *q;
+	unsigned long n;
+	int l;
+
+	if (st->f_chunk_tail) {
+		l = vhttps_stream_line(st, line, sizeof(line));
+		if (l < 0)
+			return (-1);
+		if (!vct_iscrlf(line[0])) {
+			vtc_log(st->hp->vl, 1,
+			    "BANDEC_00925: Wrong chunk tail[0] = %02x",
+			    line[0] & 0xff);
+			return (-1);
+		}
+		st->f_chunk_tail = 0;
+	}
+	if (vhttps_stream_line(st, line, sizeof(line)) < 0)
+		return (-1);
+	n = strtoul(line, &q, 16);
+	if (q == line) {
+		vtc_log(st->hp->vl, 1,
+		    "BANDEC_00926: Invalid chunk size (no digits found)");
+		return (-1);
+	}
+	if (*q != '\0' && !vct_islws(*q) && *q != ';') {
+		vtc_log(st->hp->vl, 1,
+		    "BANDEC_00927: Invalid character after chunk size ('%c')",
+		    *q);
+		return (-1);
+	}
+	if (n > 0) {
+		st->left = n;
+		st->f_chunk_tail = 1;
+		return (0);
+	}
+	/* The last chunk; skip the trailer. */
+	do {
+		l = vhttps_stream_line(st, line, sizeof(line));
+		if (l < 0)
+			return (-1);
+	} while (!vct_iscrlf(line[0]));
+	st->f_eof = 1;
+	return (0);
+}
+
+/* The body as sent, without the transfer coding. */
+static ssize_t
+vhttps_stream_raw(struct vhttps_stream *st, void *buf, size_t len)
+{
+	int i;
+
+	if (st->f_eof)
+		return (0);
+	switch (st->mode) {
+	case VHTTPS_STREAM_M_LENGTH:
+		if (st->left == 0) {
+			st->f_eof = 1;
+			return (0);
+		}
+		len = MIN(len, st->left);
+		break;
+	case VHTTPS_STREAM_M_CHUNKED:
+		if (st->left == 0) {
+			if (vhttps_stream_chunk(st) != 0)
+				return (-1);
+			if (st->f_eof)
+				return (0);
 		}
-		AN(resplen);
-		if (hp->bodylen > *resplen) {
+		len = MIN(len, st->left);
+		break;
+	default:
+		break;
+	}
+	len = MIN(len, INT_MAX);
+	i = vhttps_read(st->hp, buf, (int)len,
+	    st->mode == VHTTPS_STREAM_M_EOF);
+	if (i == 0 && st->mode == VHTTPS_STREAM_M_EOF) {
+		st->f_eof = 1;
+		return (0);
+	}
+	if (i <= 0)
+		return (-1);
+	if (st->mode != VHTTPS_STREAM_M_EOF)
+		st->left -= i;
+	return (i);
+}
+
+/*
+ * Sends the request and reads the response header.  resp_status and the
+ * other response fields of 'req' are set when this returns; the body is
+ * then read with VHTTPS_stream_read() until it returns 0.
+ */
+struct vhttps_stream *
+VHTTPS_post_stream(struct vhttps_req *req)
+{
+	struct vhttps_internal *hp;
+	struct vhttps_stream *st;
+	struct vhttps_conn *conn;
+	char *p;
+	int r;
+	int timeout = 30;
+
+	hp = vhttps_request(req, "POST", timeout, &conn);
+	if (hp == NULL)
+		return (NULL);
+	ALLOC_OBJ(st, VHTTPS_STREAM_MAGIC);
+	AN(st);
+	st->conn = conn;
+	st->hp = hp;
+	st->f_keepalive = vhttps_persistent(hp);
+	vhttps_resp_fill(req, st->hp);
+	p = vhttps_find_header(st->hp->resp, "content-length");
+	if (p != NULL) {
+		st->mode = VHTTPS_STREAM_M_LENGTH;
+		st->left = strtoull(p, NULL, 0);
+	} else if ((p = vhttps_find_header(st->hp->resp,
+	    "transfer-encoding")) != NULL && !strcmp(p, "chunked")) {
+		st->mode = VHTTPS_STREAM_M_CHUNKED;
+	} else if (!strcmp(st->hp->resp[1], "200")) {
+		st->mode = VHTTPS_STREAM_M_EOF;
+		st->f_keepalive = 0;
+	} else {
+		st->mode = VHTTPS_STREAM_M_LENGTH;
+		st->left = 0;
+		if (strcmp(st->hp->resp[1], "204") &&
+		    strcmp(st->hp->resp[1], "304"))
+			st->f_keepalive = 0;
+	}
+	p = vhttps_find_header(st->hp->resp, "content-encoding");
+	if (p != NULL && strstr(p, "gzip") != NULL) {
+		/* 31 = 15 (max window bits) + 16 (gzip format) */
+		r = inflateInit2(&st->strm, 31);
+		if (r != Z_OK) {
 			vtc_log(req->vl, 1,
-			    "BANDEC_00027: Not enough buffer space. %d/%d",
-			    (int)hp->bodylen, (int)*resplen);
-			vhttps_free(hp);
-			goto error;
+			    "BANDEC_00928: inflateInit2 failed: %d", r);
+			VHTTPS_stream_close(st);
+			return (NULL);
 		}
-		*resplen = hp->bodylen;
-		memcpy(respbuf, hp->body, hp->bodylen);
-		if (req->f_need_resp_status)
-			req->resp_status = atoi(hp->resp[1]);
-		if (req->f_need_resp_mudband_etag) {
-			char *p;
-
-			p = vhttps_find_header(hp->resp, "mudband-etag");
-			if (p != NULL) {
-				ODR_snprintf(req->resp_mudband_etag,
-				    sizeof(req->resp_mudband_etag), "%s", p);
+		st->f_gzip = 1;
+	}
+	return (st);
+}
+
+/*
+ * Returns the number of body bytes put into 'buf', 0 at the end of the
+ * body, or -1.
+ */
+ssize_t
+VHTTPS_stream_read(struct vhttps_stream *st, void *buf, size_t len)
+{
+	ssize_t l;
+	int ret;
+
+	CHECK_OBJ_NOTNULL(st, VHTTPS_STREAM_MAGIC);
+	if (st->f_error)
+		return (-1);
+	if (!st->f_gzip) {
+		l = vhttps_stream_raw(st, buf, len);
+		if (l < 0)
+			st->f_error = 1;
+		return (l);
+	}
+	if (st->f_gzip_end || len == 0)
+		return (0);
+	len = MIN(len, UINT_MAX);
+	st->strm.next_out = buf;
+	st->strm.avail_out = (uInt)len;
+	while (st->strm.avail_out == len) {
+		if (st->strm.avail_in == 0) {
+			l = vhttps_stream_raw(st, st->zbuf, sizeof(st->zbuf));
+			if (l < 0)
+				goto error;
+			if (l == 0) {
+				if (st->strm.total_in == 0) {
+					/* An empty body. */
+					st->f_gzip_end = 1;
+					break;
+				}
+				vtc_log(st->hp->vl, 1,
+				    "BANDEC_00917: Truncated gzip body.");
+				goto error;
 			}
+			st->strm.next_in = st->zbuf;
+			st->strm.avail_in = (uInt)l;
+		}
+		ret = inflate(&st->strm, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			st->f_gzip_end = 1;
+			break;
+		}
+		if (ret != Z_OK) {
+			vtc_log(st->hp->vl, 1,
+			    "BANDEC_00929: inflate failed: %d", ret);
+			goto error;
 		}
-		vhttps_free(hp);
 	}
-	vsb_delete(vsb);
-	VSSL_free(ssl);
-	close(fd);
-	return (0);
+	return ((ssize_t)(len - st->strm.avail_out));
 error:
-	vsb_delete(vsb);
-	VSSL_free(ssl);
-	close(fd);
+	st->f_error = 1;
 	return (-1);
 }
 
+void
+VHTTPS_stream_close(struct vhttps_stream *st)
+{
+	char buf[64];
+
+	CHECK_OBJ_NOTNULL(st, VHTTPS_STREAM_MAGIC);
+	if (st->f_gzip)
+		inflateEnd(&st->strm);
+	/*
+	 * inflate(3) stops at the end of the gzip data so the last chunk
+	 * could still be unread.
+	 */
+	if (st->f_keepalive && !st->f_error && st->f_gzip_end && !st->f_eof &&
+	    vhttps_stream_raw(st, buf, sizeof(buf)) != 0)
+		st->f_keepalive = 0;
+	/* Reusable only if the body was read to its end. */
+	if (st->f_error || st->hp->rabufoff != st->hp->rabuflen ||
+	    (st->mode == VHTTPS_STREAM_M_LENGTH && st->left != 0) ||
+	    (st->mode == VHTTPS_STREAM_M_CHUNKED && !st->f_eof))
+		st->f_keepalive = 0;
+	vhttps_free(st->hp);
+	vhttps_conn_put(st->conn, st->f_keepalive);
+	FREE_OBJ(st);
+}
+
 #define	TRUST_ME(ptr)	((void*)(uintptr_t)(ptr))
 
 void
@@ -688,4 +1254,5 @@ VHTTPS_init(void)
 {
 
 	VSSL_init();
+	AZ(ODR_pthread_mutex_init(&vhttps_conn_mtx, NULL));
 }
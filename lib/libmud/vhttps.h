@@ -34,6 +34,7 @@
 
 struct vsb;
 struct vtclog;
+struct vhttps_stream;
 
 struct vhttps_internal {
 	unsigned		magic;
@@ -45,6 +46,11 @@ struct vhttps_internal {
 	char			*buf;
 	size_t			buflen;
 	size_t			bufoff;
+	/* Bytes read from the socket but not parsed yet. */
+	char			*rabuf;
+	int			nrabuf;
+	int			rabufoff;
+	int			rabuflen;
 	struct vtclog		*vl;
 	struct vsb		*vsb;
 	struct vssl		*ssl;
@@ -59,6 +65,7 @@ struct vhttps_internal {
 	char			*gzipbody;
 	unsigned		gzipbodylen;
 	int			timeout;
+	int			keepalive;
 
 #define VHTTPS_MAX_HDR		50
 	char			*req[VHTTPS_MAX_HDR];
@@ -83,5 +90,9 @@ struct vhttps_req {
 void	VHTTPS_init(void);
 int	VHTTPS_get(struct vhttps_req *req, char *respbuf, size_t *resplen);
 int	VHTTPS_post(struct vhttps_req *req, char *respbuf, size_t *resplen);
+struct vhttps_stream *
+	VHTTPS_post_stream(struct vhttps_req *req);
+ssize_t	VHTTPS_stream_read(struct vhttps_stream *st, void *buf, size_t len);
+void	VHTTPS_stream_close(struct vhttps_stream *st);
 
 #endif
@@ -50,6 +50,19 @@ static SSL_CTX	*vssl_ctx;
 static odr_pthread_mutex_t *vssl_lock;
 static int vssl_inited;
 
+/*
+ * The latest session ticket of each server so the next connection resumes
+ * the TLS session instead of doing the full handshake.
+ */
+struct vssl_sess {
+	char			*domain;
+	SSL_SESSION		*sess;
+};
+#define	VSSL_SESS_MAX		8
+static struct vssl_sess vssl_sess[VSSL_SESS_MAX];
+static unsigned vssl_sess_next;
+static odr_pthread_mutex_t vssl_sess_mtx;
+
 static unsigned long
 VSSL_thrid_cb(void)
 {
@@ -89,6 +102,62 @@ VSSL_lock_cb(int mode, int type, const char *file, int line)
 	assert(n == 0);
 }
 
+static struct vssl_sess *
+vssl_sess_find(const char *domain)
+{
+	int i;
+
+	for (i = 0; i < VSSL_SESS_MAX; i++) {
+		if (vssl_sess[i].domain != NULL &&
+		    !strcmp(vssl_sess[i].domain, domain))
+			return (&vssl_sess[i]);
+	}
+	return (NULL);
+}
+
+/*
+ * Called by OpenSSL for every new session.  With TLS 1.3 it's after the
+ * handshake when the server sends a ticket.
+ */
+static int
+vssl_sess_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	struct vssl *s;
+	struct vssl_sess *vs;
+	SSL_SESSION *copy;
+
+	s = SSL_get_app_data(ssl);
+	if (s == NULL || s->domain == NULL)
+		return (0);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if (!SSL_SESSION_is_resumable(sess))
+		return (0);
+	/*
+	 * A copy because OpenSSL marks the session of a connection freed
+	 * without close_notify as not resumable.
+	 */
+	copy = SSL_SESSION_dup(sess);
+	if (copy == NULL)
+		return (0);
+#else
+	copy = sess;
+#endif
+	AZ(ODR_pthread_mutex_lock(&vssl_sess_mtx));
+	vs = vssl_sess_find(s->domain);
+	if (vs == NULL) {
+		vs = &vssl_sess[vssl_sess_next++ % VSSL_SESS_MAX];
+		free(vs->domain);
+		vs->domain = ODR_strdup(s->domain);
+		AN(vs->domain);
+	}
+	if (vs->sess != NULL)
+		SSL_SESSION_free(vs->sess);
+	vs->sess = copy;
+	AZ(ODR_pthread_mutex_unlock(&vssl_sess_mtx));
+	/* Keeps the reference if it's not a copy. */
+	return (copy == sess);
+}
+
 void
 VSSL_init(void)
 {
@@ -118,6 +187,10 @@ VSSL_init(void)
 
 	vssl_ctx = SSL_CTX_new(SSLv23_client_method());
 	AN(vssl_ctx);
+	AZ(ODR_pthread_mutex_init(&vssl_sess_mtx, NULL));
+	SSL_CTX_set_session_cache_mode(vssl_ctx,
+	    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(vssl_ctx, vssl_sess_new_cb);
 	vssl_inited = 1;
 }
 
@@ -142,6 +215,7 @@ struct vssl *
 VSSL_new(struct vtclog *vl, int fd, const char *domain)
 {
 	struct vssl *s;
+	struct vssl_sess *vs;
 	char *name;
 
 	if (vssl_ctx == NULL) {
@@ -161,6 +235,9 @@ VSSL_new(struct vtclog *vl, int fd, const char *domain)
 		free(name);
 		return (NULL);
 	}
+	s->domain = ODR_strdup(domain);
+	AN(s->domain);
+	SSL_set_app_data(s->ssl, s);
 	SSL_set_fd(s->ssl, fd);
 #if defined(SSL_set_tlsext_host_name)
 	{
@@ -170,6 +247,11 @@ VSSL_new(struct vtclog *vl, int fd, const char *domain)
 		assert(r == 1);
 	}
 #endif
+	AZ(ODR_pthread_mutex_lock(&vssl_sess_mtx));
+	vs = vssl_sess_find(domain);
+	if (vs != NULL && vs->sess != NULL)
+		(void)SSL_set_session(s->ssl, vs->sess);
+	AZ(ODR_pthread_mutex_unlock(&vssl_sess_mtx));
 	free(name);
 	return (s);
 }
@@ -204,6 +286,8 @@ VSSL_connect(struct vssl *s)
 		ERR_print_errors_fp(stdout);
 		return (-1);
 	}
+	if (SSL_session_reused(s->ssl))
+		vtc_log(s->vl, 4, "TLS session resumed. (%s)", s->domain);
 	return (0);
 }
 
@@ -237,6 +321,17 @@ VSSL_read(struct vssl *s, void *buf, size_t buflen)
 	return (r);
 }
 
+/*
+ * Bytes already decrypted and waiting to be read; select(2) on the socket
+ * doesn't see them.
+ */
+int
+VSSL_pending(struct vssl *s)
+{
+
+	return (SSL_pending(s->ssl));
+}
+
 int
 VSSL_write(struct vssl *s, void *buf, size_t buflen)
 {
@@ -267,10 +362,23 @@ VSSL_write(struct vssl *s, void *buf, size_t buflen)
 	return (r);
 }
 
+/*
+ * Sends close_notify without waiting for the server's.  Only for a
+ * connection without errors: OpenSSL must not be asked to shut down after
+ * a fatal one.
+ */
+void
+VSSL_shutdown(struct vssl *s)
+{
+
+	(void)SSL_shutdown(s->ssl);
+}
+
 void
 VSSL_free(struct vssl *s)
 {
 
 	SSL_free(s->ssl);
+	free(s->domain);
 	free(s);
 }
@@ -32,6 +32,7 @@
 struct vssl {
 	void			*ssl;
 	struct vtclog		*vl;
+	char			*domain;
 };
 
 void	VSSL_init(void);
@@ -39,7 +40,9 @@ struct vssl *
 	VSSL_new(struct vtclog *vl, int fd, const char *domain);
 int	VSSL_connect(struct vssl *s);
 int	VSSL_read(struct vssl *s, void *buf, size_t buflen);
+int	VSSL_pending(struct vssl *s);
 int	VSSL_write(struct vssl *s, void *buf, size_t buflen);
+void	VSSL_shutdown(struct vssl *s);
 void	VSSL_free(struct vssl *s);
 
 #endif
@@ -0,0 +1,168 @@
+#!/usr/bin/python3
+
+#
+# A stand-in for the config endpoint of www.mud.band (POST /api/band/conf)
+# to exercise the config delta path of the client without the real server.
+#
+#   openssl req -x509 -newkey rsa:2048 -nodes -days 30 \
+#       -subj /CN=www.mud.band -keyout key.pem -out cert.pem
+#   echo "127.0.0.1 www.mud.band" >> /etc/hosts
+#   tools/confsrv.py -c cert.pem -k key.pem [-f fault] conf1.json conf2.json
+#
+# Each file is a "conf" object as the server returns it, e.g. a copy of
+# conf_<uuid>.json.  A client without a config gets the first file and
+# each fetch after that moves it on to the file after the one its etag
+# names, so it walks through the files one by one.  Once it has the last
+# one it gets 304.  If the client sends a "delta_etag" the answer is a
+# "delta" against that version: peers_remove, peers_modify and peers_add
+# keyed by wireguard_pubkey, plus "interface" and "acl" if they changed.
+#
+# -f breaks every delta so that the client has to log BANDEC_00915 and
+# fetch the full config again:
+#
+#   etag        base_etag names a version the client doesn't have
+#   unknown     peers_modify carries a peer the base doesn't have
+#   known       peers_add carries a peer the base already has
+#
+
+import getopt
+import gzip
+import hashlib
+import http.server
+import json
+import ssl
+import sys
+
+confs = []
+etags = []
+fault = None
+
+def usage():
+    print("Usage: %s -c cert -k key [-p port] [-f etag|unknown|known]"
+          " conf.json ..." % sys.argv[0])
+    sys.exit(1)
+
+def confEtag(conf):
+    body = json.dumps(conf, sort_keys=True).encode()
+    return hashlib.sha1(body).hexdigest()
+
+def peerMap(conf):
+    peers = {}
+    for peer in conf.get("peers", []):
+        peers[peer["wireguard_pubkey"]] = peer
+    return peers
+
+def confDelta(base, base_etag, conf):
+    old = peerMap(base)
+    new = peerMap(conf)
+    delta = {
+        "base_etag": base_etag,
+        "peers_remove": [ k for k in old if k not in new ],
+        "peers_modify": [ new[k] for k in new
+                          if k in old and new[k] != old[k] ],
+        "peers_add": [ new[k] for k in new if k not in old ],
+    }
+    for key in [ "interface", "acl" ]:
+        if key in conf and conf.get(key) != base.get(key):
+            delta[key] = conf[key]
+    if fault == "etag":
+        delta["base_etag"] = "0" * 40
+    elif fault == "unknown":
+        peer = dict(conf["peers"][0]) if conf.get("peers") else {}
+        peer["wireguard_pubkey"] = "confsrv-unknown-peer"
+        delta["peers_modify"].append(peer)
+    elif fault == "known":
+        kept = [ k for k in old if k in new ]
+        if kept:
+            delta["peers_add"].append(old[kept[0]])
+    return delta
+
+class ConfHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def reply(self, status, body=None):
+        self.send_response(status)
+        if body is None:
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        data = json.dumps(body).encode()
+        if "gzip" in self.headers.get("Accept-Encoding", ""):
+            data = gzip.compress(data)
+            self.send_header("Content-Encoding", "gzip")
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        if self.cur is not None:
+            self.send_header("mudband-etag", etags[self.cur])
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_POST(self):
+        self.cur = None
+        length = int(self.headers.get("Content-Length", "0"))
+        body = self.rfile.read(length)
+        if self.path != "/api/band/conf":
+            self.reply(404, { "status": 404, "msg": "Not found" })
+            return
+        req = json.loads(body or b"{}")
+        have = self.headers.get("If-None-Match")
+        if have == etags[-1]:
+            self.log_message("version %d: not modified", len(etags) - 1)
+            self.reply(304)
+            return
+        self.cur = 0
+        if have in etags:
+            self.cur = etags.index(have) + 1
+        base_etag = req.get("delta_etag")
+        if base_etag in etags:
+            base = etags.index(base_etag)
+            delta = confDelta(confs[base], base_etag, confs[self.cur])
+            self.log_message("version %d: delta against %d (remove %d"
+                             " modify %d add %d)", self.cur, base,
+                             len(delta["peers_remove"]),
+                             len(delta["peers_modify"]),
+                             len(delta["peers_add"]))
+            self.reply(200, { "status": 200, "delta": delta })
+            return
+        self.log_message("version %d: full config", self.cur)
+        self.reply(200, { "status": 200, "conf": confs[self.cur] })
+
+def main():
+    global fault
+
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], "c:f:k:p:")
+    except getopt.GetoptError as err:
+        print(str(err))
+        usage()
+    cert = None
+    key = None
+    port = 443
+    for o, a in opts:
+        if o == "-c":
+            cert = a
+        elif o == "-f":
+            if a not in [ "etag", "unknown", "known" ]:
+                usage()
+            fault = a
+        elif o == "-k":
+            key = a
+        elif o == "-p":
+            port = int(a)
+    if cert is None or key is None or len(args) == 0:
+        usage()
+    for path in args:
+        fp = open(path, "r")
+        conf = json.load(fp)
+        fp.close()
+        conf.pop("etag", None)
+        confs.append(conf)
+        etags.append(confEtag(conf))
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    ctx.load_cert_chain(cert, key)
+    srv = http.server.ThreadingHTTPServer(("", port), ConfHandler)
+    srv.socket = ctx.wrap_socket(srv.socket, server_side=True)
+    srv.serve_forever()
+
+if __name__ == "__main__":
+    main()